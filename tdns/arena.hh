@@ -0,0 +1,127 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <vector>
+
+/*!
+   @file
+   @brief A simple arena allocator, in which a zone can keep its nodes and records
+
+   Building a zone from an AXFR creates a node, an RRSet and a record object
+   for each record, and each of those used to be a separate heap allocation.
+   An Arena instead hands out memory from large blocks, and never gives any
+   back until it is destroyed, at which point everything goes in one go.
+
+   Memory is taken from the Arena that is current on this thread, as set by
+   ArenaScope. Standard containers do this through ArenaAllocator, which
+   remembers the Arena that was current when the container was created, and
+   record objects through RRGen::operator new.
+*/
+
+class Arena
+{
+public:
+  Arena() {}
+  Arena(const Arena&) = delete;
+  Arena& operator=(const Arena&) = delete;
+  ~Arena()
+  {
+    for(auto b : d_blocks)
+      free(b);
+  }
+
+  void* allocate(size_t size, size_t align = alignof(std::max_align_t))
+  {
+    char* p = (char*)(((uintptr_t)d_pos + align - 1) & ~(uintptr_t)(align - 1));
+    if(!d_pos || p + size > d_end) {
+      newBlock(size + align);
+      p = (char*)(((uintptr_t)d_pos + align - 1) & ~(uintptr_t)(align - 1));
+    }
+    d_pos = p + size;
+    d_used += size;
+    return p;
+  }
+
+  size_t used() const { return d_used; }          //!< bytes handed out
+  size_t reserved() const { return d_reserved; }  //!< bytes in blocks
+  //! Notes how much is handed out now, so a user can tell how much it took since
+  void mark() { d_marked = d_used; }
+  size_t marked() const { return d_marked; }      //!< used() at the last mark()
+
+  //! The Arena new zone objects on this thread come from, nullptr for the heap
+  static Arena*& current()
+  {
+    static thread_local Arena* s_current;
+    return s_current;
+  }
+
+private:
+  void newBlock(size_t atleast)
+  {
+    size_t size = atleast > blockSize ? atleast : blockSize;
+    char* b = (char*)malloc(size);
+    if(!b)
+      throw std::bad_alloc();
+    d_blocks.push_back(b);
+    d_pos = b;
+    d_end = b + size;
+    d_reserved += size;
+  }
+
+  static constexpr size_t blockSize = 256 * 1024;
+  std::vector<char*> d_blocks;
+  char* d_pos{nullptr};
+  char* d_end{nullptr};
+  size_t d_used{0}, d_reserved{0}, d_marked{0};
+};
+
+//! While this exists, Arena::current() is 'arena'
+class ArenaScope
+{
+public:
+  explicit ArenaScope(Arena* arena) : d_prev(Arena::current())
+  {
+    Arena::current() = arena;
+  }
+  ~ArenaScope()
+  {
+    Arena::current() = d_prev;
+  }
+  ArenaScope(const ArenaScope&) = delete;
+  ArenaScope& operator=(const ArenaScope&) = delete;
+private:
+  Arena* d_prev;
+};
+
+//! For standard containers, allocates from the Arena that was current when it was made, or from the heap
+template<typename T>
+class ArenaAllocator
+{
+public:
+  typedef T value_type;
+  // a container that takes over the contents of another also takes the Arena they are in
+  typedef std::true_type propagate_on_container_move_assignment;
+  typedef std::true_type propagate_on_container_swap;
+  ArenaAllocator() : d_arena(Arena::current()) {}
+  explicit ArenaAllocator(Arena* arena) : d_arena(arena) {}
+  template<typename U> ArenaAllocator(const ArenaAllocator<U>& rhs) : d_arena(rhs.d_arena) {}
+
+  T* allocate(size_t n)
+  {
+    if(d_arena)
+      return (T*)d_arena->allocate(n * sizeof(T), alignof(T));
+    return std::allocator<T>().allocate(n);
+  }
+  void deallocate(T* p, size_t n)
+  {
+    if(!d_arena) // arena memory goes when the arena goes
+      std::allocator<T>().deallocate(p, n);
+  }
+  template<typename U> bool operator==(const ArenaAllocator<U>& rhs) const { return d_arena == rhs.d_arena; }
+  template<typename U> bool operator!=(const ArenaAllocator<U>& rhs) const { return d_arena != rhs.d_arena; }
+
+  Arena* d_arena;
+};
@@ -75,7 +75,7 @@ void loadZones(DNSNode& zones)
   for(auto& a: addresses) {
     try {
       a.sin4.sin_port = htons(53);
-      zones.add({})->zone=retrieveZone(a, {});
+      addRemoteZone(zones, a, {});
       break;
     }
     catch(std::exception& e) {
@@ -83,9 +83,9 @@ void loadZones(DNSNode& zones)
     }
   }
 
-  zones.add({"hubertnet", "nl"})->zone=retrieveZone(ComboAddress("52.48.64.3", 53), {"hubertnet", "nl"});
-  zones.add({"ds9a", "nl"})->zone=retrieveZone(ComboAddress("52.48.64.3", 53), {"ds9a", "nl"});
-  zones.add({"powerdns", "org"})->zone=retrieveZone(ComboAddress("52.48.64.3", 53), {"powerdns", "org"});
+  addRemoteZone(zones, ComboAddress("52.48.64.3", 53), {"hubertnet", "nl"});
+  addRemoteZone(zones, ComboAddress("52.48.64.3", 53), {"ds9a", "nl"});
+  addRemoteZone(zones, ComboAddress("52.48.64.3", 53), {"powerdns", "org"});
 }
 
 void reportQuery(DNSName qname, DNSClass qclass, DNSType qtype, const ComboAddress& remote)
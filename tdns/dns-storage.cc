@@ -1,83 +1,405 @@
 #include "dns-storage.hh"
 #include "record-types.hh"
+#include "zone-image.hh"
+#include "radix-index.hh"
 #include <iomanip>
+#include <mutex>
+#include <random>
+#include <unordered_map>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 using namespace std;
 
-//! Makes us relative to 'root', returns false if we weren't part of root
-bool DNSName::makeRelative(const DNSName& root)
+static inline uint8_t dnsFold(uint8_t c)
 {
-  auto us = d_name, them=root.d_name;
-  while(!them.empty()) {
-    if(us.empty())
-      return false;
-    if(us.back() == them.back()) {
-      us.pop_back();
-      them.pop_back();
+  return (c >= 'A' && c <= 'Z') ? c + 0x20 : c;
+}
+
+//! DNS case insensitivity: only A-Z fold to a-z, nothing else. Length bytes (<64) are not touched
+int dnsFoldCompare(const uint8_t* a, const uint8_t* b, size_t len)
+{
+  size_t n = 0;
+#ifdef __SSE2__
+  // 16 bytes at a time: shift A-Z to the bottom of the signed range so a single compare finds them,
+  // then OR in 0x20 to lowercase only those
+  const __m128i shift = _mm_set1_epi8((char)(0x80 - 'A'));
+  const __m128i upper = _mm_set1_epi8((char)(0x80 + 26));
+  const __m128i bit = _mm_set1_epi8(0x20);
+  for(; n + 16 <= len; n += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i*)(a + n));
+    __m128i y = _mm_loadu_si128((const __m128i*)(b + n));
+    x = _mm_or_si128(x, _mm_and_si128(_mm_cmplt_epi8(_mm_add_epi8(x, shift), upper), bit));
+    y = _mm_or_si128(y, _mm_and_si128(_mm_cmplt_epi8(_mm_add_epi8(y, shift), upper), bit));
+    unsigned int diff = ~_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) & 0xffff;
+    if(diff) {
+      n += __builtin_ctz(diff);
+      return (int)dnsFold(a[n]) - (int)dnsFold(b[n]);
     }
-    else
-      return false;
   }
-  d_name = us;
+#endif
+  for(; n < len; ++n) {
+    if(a[n] != b[n] && dnsFold(a[n]) != dnsFold(b[n]))
+      return (int)dnsFold(a[n]) - (int)dnsFold(b[n]);
+  }
+  return 0;
+}
+
+void DNSName::push_back(const void* label, size_t len)
+{
+  if(!len)
+    throw std::runtime_error("Empty label in DNSName");
+  if(len > 63)
+    throw std::out_of_range("label too long");
+  if(d_len + 1 + len > maxLength - 1)
+    throw std::out_of_range("name too long");
+  d_storage[d_len] = len;
+  memcpy(d_storage + d_len + 1, label, len);
+  d_len += 1 + len;
+  ++d_count;
+}
+
+void DNSName::push_front(const DNSLabel& l)
+{
+  auto len = l.size();
+  if(!len)
+    throw std::runtime_error("Empty label in DNSName");
+  if(d_len + 1 + len > maxLength - 1)
+    throw std::out_of_range("name too long");
+  memmove(d_storage + 1 + len, d_storage, d_len);
+  d_storage[0] = len;
+  memcpy(d_storage + 1, l.d_s.c_str(), len);
+  d_len += 1 + len;
+  ++d_count;
+}
+
+void DNSName::pop_front()
+{
+  auto skip = 1 + d_storage[0];
+  memmove(d_storage, d_storage + skip, d_len - skip);
+  d_len -= skip;
+  --d_count;
+}
+
+//! Labels only know their length, so to go back we walk from the start
+uint8_t DNSName::prevLabel(uint8_t pos) const
+{
+  uint8_t prev = 0;
+  for(uint8_t n = 0; n < pos; n += 1 + d_storage[n])
+    prev = n;
+  return prev;
+}
+
+//! Returns the offset where root starts within us, or string::npos if we are not part of root
+size_t DNSName::suffixPos(const DNSName& root) const
+{
+  if(root.d_len > d_len)
+    return string::npos;
+  size_t pos = 0;
+  while(d_len - pos > root.d_len)  // skip labels until what remains is as long as root
+    pos += 1 + d_storage[pos];
+  if(d_len - pos != root.d_len || dnsFoldCompare(d_storage + pos, root.d_storage, root.d_len))
+    return string::npos;
+  return pos;
+}
+
+//! Makes us relative to 'root', returns false if we weren't part of root
+bool DNSName::makeRelative(const DNSName& root)
+{
+  auto pos = suffixPos(root);
+  if(pos == string::npos)
+    return false;
+  d_len = pos;
+  d_count -= root.d_count;
   return true;
 }
 
 //! Checks is this DNSName is part of root
 bool DNSName::isPartOf(const DNSName& root) const
 {
-  auto them = root.d_name.crbegin(), us = d_name.crbegin();
-  for(;;) {
-    if(them == root.d_name.crend())
-      return true;
-    if(us == d_name.crend())
-      return false;
-    
-    if(*them == *us) {
-      ++them;
-      ++us;
-    }
-    else
-      break;
+  return suffixPos(root) != string::npos;
+}
+
+bool DNSName::operator==(const DNSName& rhs) const
+{
+  return d_len == rhs.d_len && !dnsFoldCompare(d_storage, rhs.d_storage, d_len);
+}
+
+int DNSName::compare(const DNSName& rhs) const
+{
+  uint8_t us = 0, them = 0;
+  for(; us < d_len && them < rhs.d_len; us += 1 + d_storage[us], them += 1 + rhs.d_storage[them]) {
+    uint8_t ourlen = d_storage[us], theirlen = rhs.d_storage[them];
+    if(int ret = dnsFoldCompare(d_storage + us + 1, rhs.d_storage + them + 1, std::min(ourlen, theirlen)))
+      return ret;
+    if(ourlen != theirlen)
+      return (int)ourlen - (int)theirlen;
   }
-  return false;
+  return (int)(us < d_len) - (int)(them < rhs.d_len);
 }
 
+DNSName& DNSName::operator+=(const DNSName& rhs)
+{
+  if(d_len + rhs.d_len > maxLength - 1)
+    throw std::out_of_range("name too long");
+  memcpy(d_storage + d_len, rhs.d_storage, rhs.d_len);
+  d_len += rhs.d_len;
+  d_count += rhs.d_count;
+  return *this;
+}
 
 //! Append two DNSNames
 DNSName operator+(const DNSName& a, const DNSName& b)
 {
   DNSName ret=a;
-  for(const auto& l : b.d_name)
-    ret.d_name.push_back(l);
+  ret += b;
   return ret;
 }
 
-//! This function is plain wrong and does unescape its input XXX
+//! DNSName::parse() for a string, escapes and all
 DNSName makeDNSName(const std::string& str)
+{
+  return DNSName::parse(str.c_str(), str.size());
+}
+
+//! The first '.' or '\\' from p on, or end. Looks at 16 or 8 bytes at a time
+static const char* findDotOrEscape(const char* p, const char* end)
+{
+#ifdef __SSE2__
+  const __m128i dot = _mm_set1_epi8('.'), backslash = _mm_set1_epi8('\\');
+  for(; end - p >= 16; p += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i*)p);
+    if(int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(x, dot), _mm_cmpeq_epi8(x, backslash))))
+      return p + __builtin_ctz(mask);
+  }
+#else
+  // a byte of w ^ c is zero where w has c, and (x - 0x01..) & ~x & 0x80.. is non-zero if x has a zero byte
+  const uint64_t ones = 0x0101010101010101ULL, highs = 0x8080808080808080ULL;
+  for(; end - p >= 8; p += 8) {
+    uint64_t w, d, b;
+    memcpy(&w, p, sizeof(w));
+    d = w ^ (ones * '.');
+    b = w ^ (ones * '\\');
+    if(((d - ones) & ~d & highs) || ((b - ones) & ~b & highs))
+      break; // it is in these 8 bytes
+  }
+#endif
+  while(p != end && *p != '.' && *p != '\\')
+    ++p;
+  return p;
+}
+
+uint64_t DNSNameHash::defaultSeed()
+{
+  static const uint64_t seed = ((uint64_t)std::random_device()() << 32) | std::random_device()();
+  return seed;
+}
+
+//! Lowercases the A-Z among 8 bytes at once, each byte is looked at without its top bit and skipped if it has one
+static inline uint64_t dnsFold8(uint64_t w)
+{
+  const uint64_t ones = 0x0101010101010101ULL, highs = 0x8080808080808080ULL;
+  uint64_t low = w & ~highs;
+  uint64_t atLeastA = low + ones * (0x80 - 'A');   // top bit set where the byte is >= 'A'
+  uint64_t aboveZ = low + ones * (0x80 - 'Z' - 1); // and where it is > 'Z'
+  return w | ((atLeastA & ~aboveZ & ~w & highs) >> 2);
+}
+
+//! Every input bit ends up affecting the low bits, which is what tables index with
+static inline uint64_t hashMix(uint64_t h)
+{
+  h ^= h >> 32;
+  h *= 0xff51afd7ed558ccdULL;
+  return h ^ (h >> 29);
+}
+
+uint64_t DNSNameHash::extend(uint64_t hash, const uint8_t* label, size_t len) const
+{
+  uint64_t h = hashMix(hash ^ (len + 1) ^ d_seed); // the length keeps "a" "b" apart from "ab"
+  uint64_t w;
+  for(; len >= 8; len -= 8, label += 8) {
+    memcpy(&w, label, 8);
+    h = hashMix(h ^ dnsFold8(w));
+  }
+  if(len) { // the rest, without a memcpy call for a length the compiler does not know
+    w = 0;
+    for(size_t n = 0; n < len; ++n)
+      w |= (uint64_t)label[n] << (8 * n);
+    h = hashMix(h ^ dnsFold8(w));
+  }
+  return h;
+}
+
+size_t DNSNameHash::operator()(const DNSName& name) const
+{
+  // find the labels front to back, stepping back from the end would rescan the name every time
+  uint8_t pos[DNSName::maxLength / 2];
+  unsigned int count = 0;
+  auto data = name.data();
+  for(size_t n = 0; n < name.wireLength(); n += 1 + data[n])
+    pos[count++] = n;
+  uint64_t h = d_seed;
+  while(count--)
+    h = extend(h, data + pos[count] + 1, data[pos[count]]);
+  return h;
+}
+
+/* Copies runs of plain characters straight into d_storage, and fills in the length byte
+   in front of each label once we know where it ends */
+DNSName DNSName::parse(const char* str, size_t len)
 {
   DNSName ret;
-  if(str==".")
+  const char* p = str;
+  const char* end = str + len;
+  if(len == 1 && *p == '.')
     return ret;
 
-  string part;
-  for(const auto& c: str) {
-    if(c=='.') {
-      ret.push_back(part);
-      part.clear();
+  size_t start = 0, pos = 1; // where the length byte of the current label goes, and where its next byte goes
+  auto endLabel = [&]() {
+    auto llen = pos - start - 1;
+    if(!llen)
+      throw std::runtime_error("Empty label in DNSName");
+    if(llen > 63)
+      throw std::out_of_range("label too long");
+    ret.d_storage[start] = llen;
+    ++ret.d_count;
+    start = pos++;
+  };
+  while(p != end) {
+    auto special = findDotOrEscape(p, end);
+    if(pos + (special - p) > maxLength - 1)
+      throw std::out_of_range("name too long");
+    memcpy(ret.d_storage + pos, p, special - p);
+    pos += special - p;
+    p = special;
+    if(p == end)
+      break;
+    if(*p++ == '.') {
+      endLabel();
+      continue;
+    }
+    if(p == end)
+      throw std::runtime_error("Escape at the end of name '"+string(str, len)+"'");
+    uint8_t c = *p++;
+    if(c >= '0' && c <= '9') { // \DDD, always three digits
+      if(end - p < 2 || p[0] < '0' || p[0] > '9' || p[1] < '0' || p[1] > '9')
+        throw std::runtime_error("Bad \\DDD escape in name '"+string(str, len)+"'");
+      unsigned int val = (c - '0') * 100 + (p[0] - '0') * 10 + (p[1] - '0');
+      if(val > 255)
+        throw std::runtime_error("Bad \\DDD escape in name '"+string(str, len)+"'");
+      c = val;
+      p += 2;
     }
-    else part.append(1, c);
+    if(pos + 1 > maxLength - 1)
+      throw std::out_of_range("name too long");
+    ret.d_storage[pos++] = c;
   }
-  if(!part.empty())
-    ret.push_back(part);
+  if(pos > start + 1) // the last label, if there was no dot after it
+    endLabel();
+  ret.d_len = start;
   return ret;
 }
 
+/* The intern table maps the wire format of a name, case and all, to the one instance we
+   have of it. The entries are weak, the deleter of the last InternedName removes them. */
+namespace {
+struct InternTable
+{
+  std::mutex lock;
+  std::unordered_map<std::string, std::weak_ptr<const DNSName>> names;
+};
+}
+
+static InternTable& getInternTable()
+{
+  static InternTable* table = new InternTable(); // never destroyed, names may outlive static destruction
+  return *table;
+}
+
+static std::string internKey(const DNSName& name)
+{
+  return std::string((const char*)name.data(), name.wireLength());
+}
+
+void InternedName::intern()
+{
+  auto& table = getInternTable();
+  auto key = internKey(*d_name);
+  auto own = std::move(d_name); // let go of it outside the lock, it may be an interned one
+  std::lock_guard<std::mutex> l(table.lock);
+  auto& entry = table.names[key];
+  d_name = entry.lock();
+  if(d_name)
+    return;
+  d_name = std::shared_ptr<const DNSName>(new DNSName(*own), [](const DNSName* dn) {
+      auto& table = getInternTable();
+      {
+        std::lock_guard<std::mutex> l(table.lock);
+        auto iter = table.names.find(internKey(*dn));
+        if(iter != table.names.end() && iter->second.expired()) // it may have been interned again already
+          table.names.erase(iter);
+      }
+      delete dn;
+    });
+  entry = d_name;
+}
+
+InternedName::InternedName()
+{
+  static const InternedName root{DNSName()};
+  d_name = root.d_name;
+}
 
+InternedName::Stats InternedName::stats()
+{
+  auto& table = getInternTable();
+  Stats ret;
+  std::lock_guard<std::mutex> l(table.lock);
+  for(const auto& e : table.names) {
+    ++ret.names;
+    ret.references += e.second.use_count();
+    // the name, its control block, and the hash node with its key
+    ret.bytes += sizeof(DNSName) + 32 + sizeof(e) + 2 * sizeof(void*) + (e.first.capacity() > 15 ? e.first.capacity() + 1 : 0);
+  }
+  ret.bytes += table.names.bucket_count() * sizeof(void*);
+  return ret;
+}
+
+std::ostream & operator<<(std::ostream &os, const InternedName& d)
+{
+  return os << d.get();
+}
+
+DNSNode::DNSNode() = default;
+DNSNode::DNSNode(const DNSLabel& lab, DNSNode* parent) : d_name(lab), d_parent(parent) {}
 DNSNode::~DNSNode() = default;
 RRGen::~RRGen() = default;
 
+/* In front of each record, we note the Arena it came from, so operator delete
+   knows if it has to free it. alignof(RRGen) is 8, so 8 bytes keep alignment */
+void* RRGen::operator new(size_t size)
+{
+  Arena* arena = Arena::current();
+  void* p = arena ? arena->allocate(size + 8, 8) : ::operator new(size + 8);
+  *(Arena**)p = arena;
+  return (char*)p + 8;
+}
+
+void RRGen::operator delete(void* p)
+{
+  if(!p)
+    return;
+  char* start = (char*)p - 8;
+  if(!*(Arena**)start)
+    ::operator delete(start);
+}
+
 //! The big RFC 1034-compatible find function. Will perform wildcard synth if requested & let you know about it
 const DNSNode* DNSNode::find(DNSName& name, DNSName& last, bool wildcard, const DNSNode** passedZonecut, const DNSNode** passedwcard) const
 {
+  if(d_radix)
+    return d_radix->find(name, last, wildcard, passedZonecut, passedwcard);
+
   if(!last.empty() && rrsets.count(DNSType::NS)) {
     if(passedZonecut)  *passedZonecut=this;
   }
@@ -85,18 +407,18 @@ const DNSNode* DNSNode::find(DNSName& name, DNSName& last, bool wildcard, const
   if(name.empty()) {
     return this;
   }
-  auto iter = children.find(name.back());
+  auto iter = findChild(name.back());
 
-  if(iter == children.end()) {
+  if(!iter) {
     if(!wildcard)
       return this;
 
-    iter = children.find(DNSLabel("*"));
-    if(iter == children.end()) { // also no wildcard
+    iter = findChild(DNSLabel("*"));
+    if(!iter) { // also no wildcard
       return this;
     }
     else {  //  Had wildcard match, picking that, matching all labels
-      if(passedwcard) *passedwcard = &*iter;
+      if(passedwcard) *passedwcard = iter;
       
       while(name.size() > 1) {
         last.push_front(name.back());
@@ -116,8 +438,313 @@ DNSNode* DNSNode::add(DNSName name)
   if(name.empty()) return this;
   auto back = name.back();
   name.pop_back();
-  children.emplace(back, this);
-  return const_cast<DNSNode&>(*children.find(back)).add(name); // sorry
+  // look first, emplace would build a node only to throw it away if we have it already
+  auto iter = children.lower_bound(back);
+  if(iter == children.end() || !(iter->d_name == back)) {
+    iter = children.emplace_hint(iter, back, this);
+    d_index.clear(); // new child, so our index is out of date
+    dropIndexes();
+  }
+  return const_cast<DNSNode&>(*iter).add(name); // sorry
+}
+
+const DNSNode* DNSNode::findChild(const DNSLabel& label) const
+{
+  if(d_index.d_kind != ChildIndex::Kind::None) {
+    auto pos = d_index.position(label);
+    return pos < 0 ? nullptr : d_index.d_sorted[pos];
+  }
+  auto iter = children.find(label);
+  return iter == children.end() ? nullptr : &*iter;
+}
+
+void DNSNode::freeze(FindEngine engine)
+{
+  freezeNodes(engine);
+  if(engine == FindEngine::Radix) // one for the whole tree, our children don't need their own
+    d_radix = std::make_unique<RadixIndex>(*this);
+}
+
+void DNSNode::freezeNodes(FindEngine engine)
+{
+  d_index.build(children);
+  for(auto& rrs : rrsets)
+    rrs.second.intern();
+  for(auto& c : children)
+    const_cast<DNSNode&>(c).freezeNodes(engine);
+  if(zone) {
+    zone->freeze(engine);
+    zone->d_exact = std::make_unique<ExactIndex>(*zone);
+  }
+}
+
+ExactIndex::ExactIndex(const DNSNode& apex) : d_apex(&apex)
+{
+  std::vector<std::pair<uint32_t, const DNSNode*>> nodes;
+  collect(apex, hashStart, nodes);
+  size_t size = 1;
+  while(size < 2 * nodes.size())
+    size *= 2;
+  fill(nodes, size);
+}
+
+//! Empties the table, makes it 'size' slots, and adds 'nodes' to it
+void ExactIndex::fill(const std::vector<std::pair<uint32_t, const DNSNode*>>& nodes, size_t size)
+{
+  d_table.assign(size, Slot{0, nullptr});
+  d_count = nodes.size();
+  for(const auto& n : nodes) {
+    auto slot = n.first & (size - 1);
+    while(d_table[slot].node)
+      slot = (slot + 1) & (size - 1);
+    d_table[slot] = Slot{n.first, n.second};
+  }
+}
+
+uint32_t ExactIndex::hashOf(const DNSNode& node) const
+{
+  std::vector<const DNSLabel*> labels;
+  for(auto us = &node; us != d_apex; us = us->d_parent)
+    labels.push_back(&us->d_name);
+  uint32_t hash = hashStart;
+  for(auto iter = labels.rbegin(); iter != labels.rend(); ++iter)
+    hash = ExactIndex::hash(hash, **iter);
+  return hash;
+}
+
+void ExactIndex::insertTree(const DNSNode& node)
+{
+  for(auto us = &node; us != d_apex; us = us->d_parent)
+    if(us->rrsets.count(DNSType::NS))
+      return;
+  std::vector<std::pair<uint32_t, const DNSNode*>> nodes;
+  collect(node, hashOf(node), nodes);
+  if(2 * (d_count + nodes.size()) > d_table.size()) { // grow, and put back what we have
+    size_t size = d_table.size();
+    while(size < 2 * (d_count + nodes.size()))
+      size *= 2;
+    for(const auto& s : d_table)
+      if(s.node)
+        nodes.push_back({s.hash, s.node});
+    fill(nodes, size);
+    return;
+  }
+  d_count += nodes.size();
+  auto mask = d_table.size() - 1;
+  for(const auto& n : nodes) {
+    auto slot = n.first & mask;
+    while(d_table[slot].node)
+      slot = (slot + 1) & mask;
+    d_table[slot] = Slot{n.first, n.second};
+  }
+}
+
+void ExactIndex::eraseTree(const DNSNode& node)
+{
+  erase(node);
+  for(const auto& c : node.children)
+    eraseTree(c);
+}
+
+//! Removes 'node', and moves back the slots after it that would otherwise no longer be found
+void ExactIndex::erase(const DNSNode& node)
+{
+  auto mask = d_table.size() - 1;
+  auto slot = hashOf(node) & mask;
+  for(; d_table[slot].node != &node; slot = (slot + 1) & mask)
+    if(!d_table[slot].node)
+      return;
+  for(auto next = (slot + 1) & mask; d_table[next].node; next = (next + 1) & mask) {
+    auto home = d_table[next].hash & mask;
+    // can it stay where it is? Only if its home is after the hole, up to where it is now
+    if(slot <= next ? (slot < home && home <= next) : (slot < home || home <= next))
+      continue;
+    d_table[slot] = d_table[next];
+    slot = next;
+  }
+  d_table[slot] = Slot{0, nullptr};
+  --d_count;
+}
+
+//! Everything below the apex, except zone cuts and what is below them
+void ExactIndex::collect(const DNSNode& node, uint32_t hash, std::vector<std::pair<uint32_t, const DNSNode*>>& nodes)
+{
+  nodes.push_back({hash, &node});
+  for(const auto& c : node.children) {
+    if(!c.rrsets.count(DNSType::NS))
+      collect(c, ExactIndex::hash(hash, c.d_name), nodes);
+  }
+}
+
+uint32_t ExactIndex::hash(uint32_t hash, const DNSLabel& label)
+{
+  hash = (hash ^ (uint8_t)label.d_folded.size()) * 16777619U;
+  for(uint8_t c : label.d_folded)
+    hash = (hash ^ c) * 16777619U;
+  return hash;
+}
+
+uint32_t ExactIndex::hash(const DNSName& name)
+{
+  uint32_t hash = hashStart;
+  for(auto iter = name.end(); iter != name.begin(); ) {
+    --iter;
+    hash = (hash ^ iter.size()) * 16777619U;
+    auto data = (const uint8_t*)iter.data();
+    for(uint8_t n = 0; n < iter.size(); ++n)
+      hash = (hash ^ dnsFold(data[n])) * 16777619U;
+  }
+  return hash;
+}
+
+const DNSNode* ExactIndex::find(const DNSName& name) const
+{
+  auto hash = ExactIndex::hash(name);
+  auto mask = d_table.size() - 1;
+  for(auto slot = hash & mask; d_table[slot].node; slot = (slot + 1) & mask) {
+    if(d_table[slot].hash != hash)
+      continue;
+    // check the labels, from the first one in 'name' and the node up to the apex
+    const DNSNode* node = d_table[slot].node;
+    auto iter = name.begin();
+    for(; iter != name.end() && node != d_apex; ++iter, node = node->d_parent) {
+      const auto& folded = node->d_name.d_folded;
+      if(folded.size() != iter.size() || dnsFoldCompare((const uint8_t*)folded.c_str(), (const uint8_t*)iter.data(), folded.size()))
+        break;
+    }
+    if(iter == name.end() && node == d_apex)
+      return d_table[slot].node;
+  }
+  return nullptr;
+}
+
+void DNSNode::dropIndexes()
+{
+  for(auto us = this; us; us = us->d_parent) {
+    us->d_radix.reset();
+    us->d_exact.reset();
+  }
+}
+
+//! FNV-1a over the lowercased label
+uint32_t DNSNode::ChildIndex::hash(const DNSLabel& label)
+{
+  uint32_t hash = 2166136261U;
+  for(uint8_t c : label.d_folded)
+    hash = (hash ^ c) * 16777619U;
+  return hash;
+}
+
+void DNSNode::ChildIndex::build(const children_t& children)
+{
+  clear();
+  if(children.empty())
+    return;
+  d_sorted.reserve(children.size());
+  for(const auto& c : children) {
+    const_cast<DNSNode&>(c).d_pos = d_sorted.size();
+    d_sorted.push_back(&c);
+  }
+  d_posValid = true;
+  d_kind = Kind::Sorted;
+  if(children.size() >= hashThreshold)
+    buildTable();
+}
+
+void DNSNode::ChildIndex::buildTable()
+{
+  size_t size = 1;
+  while(size < 2 * d_sorted.size())
+    size *= 2;
+  d_table.assign(size, Slot{0, 0});
+  for(uint32_t n = 0; n < d_sorted.size(); ++n) {
+    auto hash = ChildIndex::hash(d_sorted[n]->d_name);
+    auto slot = hash & (size - 1);
+    while(d_table[slot].pos)
+      slot = (slot + 1) & (size - 1);
+    d_table[slot] = Slot{hash, n + 1};
+  }
+  d_kind = Kind::Hashed;
+}
+
+void DNSNode::ChildIndex::clear()
+{
+  d_kind = Kind::None;
+  d_sorted.clear();
+  d_table.clear();
+  d_posValid = false;
+}
+
+/* Neither of these touches the other children, so they cost a move of d_sorted and a pass
+   over d_table. The positions in the table after the change move by one */
+void DNSNode::ChildIndex::insert(const DNSNode& child)
+{
+  auto iter = std::lower_bound(d_sorted.begin(), d_sorted.end(), child.d_name,
+                               [](const DNSNode* a, const DNSLabel& b) { return a->d_name < b; });
+  uint32_t pos = iter - d_sorted.begin();
+  d_sorted.insert(iter, &child);
+  d_posValid = false;
+  if(d_kind == Kind::Hashed && 2 * d_sorted.size() <= d_table.size()) {
+    for(auto& s : d_table) // without a branch, which would be unpredictable
+      s.pos += s.pos > pos;
+    auto hash = ChildIndex::hash(child.d_name);
+    auto mask = d_table.size() - 1;
+    auto slot = hash & mask;
+    while(d_table[slot].pos)
+      slot = (slot + 1) & mask;
+    d_table[slot] = Slot{hash, pos + 1};
+  }
+  else if(d_sorted.size() >= hashThreshold)
+    buildTable();
+}
+
+void DNSNode::ChildIndex::erase(const DNSNode& child)
+{
+  int pos = position(child.d_name);
+  if(pos < 0)
+    return;
+  d_sorted.erase(d_sorted.begin() + pos);
+  d_posValid = false;
+  if(d_sorted.empty()) {
+    clear();
+    return;
+  }
+  if(d_kind != Kind::Hashed)
+    return;
+  // like ExactIndex::erase, move back what would otherwise no longer be found
+  auto mask = d_table.size() - 1;
+  auto slot = hash(child.d_name) & mask;
+  while(d_table[slot].pos != (uint32_t)pos + 1)
+    slot = (slot + 1) & mask;
+  for(auto next = (slot + 1) & mask; d_table[next].pos; next = (next + 1) & mask) {
+    auto home = d_table[next].hash & mask;
+    if(slot <= next ? (slot < home && home <= next) : (slot < home || home <= next))
+      continue;
+    d_table[slot] = d_table[next];
+    slot = next;
+  }
+  d_table[slot] = Slot{0, 0};
+  for(auto& s : d_table)
+    s.pos -= s.pos > (uint32_t)pos + 1;
+}
+
+int DNSNode::ChildIndex::position(const DNSLabel& label) const
+{
+  if(d_kind == Kind::Hashed) {
+    auto hash = ChildIndex::hash(label);
+    auto mask = d_table.size() - 1;
+    for(auto slot = hash & mask; d_table[slot].pos; slot = (slot + 1) & mask) {
+      const auto& s = d_table[slot];
+      if(s.hash == hash && d_sorted[s.pos - 1]->d_name == label)
+        return s.pos - 1;
+    }
+    return -1;
+  }
+  auto iter = std::lower_bound(d_sorted.begin(), d_sorted.end(), label,
+                               [](const DNSNode* a, const DNSLabel& b) { return a->d_name < b; });
+  if(iter == d_sorted.end() || !((*iter)->d_name == label))
+    return -1;
+  return iter - d_sorted.begin();
 }
 
 const DNSNode* DNSNode::next() const
@@ -135,6 +762,14 @@ const DNSNode* DNSNode::next() const
     auto us = this; 
     while(us->d_parent) {
 //      cout<<"Looking for node "<<us->d_name<<" at parent"<<endl;
+      const auto& index = us->d_parent->d_index;
+      if(index.d_kind != ChildIndex::Kind::None) { // frozen, so we know where we are without searching
+        auto pos = index.positionOf(*us);
+        if(pos + 1 < index.d_sorted.size())
+          return index.d_sorted[pos + 1];
+        us = us->d_parent;
+        continue;
+      }
       auto iter=us->d_parent->children.find(*us);
       if(iter == us->d_parent->children.cend()) {
         //        cout<<"Ehm, parent doesn't know about us?"<<endl;
@@ -163,6 +798,14 @@ const DNSNode* DNSNode::prev() const
   
   while(us->d_parent) {
     //  cout<<"Looking for node "<<us->d_name<<" at parent"<<endl;
+    const auto& index = us->d_parent->d_index;
+    if(index.d_kind != ChildIndex::Kind::None) {
+      auto pos = index.positionOf(*us);
+      if(pos > 0)
+        return index.d_sorted[pos - 1];
+      us = us->d_parent;
+      continue;
+    }
     auto iter=us->d_parent->children.find(*us);
     if(iter != us->d_parent->children.cbegin()) {
       //cout<<"Found that at parent node, returning the one left it"<<endl;
@@ -177,9 +820,124 @@ const DNSNode* DNSNode::prev() const
   return us;
 }
 
+//! The names in a record that can be interned, most records have none
+template<typename T>
+static void internNames(T&) {}
+static void internNames(NSGen& gen) { gen.d_name.intern(); }
+static void internNames(MXGen& gen) { gen.d_name.intern(); }
+static void internNames(CNAMEGen& gen) { gen.d_name.intern(); }
+static void internNames(PTRGen& gen) { gen.d_name.intern(); }
+static void internNames(SRVGen& gen) { gen.d_target.intern(); }
+static void internNames(RRSIGGen& gen) { gen.d_signer.intern(); }
+
+void RRSet::intern()
+{
+  for(auto* part : {&contents, &signatures})
+    for(auto& rr : *part)
+      visitRR(*rr, [](auto& gen) { internNames(gen); });
+}
+
+//! What a string has on the heap, libstdc++ keeps up to 15 characters inline
+static size_t heapBytes(const std::string& s)
+{
+  return s.capacity() > 15 ? s.capacity() + 1 : 0;
+}
+
+//! What a generator has on the heap, most have nothing
+template<typename T>
+static size_t heapBytes(const T&)
+{
+  return 0;
+}
+
+static size_t heapBytes(const TXTGen& gen)
+{
+  size_t ret = gen.d_txts.capacity() * sizeof(std::string);
+  for(const auto& txt : gen.d_txts)
+    ret += heapBytes(txt);
+  return ret;
+}
+
+static size_t heapBytes(const NAPTRGen& gen)
+{
+  return heapBytes(gen.d_flags) + heapBytes(gen.d_services) + heapBytes(gen.d_regexp);
+}
+
+static size_t heapBytes(const RRSIGGen& gen) { return heapBytes(gen.d_signature); }
+static size_t heapBytes(const UnknownGen& gen) { return heapBytes(gen.d_rr); }
+static size_t heapBytes(const ClockTXTGen& gen) { return heapBytes(gen.d_format); }
+
+//! The record itself, the Arena pointer in front of it, and what it has on the heap
+static size_t recordBytes(const RRGen& rr)
+{
+  return visitRR(rr, [](const auto& gen) {
+      return 8 + sizeof(gen) + heapBytes(gen);
+    });
+}
+
+MemoryUsage DNSNode::memoryUsage() const
+{
+  MemoryUsage ret;
+  ret.nodes = 1;
+  // a std::set node has a color and three pointers in front of the DNSNode
+  ret.nodeBytes = 32 + sizeof(DNSNode) + d_index.d_sorted.capacity() * sizeof(DNSNode*) +
+    d_index.d_table.capacity() * sizeof(ChildIndex::Slot);
+  ret.labelBytes = heapBytes(d_name.d_s) + heapBytes(d_name.d_folded);
+  for(const auto& rrs : rrsets) {
+    const auto& rrset = rrs.second;
+    ret.rrsetBytes += 32 + sizeof(rrs) + (rrset.contents.capacity() + rrset.signatures.capacity()) * sizeof(std::unique_ptr<RRGen>);
+    for(const auto& rr : rrset.contents) {
+      auto bytes = recordBytes(*rr);
+      ret.rdataBytes += bytes;
+      ret.types[rrs.first] += bytes;
+    }
+    for(const auto& rr : rrset.signatures) {
+      auto bytes = recordBytes(*rr);
+      ret.signatureBytes += bytes;
+      ret.types[rrs.first] += bytes;
+    }
+    ret.records += rrset.contents.size();
+    ret.signatures += rrset.signatures.size();
+  }
+  for(const auto& c : children)
+    ret += c.memoryUsage();
+  return ret;
+}
+
+MemoryUsage& MemoryUsage::operator+=(const MemoryUsage& rhs)
+{
+  nodes += rhs.nodes;
+  records += rhs.records;
+  signatures += rhs.signatures;
+  nodeBytes += rhs.nodeBytes;
+  labelBytes += rhs.labelBytes;
+  rrsetBytes += rhs.rrsetBytes;
+  rdataBytes += rhs.rdataBytes;
+  signatureBytes += rhs.signatureBytes;
+  for(const auto& t : rhs.types)
+    types[t.first] += t.second;
+  return *this;
+}
+
+std::vector<std::string> MemoryUsage::describe() const
+{
+  std::vector<std::string> ret{
+    "total "+std::to_string(total()),
+    "nodes "+std::to_string(nodes)+" using "+std::to_string(nodeBytes),
+    "labels "+std::to_string(labelBytes),
+    "rrsets "+std::to_string(rrsetBytes),
+    "records "+std::to_string(records)+" using "+std::to_string(rdataBytes),
+    "signatures "+std::to_string(signatures)+" using "+std::to_string(signatureBytes)};
+  for(const auto& t : types)
+    ret.push_back(std::string(toString(t.first))+" "+std::to_string(t.second));
+  return ret;
+}
+
 void DNSNode::addRRs(std::unique_ptr<RRGen>&&a)
 {
-  if(auto rrsig = dynamic_cast<RRSIGGen*>(a.get())) {
+  if(a->getType() == DNSType::NS || (rrCast<RRSIGGen>(a) && rrCast<RRSIGGen>(a)->d_type == DNSType::NS))
+    dropIndexes(); // they know where the zone cuts are
+  if(auto rrsig = rrCast<RRSIGGen>(a)) {
     rrsets[rrsig->d_type].add(std::move(a));
   }
   else if(a->getType() == DNSType::CNAME && std::count_if(rrsets.begin(), rrsets.end(), [](const auto& a) { return a.first != DNSType::NSEC; })) {
@@ -212,7 +970,7 @@ std::ostream & operator<<(std::ostream &os, const DNSLabel& d)
 std::ostream & operator<<(std::ostream &os, const DNSName& d)
 {
   if(d.empty()) os<<'.';
-  else for(const auto& l : d.d_name) 
+  else for(const auto& l : d) 
     os<<l<<".";
   return os;
 }
@@ -224,3 +982,202 @@ std::string DNSName::toString() const
   str << *this;
   return str.str();
 }
+
+void DNSNode::apply(const Changeset& changes)
+{
+  if(d_arena && !d_arena->marked())
+    d_arena->mark(); // what loading the zone took
+  ArenaScope scope(d_arena ? d_arena.get() : Arena::current()); // new nodes and records go where the others are
+  bool frozen = d_exact || d_index.d_kind != ChildIndex::Kind::None;
+  d_radix.reset();
+  std::set<DNSNode*> reindex; // nodes that got their first children, we index them at the end
+
+  for(const auto& c : changes.removes) {
+    DNSNode* node = this;
+    for(DNSName name(c.name); node && !name.empty(); name.pop_back())
+      node = const_cast<DNSNode*>(node->findChild(name.back()));
+    if(!node)
+      continue;
+    auto rrsig = rrCast<RRSIGGen>(c.rr);
+    auto iter = node->rrsets.find(rrsig ? rrsig->d_type : c.rr->getType());
+    if(iter == node->rrsets.end())
+      continue;
+    auto& part = rrsig ? iter->second.signatures : iter->second.contents;
+    auto wire = makeWireRData(*c.rr);
+    auto rr = std::find_if(part.begin(), part.end(), [&](const auto& a) { return makeWireRData(*a) == wire; });
+    if(rr == part.end())
+      continue;
+    part.erase(rr);
+    if(!iter->second.contents.empty() || !iter->second.signatures.empty())
+      continue;
+    bool wasCut = iter->first == DNSType::NS && node != this;
+    node->rrsets.erase(iter);
+    if(wasCut && d_exact)
+      d_exact->insertTree(*node);
+
+    // nodes without records or children go, and maybe their parents too
+    while(node != this && node->rrsets.empty() && node->children.empty()) {
+      auto parent = node->d_parent;
+      if(d_exact)
+        d_exact->eraseTree(*node);
+      reindex.erase(node);
+      if(parent->d_index.d_kind != ChildIndex::Kind::None)
+        parent->d_index.erase(*node);
+      parent->children.erase(parent->children.find(node->d_name));
+      node = parent;
+    }
+  }
+
+  for(const auto& c : changes.adds) {
+    DNSNode* node = this;
+    for(DNSName name(c.name); !name.empty(); name.pop_back()) {
+      auto back = name.back();
+      auto iter = node->children.lower_bound(back);
+      if(iter == node->children.end() || !(iter->d_name == back)) {
+        iter = node->children.emplace_hint(iter, back, node);
+        if(node->d_index.d_kind != ChildIndex::Kind::None)
+          node->d_index.insert(*iter);
+        else if(frozen)
+          reindex.insert(node);
+        if(d_exact)
+          d_exact->insertTree(*iter);
+      }
+      node = const_cast<DNSNode*>(&*iter);
+    }
+    auto rr = cloneRR(*c.rr);
+    visitRR(*rr, [](auto& gen) { internNames(gen); });
+    auto wire = makeWireRData(*rr);
+    auto rrsig = rrCast<RRSIGGen>(rr);
+    DNSType type = rrsig ? rrsig->d_type : rr->getType();
+    bool newCut = type == DNSType::NS && node != this && !node->rrsets.count(type);
+    auto& rrset = node->rrsets[type];
+    auto& part = rrsig ? rrset.signatures : rrset.contents;
+    if(std::none_of(part.begin(), part.end(), [&](const auto& a) { return makeWireRData(*a) == wire; }))
+      part.push_back(std::move(rr));
+    if(!rrsig)
+      rrset.ttl = c.ttl;
+    if(newCut && d_exact)
+      d_exact->eraseTree(*node);
+  }
+
+  if(frozen)
+    for(auto node : reindex)
+      node->d_index.build(node->children);
+
+  static constexpr size_t compactAfter = 256 * 1024; // so small zones don't do this all the time
+  if(d_arena && d_arena->used() - d_arena->marked() > std::max(d_arena->marked(), compactAfter))
+    compact();
+}
+
+static std::unique_ptr<DNSNode> copyTree(const DNSNode& from);
+
+bool IXFRReader::add(const DNSName& name, uint32_t ttl, std::unique_ptr<RRGen>&& rr)
+{
+  auto soa = name.empty() ? rrCast<SOAGen>(rr) : nullptr;
+  switch(d_state) {
+  case State::Start:
+    if(!soa)
+      throw std::runtime_error("IXFR response does not start with a SOA");
+    d_serial = soa->d_serial;
+    d_state = State::First;
+    return true;
+  case State::First:
+    if(!soa || soa->d_serial == d_serial) { // the whole zone, or just its SOA twice
+      d_full = true;
+      d_state = State::Done;
+      return false;
+    }
+    changesets.emplace_back();
+    changesets.back().remove(name, std::move(rr));
+    d_state = State::Removes;
+    return true;
+  case State::Removes:
+    if(soa) {
+      changesets.back().add(name, ttl, std::move(rr));
+      d_state = State::Adds;
+    }
+    else
+      changesets.back().remove(name, std::move(rr));
+    return true;
+  case State::Adds:
+    if(soa && soa->d_serial == d_serial) {
+      d_state = State::Done;
+      return false;
+    }
+    if(soa) {
+      changesets.emplace_back();
+      changesets.back().remove(name, std::move(rr));
+      d_state = State::Removes;
+    }
+    else
+      changesets.back().add(name, ttl, std::move(rr));
+    return true;
+  case State::Done:
+    break;
+  }
+  throw std::runtime_error("IXFR response goes on after its last SOA");
+}
+
+//! Copies the records, children and zones of 'from' into 'to'
+static void copyNode(const DNSNode& from, DNSNode& to)
+{
+  for(const auto& rrs : from.rrsets) {
+    auto& rrset = to.rrsets[rrs.first];
+    rrset.ttl = rrs.second.ttl;
+    for(const auto& rr : rrs.second.contents)
+      rrset.contents.push_back(cloneRR(*rr));
+    for(const auto& rr : rrs.second.signatures)
+      rrset.signatures.push_back(cloneRR(*rr));
+  }
+  for(const auto& c : from.children) {
+    auto iter = to.children.emplace_hint(to.children.end(), c.d_name, &to);
+    copyNode(c, const_cast<DNSNode&>(*iter));
+  }
+  if(from.zone)
+    to.zone = copyTree(*from.zone);
+  to.image = from.image;
+}
+
+//! An unfrozen copy of 'from' and what is below it, in an Arena of its own if 'from' has one
+static std::unique_ptr<DNSNode> copyTree(const DNSNode& from)
+{
+  auto arena = from.d_arena ? std::make_unique<Arena>() : nullptr;
+  ArenaScope scope(arena ? arena.get() : Arena::current());
+  auto ret = std::make_unique<DNSNode>();
+  ret->d_name = from.d_name;
+  copyNode(from, *ret);
+  ret->d_arena = std::move(arena);
+  return ret;
+}
+
+void DNSNode::compact()
+{
+  bool frozen = d_exact || d_index.d_kind != ChildIndex::Kind::None;
+  auto fresh = copyTree(*this);
+  // the ArenaAllocators go along, so our old contents go with 'fresh', and its Arena last
+  children.swap(fresh->children);
+  rrsets.swap(fresh->rrsets);
+  d_arena.swap(fresh->d_arena);
+  for(auto& c : children)
+    const_cast<DNSNode&>(c).d_parent = this;
+  d_radix.reset();
+  d_exact.reset();
+  d_index.clear();
+  if(frozen) {
+    freezeNodes(FindEngine::Tree);
+    d_exact = std::make_unique<ExactIndex>(*this);
+  }
+  if(d_arena)
+    d_arena->mark();
+}
+
+std::unique_ptr<DNSNode> DNSNode::clone() const
+{
+  auto ret = copyTree(*this);
+  if(d_exact || d_index.d_kind != ChildIndex::Kind::None) { // the copy answers the same way we do
+    ret->freeze(d_radix ? FindEngine::Radix : FindEngine::Tree);
+    if(d_exact)
+      ret->d_exact = std::make_unique<ExactIndex>(*ret);
+  }
+  return ret;
+}
@@ -4,13 +4,15 @@
 #include <set>
 #include <map>
 #include <vector>
-#include <deque>
+#include <iterator>
+#include <cstring>
 #include <iostream>
 #include <cstdint>
 #include <functional>
 #include <memory>
 #include "nenum.hh"
 #include "comboaddress.hh"
+#include "arena.hh"
 
 /*! 
    @file
@@ -91,68 +93,130 @@ SMARTENUMSTART(DNSClass) SENUM2(DNSClass, IN, CH) SMARTENUMEND(DNSClass)
 COMBOENUM4(DNSSection, Question, 0, Answer, 1, Authority, 2, Additional, 3);
 // this semicolon makes Doxygen happy
 
+//! Compares 'len' bytes case insensitively (A-Z as a-z, nothing else), returns <0, 0 or >0 like memcmp
+int dnsFoldCompare(const uint8_t* a, const uint8_t* b, size_t len);
+
 /*! \brief Represents a DNS label, which is part of a DNS Name */
 class DNSLabel
 {
 public:
   DNSLabel() {}
   DNSLabel(const char* s) : DNSLabel(std::string(s)) {} 
-  DNSLabel(const std::string& s) : d_s(s)
+  DNSLabel(const std::string& s) : d_s(s), d_folded(s)
   {
     if(d_s.size() > 63)
       throw std::out_of_range("label too long");
+    for(auto& c : d_folded)
+      if(c >= 'A' && c <= 'Z')
+        c += 0x20;
+  }
+  DNSLabel(const char* s, size_t len) : DNSLabel(std::string(s, len)) {}
+
+  //! Case insensitive comparison in DNSSEC canonical order, <0, 0 or >0 like memcmp
+  int compare(const DNSLabel& rhs) const
+  {
+    auto len = std::min(d_folded.size(), rhs.d_folded.size());
+    if(int ret = memcmp(d_folded.c_str(), rhs.d_folded.c_str(), len))
+      return ret;
+    return (int)d_folded.size() - (int)rhs.d_folded.size();
   }
   //! Equality and comparison are case insensitive
   bool operator<(const DNSLabel& rhs) const
   {
-    return std::lexicographical_compare(d_s.begin(), d_s.end(), rhs.d_s.begin(), rhs.d_s.end(), charcomp);
+    return compare(rhs) < 0;
   }
   
   bool operator==(const DNSLabel &rhs) const
   {
-    return !(*this < rhs) && !(rhs<*this);
+    return d_folded.size() == rhs.d_folded.size() && !memcmp(d_folded.c_str(), rhs.d_folded.c_str(), d_folded.size());
   }
   auto size() const { return d_s.size(); }
   auto empty() const { return d_s.empty(); }
   
-  std::string d_s;
-private:
-  static bool charcomp(char a, char b)
-  {
-    if(a >= 0x61 && a <= 0x7A)
-      a -= 0x20;
-    if(b >= 0x61 && b <= 0x7A)
-      b -= 0x20;
-    return a < b;
-  }
+  std::string d_s;       //!< the label as we got it, used for output
+  std::string d_folded;  //!< d_s with A-Z lowercased, used for comparisons
 };
 std::ostream & operator<<(std::ostream &os, const DNSLabel& d);
 
 
 //! A DNS Name with helpful methods. Inherits case insensitivity from DNSLabel
+/*! Internally, the labels are stored back to back in DNS wire format (a length
+    byte followed by the label) in a buffer that is part of the DNSName itself.
+    This means that creating, copying and shortening names never allocates.
+    Iterating over a DNSName still gets you DNSLabels. */
 struct DNSName
 {
+  //! Longest a name can be on the wire, including the terminating root label
+  static constexpr size_t maxLength = 255;
+
   DNSName() {}
-  DNSName(std::initializer_list<DNSLabel> dls) : d_name(dls) {}
-  void push_back(const DNSLabel& l) { d_name.push_back(l); }
-  auto back() const { return d_name.back(); }
-  auto begin() const { return d_name.begin(); }
-  bool empty() const { return d_name.empty(); }
-  auto end() const { return d_name.end(); }
-  auto front() const { return d_name.front(); }
-  void pop_back() { d_name.pop_back(); }
-  void pop_front() { d_name.pop_front(); }
-  auto push_front(const DNSLabel& dn) { return d_name.push_front(dn); }
-  auto size() { return d_name.size(); }
-  void clear() { d_name.clear(); }
+  DNSName(std::initializer_list<DNSLabel> dls) 
+  {
+    for(const auto& l : dls)
+      push_back(l);
+  }
+  DNSName(const DNSName& rhs) { *this = rhs; }
+  //! Parses a name in presentation format, with \. and \DDD escapes. The final dot is optional, "." is the root
+  /*! Throws std::out_of_range for names or labels that are too long, and std::runtime_error for
+      empty labels and bad escapes */
+  static DNSName parse(const char* str, size_t len);
+  DNSName& operator=(const DNSName& rhs)
+  {
+    if(this != &rhs) {
+      memcpy(d_storage, rhs.d_storage, rhs.d_len);
+      d_len = rhs.d_len;
+      d_count = rhs.d_count;
+    }
+    return *this;
+  }
+
+  //! Walks over the labels of a DNSName, from left to right, yielding DNSLabels
+  class const_iterator
+  {
+  public:
+    typedef std::bidirectional_iterator_tag iterator_category;
+    typedef DNSLabel value_type;
+    typedef std::ptrdiff_t difference_type;
+    typedef const DNSLabel* pointer;
+    typedef DNSLabel reference;
+
+    const_iterator(const DNSName* name, uint8_t pos) : d_dn(name), d_pos(pos) {}
+    DNSLabel operator*() const { return DNSLabel(data(), size()); }
+    const_iterator& operator++() { d_pos += 1 + size(); return *this; }
+    const_iterator operator++(int) { auto ret = *this; ++(*this); return ret; }
+    const_iterator& operator--() { d_pos = d_dn->prevLabel(d_pos); return *this; }
+    const_iterator operator--(int) { auto ret = *this; --(*this); return ret; }
+    bool operator==(const const_iterator& rhs) const { return d_pos == rhs.d_pos; }
+    bool operator!=(const const_iterator& rhs) const { return d_pos != rhs.d_pos; }
+    //! the bytes of this label, without making a DNSLabel
+    const char* data() const { return (const char*)d_dn->d_storage + d_pos + 1; }
+    uint8_t size() const { return d_dn->d_storage[d_pos]; }
+  private:
+    const DNSName* d_dn;
+    uint8_t d_pos;
+  };
+  typedef const_iterator iterator;
+  typedef std::reverse_iterator<const_iterator> const_reverse_iterator;
+
+  void push_back(const DNSLabel& l) { push_back(l.d_s.c_str(), l.size()); }
+  void push_back(const void* label, size_t len); //!< Append a label from raw bytes
+  void push_front(const DNSLabel& l);
+  DNSLabel back() const { return *(--end()); }
+  DNSLabel front() const { return *begin(); }
+  const_iterator begin() const { return const_iterator(this, 0); }
+  const_iterator end() const { return const_iterator(this, d_len); }
+  const_reverse_iterator rbegin() const { return const_reverse_iterator(end()); }
+  const_reverse_iterator rend() const { return const_reverse_iterator(begin()); }
+  bool empty() const { return !d_count; }
+  void pop_back() { d_len = prevLabel(d_len); --d_count; }
+  void pop_front();
+  size_t size() const { return d_count; }
+  void clear() { d_len = d_count = 0; }
   bool makeRelative(const DNSName& root);
   bool isPartOf(const DNSName& root) const;
   std::string toString() const;
-  bool operator==(const DNSName& rhs) const
-  {
-    return std::lexicographical_compare(begin(), end(), rhs.begin(), rhs.end())==0 &&
-      std::lexicographical_compare(rhs.begin(), rhs.end(), begin(), end())==0;
-  }
+  DNSName& operator+=(const DNSName& rhs);
+  bool operator==(const DNSName& rhs) const;
   bool operator!=(const DNSName& rhs) const
   {
     return !operator==(rhs);
@@ -160,18 +224,117 @@ struct DNSName
 
   bool operator<(const DNSName& rhs) const
   {
-    return std::lexicographical_compare(begin(), end(), rhs.begin(), rhs.end());
+    return compare(rhs) < 0;
   }
+  //! Compares label by label like DNSLabel does, <0, 0 or >0 like memcmp
+  int compare(const DNSName& rhs) const;
 
-  std::deque<DNSLabel> d_name;
+  //! The labels in wire format, without the terminating zero byte
+  const uint8_t* data() const { return d_storage; }
+  //! Length of data(), which excludes the terminating zero byte
+  size_t wireLength() const { return d_len; }
+private:
+  uint8_t prevLabel(uint8_t pos) const;  //!< offset of the label before the one at pos
+  size_t suffixPos(const DNSName& root) const; //!< where root starts in us, if it is our suffix
+  uint8_t d_len{0};    //!< bytes in use in d_storage
+  uint8_t d_count{0};  //!< number of labels
+  uint8_t d_storage[maxLength - 1];
 };
 
 // printing, concatenation
 std::ostream & operator<<(std::ostream &os, const DNSName& d);
 DNSName operator+(const DNSName& a, const DNSName& b);
+//! DNSName::parse() for a string
 DNSName makeDNSName(const std::string& str);
 
+//! Case insensitive hash of names and labels, for std::unordered_* and tables of our own
+/*! Names are hashed a label at a time, from the root down, eight bytes per step. So the hash
+    of www.example.com is extend(hash(example.com), "www"), and hashing all suffixes of a name
+    costs no more than hashing the name. A label hashes like the name with only that label.
+    The seed is random per process unless given, so outsiders can't pick names that all land
+    in the same bucket. */
+class DNSNameHash
+{
+public:
+  DNSNameHash() : d_seed(defaultSeed()) {}
+  explicit DNSNameHash(uint64_t seed) : d_seed(seed) {}
+
+  size_t operator()(const DNSName& name) const;
+  size_t operator()(const DNSLabel& label) const { return extend(d_seed, label); }
+
+  //! The hash of the root, which every name starts from
+  uint64_t start() const { return d_seed; }
+  //! Continues 'hash' of a name with one more label to the left
+  uint64_t extend(uint64_t hash, const DNSLabel& label) const
+  {
+    return extend(hash, (const uint8_t*)label.d_folded.c_str(), label.d_folded.size());
+  }
+  uint64_t extend(uint64_t hash, const uint8_t* label, size_t len) const;
+
+  static uint64_t defaultSeed(); //!< the same for the whole process
+private:
+  uint64_t d_seed;
+};
+
+//! Goes with DNSNameHash, case insensitive like operator== itself
+struct DNSNameEqual
+{
+  bool operator()(const DNSName& a, const DNSName& b) const { return a == b; }
+  bool operator()(const DNSLabel& a, const DNSLabel& b) const { return a == b; }
+};
+
+//! An immutable DNSName, shared by everything that interned the same name
+/*! Records that point to other names, like NS, MX and CNAME, store their target like this.
+    In a delegation heavy zone the same few nameserver names occur thousands of times,
+    and a DNSName is 256 bytes. A new InternedName has a copy of its own, DNSNode::freeze()
+    then swaps that for the shared one, so reading a message never touches the table or its
+    lock. Names are shared across zones, and go from the table once nothing uses them
+    anymore. Case is kept, so "NS1.example.com" is a different instance than
+    "ns1.example.com", but they do compare equal. */
+class InternedName
+{
+public:
+  InternedName();   //!< the root
+  explicit InternedName(const DNSName& name) : d_name(std::make_shared<const DNSName>(name)) {}
+  //! Swaps our copy for the one in the table, adding it there if needed. Takes a lock
+  void intern();
+
+  const DNSName& get() const { return *d_name; }
+  operator const DNSName&() const { return *d_name; }
+  std::string toString() const { return d_name->toString(); }
+
+  //! true if this is the very same instance, so certainly the same name. Only interned names share one
+  bool sameAs(const InternedName& rhs) const { return d_name == rhs.d_name; }
+  bool operator==(const InternedName& rhs) const { return sameAs(rhs) || *d_name == *rhs.d_name; }
+  bool operator!=(const InternedName& rhs) const { return !operator==(rhs); }
+  bool operator==(const DNSName& rhs) const { return *d_name == rhs; }
+  bool operator!=(const DNSName& rhs) const { return !(*d_name == rhs); }
+
+  struct Stats
+  {
+    size_t names{0};      //!< distinct names in the table
+    size_t references{0}; //!< InternedNames that use them
+    size_t bytes{0};      //!< used by the table and the names in it
+    //! what we save over each reference having its own DNSName
+    int64_t saved() const { return (int64_t)references * (sizeof(DNSName) - sizeof(InternedName)) - bytes; }
+  };
+  static Stats stats();
+
+private:
+  std::shared_ptr<const DNSName> d_name;
+};
+std::ostream & operator<<(std::ostream &os, const InternedName& d);
+
 class DNSMessageWriter;
+struct SOAGen;
+class ZoneImage;
+class RadixIndex;
+
+//! Which generator from record-types.hh an RRGen is, so we can check without dynamic_cast
+enum class RRKind : uint8_t
+{
+  A, AAAA, NS, CNAME, MX, SOA, TXT, SRV, NAPTR, PTR, RRSIG, Unknown, ClockTXT
+};
 
 //! Represents the contents of a resource record
 /*!  this is the how all resource records are stored, as generators
@@ -179,17 +342,24 @@ class DNSMessageWriter;
  */
 struct RRGen
 {
+  explicit RRGen(RRKind kind) : d_kind(kind) {}
   virtual void toMessage(DNSMessageWriter& dpw) = 0;
   virtual std::string toString() const = 0;
   virtual DNSType getType() const = 0;
+  //! true if the content changes at runtime, so it can not be pre-rendered
+  virtual bool isDynamic() const { return false; }
   virtual ~RRGen();
+  //! records are allocated from the current Arena, if there is one
+  static void* operator new(size_t size);
+  static void operator delete(void* p);
+  const RRKind d_kind; //!< see rrCast() and visitRR() in record-types.hh
 };
 
 //! Resource records are treated as a set and have one TTL for the whole set
 struct RRSet
 {
-  std::vector<std::unique_ptr<RRGen>> contents;
-  std::vector<std::unique_ptr<RRGen>> signatures;
+  std::vector<std::unique_ptr<RRGen>, ArenaAllocator<std::unique_ptr<RRGen>>> contents;
+  std::vector<std::unique_ptr<RRGen>, ArenaAllocator<std::unique_ptr<RRGen>>> signatures;
   void add(std::unique_ptr<RRGen>&& rr)
   {
     if(rr->getType() != DNSType::RRSIG) 
@@ -197,25 +367,165 @@ struct RRSet
     else 
       signatures.emplace_back(std::move(rr));
   }
+  //! Interns the names our records point to, see InternedName
+  void intern();
   uint32_t ttl{3600};
 };
 
+//! What a zone costs in memory, by kind and by record type. See DNSNode::memoryUsage()
+/*! Names that records point to are interned and shared between zones, so they are not in here,
+    see InternedName::stats(). */
+struct MemoryUsage
+{
+  size_t nodes{0};          //!< number of nodes
+  size_t records{0};        //!< number of records
+  size_t signatures{0};     //!< number of RRSIG records
+  size_t nodeBytes{0};      //!< the nodes themselves, and their child indexes
+  size_t labelBytes{0};     //!< labels, where not inside a node
+  size_t rrsetBytes{0};     //!< RRSets and the containers they live in
+  size_t rdataBytes{0};     //!< records
+  size_t signatureBytes{0}; //!< RRSIG records
+  //! rdata and signature bytes per record type, signatures counted with the type they cover
+  std::map<DNSType, size_t> types;
+
+  size_t total() const { return nodeBytes + labelBytes + rrsetBytes + rdataBytes + signatureBytes; }
+  MemoryUsage& operator+=(const MemoryUsage& rhs);
+  //! One line per item, like "rdata 12345", then one per type, like "A 1234"
+  std::vector<std::string> describe() const;
+};
+
+struct DNSNode;
+
+//! Finds the nodes of a zone by their full name, if they exist and are not at or below a zone cut
+/*! Most questions are for names that exist. For those, this is a single hash lookup instead of
+    a find() that goes label by label. Anything this does not find, find() still will. For the
+    names this does find, find() would have found the same node, with all of the name matched,
+    and no zone cut or wildcard passed. freeze() builds one for each zone. */
+class ExactIndex
+{
+public:
+  explicit ExactIndex(const DNSNode& apex);
+  //! The node for 'name', relative to the apex, or nullptr
+  const DNSNode* find(const DNSName& name) const;
+  size_t size() const { return d_count; }
+  //! Adds 'node' and what is below it, unless they are at or below a zone cut. For DNSNode::apply
+  void insertTree(const DNSNode& node);
+  //! Removes 'node' and what is below it, if we have them
+  void eraseTree(const DNSNode& node);
+
+  //! FNV-1a over the labels, from the last to the first, each as a length byte and the lowercased label
+  static uint32_t hash(const DNSName& name);
+  static constexpr uint32_t hashStart = 2166136261U;
+  //! Continues 'hash' with one more label to the left
+  static uint32_t hash(uint32_t hash, const DNSLabel& label);
+
+private:
+  void collect(const DNSNode& node, uint32_t hash, std::vector<std::pair<uint32_t, const DNSNode*>>& nodes);
+  void fill(const std::vector<std::pair<uint32_t, const DNSNode*>>& nodes, size_t size);
+  //! The hash of the name of 'node', relative to the apex
+  uint32_t hashOf(const DNSNode& node) const;
+  void erase(const DNSNode& node);
+  struct Slot
+  {
+    uint32_t hash;
+    const DNSNode* node; //!< nullptr for an empty slot
+  };
+  std::vector<Slot> d_table; //!< size is a power of two, at most half full
+  const DNSNode* d_apex;
+  size_t d_count{0};
+};
+
+//! Records to remove from a zone and records to add to it, like one step of an IXFR. See DNSNode::apply()
+struct Changeset
+{
+  //! One record, at a name relative to the apex of the zone
+  struct Change
+  {
+    DNSName name;
+    uint32_t ttl;
+    std::unique_ptr<RRGen> rr;
+  };
+  std::vector<Change> removes; //!< these go first. Only the name and the rdata have to match
+  std::vector<Change> adds;
+
+  void remove(const DNSName& name, std::unique_ptr<RRGen>&& rr) { removes.push_back({name, 0, std::move(rr)}); }
+  void add(const DNSName& name, uint32_t ttl, std::unique_ptr<RRGen>&& rr) { adds.push_back({name, ttl, std::move(rr)}); }
+  size_t size() const { return removes.size() + adds.size(); }
+};
+
+//! Turns the records of an IXFR response into Changesets, see RFC 1995
+/*! The response starts with the SOA we will be at. Then, for each version in between, comes the
+    SOA of the version we leave and the records it removes, and the SOA of the next version and
+    the records it adds. The SOA we will be at closes it. Just that first SOA means we are up to
+    date. Some servers send the whole zone instead, like an AXFR does */
+class IXFRReader
+{
+public:
+  //! Takes the next record of the response, named relative to the apex. Returns false once it is complete
+  bool add(const DNSName& name, uint32_t ttl, std::unique_ptr<RRGen>&& rr);
+  //! If the response can end here, which it also can after its first SOA
+  bool complete() const { return d_state == State::Done || d_state == State::First; }
+  //! If the response is the whole zone, with which the changesets are of no use
+  bool full() const { return d_full; }
+
+  std::vector<Changeset> changesets; //!< in the order they have to be applied
+private:
+  enum class State { Start, First, Removes, Adds, Done };
+  State d_state{State::Start};
+  uint32_t d_serial{0}; //!< of the first SOA
+  bool d_full{false};
+};
+
+//! How a frozen DNSNode tree finds names, see DNSNode::freeze()
+enum class FindEngine
+{
+  Tree,  //!< a label at a time, through the child index of each node
+  Radix  //!< in one descent through a RadixIndex over the whole tree
+};
+
 //! A node in the DNS tree 
 struct DNSNode
 {
+  std::unique_ptr<Arena> d_arena; //!< if set, holds the memory of this zone. First, so it goes last
   DNSLabel d_name;
   DNSNode* d_parent{0};
-  DNSNode(){}
-  DNSNode(const DNSLabel& lab, DNSNode* parent) : d_name(lab), d_parent(parent) {}
-  ~DNSNode();
+  DNSNode();
+  DNSNode(const DNSLabel& lab, DNSNode* parent);
+  ~DNSNode(); // these are out of line so users don't need the definition of ZoneImage
   //! This is the key function that finds names, returns where it found them and if any zonecuts were passsed
   const DNSNode* find(DNSName& name, DNSName& last, bool wildcards=false, const DNSNode** passedZonecut=0, const DNSNode** passedWcard=0) const;
 
   //! This is an idempotent way to add a node to a DNS tree
   DNSNode* add(DNSName name);
   
+  //! The next node in canonical order, used to walk a zone. Once frozen, this does not search
   const DNSNode* next() const;
+  //! Our left sibling, or failing that, that of our parent. Also does not search once frozen
   const DNSNode* prev() const;
+
+  //! Call once the tree is loaded, builds the lookup indexes and interns names. A later add() unfreezes that node
+  /*! With FindEngine::Radix, find() on this node then uses a RadixIndex, until something is added below us */
+  void freeze(FindEngine engine = FindEngine::Tree);
+  //! freeze() without building a RadixIndex here, zones below us do get one if asked for
+  void freezeNodes(FindEngine engine);
+  //! finds a direct child, using the frozen index if we have one
+  const DNSNode* findChild(const DNSLabel& label) const;
+  //! Walks us and our children and adds up what we use. Does not descend into other zones
+  MemoryUsage memoryUsage() const;
+
+  //! Changes the zone we are the apex of in place, at a cost that goes with the size of 'changes', not of the zone
+  /*! Removing a record that is not there, or adding one that is, does nothing. Nodes left without
+      records or children go. If we were frozen, what changed is frozen again and our ExactIndex
+      is kept up to date, but a RadixIndex is dropped. Readers must not use the zone meanwhile,
+      see DoubleBuffered in rcu.hh for how tauth-like servers can do this under load.
+      What a change removes stays in our Arena, so once changes have taken as much from it
+      as loading the zone did, the zone is copied into a new one, see compact(). */
+  void apply(const Changeset& changes);
+  //! Copies what we have into a new Arena and drops the old one, then freezes again if we were
+  void compact();
+  //! A deep copy of us and everything below us, and of the zones below us. Images are shared, they don't change
+  /*! If we have an Arena, the copy gets one too. If we are frozen, so is the copy, with the same indexes */
+  std::unique_ptr<DNSNode> clone() const;
   DNSName getName() const
   {
     DNSName ret;
@@ -256,15 +566,67 @@ struct DNSNode
   };
   
   //! children, found by DNSLabel
-  std::set<DNSNode, DNSNodeCmp> children;
+  typedef std::set<DNSNode, DNSNodeCmp, ArenaAllocator<DNSNode>> children_t;
+  children_t children;
+
+  //! Read-only index over 'children', built by freeze()
+  /*! Nodes with few children get a sorted array that is binary searched. Nodes with many
+      children, like the TLDs under the root, additionally get an open addressing hash
+      table on the lowercased label. The sorted array keeps canonical order for next() and prev(),
+      and build() tells each child where it is in there, in d_pos. */
+  struct ChildIndex
+  {
+    enum class Kind : uint8_t { None, Sorted, Hashed };
+    static constexpr size_t hashThreshold = 16; //!< from this many children on, we hash
+
+    void build(const children_t& children);
+    void clear();
+    //! Adds 'child', which was just added to the children, to a built index. For DNSNode::apply
+    /*! The d_pos of the children after it are then off, until the next build() */
+    void insert(const DNSNode& child);
+    //! Removes 'child', which is about to be removed from the children, from a built index
+    void erase(const DNSNode& child);
+    //! Where 'child' is in d_sorted
+    uint32_t positionOf(const DNSNode& child) const { return d_posValid ? child.d_pos : position(child.d_name); }
+    //! index of the child with this label in d_sorted, or -1
+    int position(const DNSLabel& label) const;
+    //! hash of the lowercased label, also used by ZoneImage
+    static uint32_t hash(const DNSLabel& label);
+
+    Kind d_kind{Kind::None};
+    std::vector<const DNSNode*> d_sorted;
+    struct Slot
+    {
+      uint32_t hash;
+      uint32_t pos; //!< position in d_sorted + 1, so 0 means empty
+    };
+    std::vector<Slot> d_table; //!< size is a power of two, at most half full
+    bool d_posValid{false};    //!< if the d_pos of our children is right, which it is after build()
+  private:
+    void buildTable();
+  };
+  ChildIndex d_index;
   
   // !the RRSets, grouped by type
-  std::map<DNSType, RRSet > rrsets;
+  std::map<DNSType, RRSet, std::less<DNSType>, ArenaAllocator<std::pair<const DNSType, RRSet>>> rrsets;
   std::unique_ptr<DNSNode> zone; //!< if this is set, this node is a zone
+  std::shared_ptr<const ZoneImage> image; //!< or if this is set, see ZoneImage. Shared by clone()
+  std::unique_ptr<RadixIndex> d_radix; //!< set by freeze(FindEngine::Radix), find() then uses it
+  std::unique_ptr<ExactIndex> d_exact; //!< set by freeze() on the apex of each zone, see findExact()
+  //! If we are the apex of a frozen zone, the node for 'name' if it exists and is below no zone cut. Otherwise nullptr
+  const DNSNode* findExact(const DNSName& name) const { return d_exact ? d_exact->find(name) : nullptr; }
+  bool hasZone() const { return zone || image; }
+  //! Drops the RadixIndex and ExactIndex of us and of the nodes above us, after a change to the tree
+  void dropIndexes();
   uint16_t namepos{0}; //!< for label compression, we also use DNSNodes
+  uint32_t d_pos{0};   //!< our place in d_parent->d_index.d_sorted, valid while that index is built
 };
 
 //! Called by main() to load zone information
 void loadZones(DNSNode& zones);
 
-std::unique_ptr<DNSNode> retrieveZone(const ComboAddress& remote, const DNSName& zone); 
+std::unique_ptr<DNSNode> retrieveZone(const ComboAddress& remote, const DNSName& zone);
+//! Asks 'remote' what changed in 'zone' since the serial of 'soa', with an IXFR
+IXFRReader retrieveChanges(const ComboAddress& remote, const DNSName& zone, const SOAGen& soa);
+//! Adds 'zone' to 'zones' from its snapshot if there is one, otherwise retrieves it from 'remote'
+void addRemoteZone(DNSNode& zones, const ComboAddress& remote, const DNSName& zone); 
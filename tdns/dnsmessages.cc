@@ -2,59 +2,196 @@
 #include "record-types.hh"
 using namespace std;
 
-DNSMessageReader::DNSMessageReader(const char* in, uint16_t size)
+DNSMessageReader::DNSMessageReader(const char* in, uint16_t size, bool copy)
 {
   if(size < sizeof(dnsheader))
     throw std::runtime_error("DNS message too small");
   memcpy(&dh, in, sizeof(dh));
-  payload.reserve(size-12);
-  payload.insert(payload.begin(), (const unsigned char*)in + 12, (const unsigned char*)in + size);
+  payload = Payload((const uint8_t*)in + sizeof(dh), size - sizeof(dh), copy);
 
   if(dh.qdcount) { // AXFR can skip this
     xfrName(d_qname);
     d_qtype = (DNSType) getUInt16();
     d_qclass = (DNSClass) getUInt16();
   }
+  d_rrstart = payloadpos;
+  d_ednsKnown = !dh.arcount;
+}
+
+DNSSection DNSMessageReader::sectionOf(unsigned int n) const
+{
+  if(n < ntohs(dh.ancount))
+    return DNSSection::Answer;
+  else if(n < ntohs(dh.ancount) + ntohs(dh.nscount))
+    return DNSSection::Authority;
+  return DNSSection::Additional;
+}
 
-  if(dh.arcount) {
-    auto nowpos=payloadpos;
-    skipRRs(ntohs(dh.ancount) + ntohs(dh.nscount) + ntohs(dh.arcount) - 1);
-    if(getUInt8() == 0 && getUInt16() == (uint16_t)DNSType::OPT) {
-      xfrUInt16(d_bufsize);
-      getUInt8(); // extended RCODE
-      d_ednsVersion = getUInt8();
-      auto flags=getUInt8();
-      d_doBit = flags & 0x80;
-      getUInt8(); getUInt16(); // ignore rest
-      d_haveEDNS = true;
+//! Reads just enough of the record at 'pos' to know where it ends, the name is skipped, not decompressed
+DNSMessageReader::RRPosition DNSMessageReader::peekRR(size_t pos, unsigned int n) const
+{
+  RRPosition ret;
+  ret.pos = pos;
+  for(;;) {
+    uint8_t labellen = payload.at(pos++);
+    if(labellen & 0xc0) {
+      ++pos;
+      break;
     }
-    payloadpos=nowpos;
+    if(!labellen)
+      break;
+    pos += labellen;
   }
+  payload.at(pos + 9); // type, class, ttl and rdlength
+  ret.type = (DNSType)get16(pos);
+  ret.rdata = pos + 10;
+  if(auto len = get16(pos + 8))
+    payload.at(ret.rdata + len - 1);
+  ret.section = sectionOf(n);
+  return ret;
+}
+
+/* Most callers iterate over the records anyway, and getRR notes the OPT record when it
+   passes it. Otherwise we look for it here */
+void DNSMessageReader::findEDNS()
+{
+  if(d_ednsKnown)
+    return;
+  size_t pos = d_rrstart;
+  try {
+    for(unsigned int n = 0; n < rrCount(); ++n) {
+      auto rr = peekRR(pos, n);
+      if(rr.type == DNSType::OPT && rr.section == DNSSection::Additional && !payload.at(rr.pos)) {
+        gotOPT(rr);
+        break;
+      }
+      pos = rr.rdata + get16(rr.rdata - 2);
+    }
+  }
+  catch(std::out_of_range& e) {
+    // callers that write a response take std::out_of_range to mean that ran out of room
+    throw std::runtime_error("Malformed record in the DNS message while looking for EDNS: "+string(e.what()));
+  }
+  d_ednsKnown = true;
+}
+
+void DNSMessageReader::gotOPT(const RRPosition& rr)
+{
+  gotOPT(get16(rr.rdata - 8), (uint32_t)get16(rr.rdata - 6) << 16 | get16(rr.rdata - 4), rr.rdata);
+}
+
+const std::vector<DNSMessageReader::RRPosition>& DNSMessageReader::index()
+{
+  if(d_indexed)
+    return d_index;
+  std::vector<RRPosition> index; // so a message that is cut short leaves no half an index
+  index.reserve(rrCount());
+  size_t pos = d_rrstart;
+  for(unsigned int n = 0; n < rrCount(); ++n) {
+    index.push_back(peekRR(pos, n));
+    const auto& rr = index.back();
+    if(rr.type == DNSType::OPT && rr.section == DNSSection::Additional && !payload.at(rr.pos) && !d_haveEDNS)
+      gotOPT(rr);
+    pos = rr.rdata + get16(rr.rdata - 2);
+  }
+  d_ednsKnown = true; // we saw them all, so getRR won't have to either
+  d_index = std::move(index);
+  d_indexed = true;
+  return d_index;
+}
+
+void DNSMessageReader::seekRR(size_t n)
+{
+  const auto& idx = index();
+  if(n < idx.size()) {
+    payloadpos = idx[n].pos;
+    rrpos = n;
+  }
+  else {
+    payloadpos = payload.size();
+    rrpos = idx.size();
+  }
+}
+
+void DNSMessageReader::seekSection(DNSSection section)
+{
+  switch(section) {
+  case DNSSection::Question:
+  case DNSSection::Answer:
+    return seekRR(0);
+  case DNSSection::Authority:
+    return seekRR(ntohs(dh.ancount));
+  case DNSSection::Additional:
+    return seekRR(ntohs(dh.ancount) + ntohs(dh.nscount));
+  }
+}
+
+void DNSMessageReader::gotOPT(uint16_t bufsize, uint32_t ttl, uint16_t rdata)
+{
+  d_bufsize = bufsize;
+  d_optRData = rdata;
+  // the TTL is the extended RCODE, the version and 16 bits of flags, of which the top one is DO
+  d_ednsVersion = (ttl >> 16) & 0xff;
+  d_doBit = ttl & 0x8000;
+  d_haveEDNS = true;
 }
 
 void DNSMessageReader::xfrName(DNSName& res, uint16_t* pos)
 {
   if(!pos) pos = &payloadpos;
   res.clear();
+  uint16_t p = *pos, start = *pos;
+  bool jumped = false;
+  // where we followed compression pointers to, and how long res was at that point
+  uint16_t targets[4];
+  uint8_t offsets[4];
+  unsigned int jumps = 0;
   for(;;) {
-    uint8_t labellen= getUInt8(pos);
+    uint8_t labellen= getUInt8(&p);
     if(labellen & 0xc0) {
-      uint16_t labellen2 = getUInt8(pos);
+      uint16_t labellen2 = getUInt8(&p);
       uint16_t newpos = ((labellen & ~0xc0) << 8) | labellen2;
       newpos -= sizeof(dnsheader); // includes struct dnsheader
 
-      if(newpos < *pos) {
-        res=res+getName(&newpos);
-        return;
+      if(newpos >= start) // every jump must go further back, otherwise we could go round in circles
+        throw std::runtime_error("forward compression: " + std::to_string(newpos) + " >= " + std::to_string(start));
+      if(!jumped) {
+        *pos = p;   // the name in the message ends at its first pointer
+        jumped = true;
+      }
+      auto slot = newpos % nameCacheSize;
+      if((d_nameCacheValid & (1U << slot)) && d_nameCache[slot].target == newpos) {
+        const auto& e = d_nameCache[slot];
+        for(unsigned int n = 0; n < e.len; n += 1 + d_nameBytes[e.pos + n])
+          res.push_back(d_nameBytes + e.pos + n + 1, d_nameBytes[e.pos + n]);
+        break;
       }
-      else {
-        throw std::runtime_error("forward compression: " + std::to_string(newpos) + " >= " + std::to_string(*pos));
+      if(jumps < 4) {
+        targets[jumps] = newpos;
+        offsets[jumps++] = res.wireLength();
       }
+      start = p = newpos;
+      continue;
     }
     if(!labellen) // end of DNSName
       break;
-    DNSLabel label = getBlob(labellen, pos);
-    res.push_back(label);
+    payload.at(p + labellen - 1); // bounds check, we copy straight from the payload
+    res.push_back(&payload.at(p), labellen);
+    p += labellen;
+  }
+  if(!jumped)
+    *pos = p;
+  for(unsigned int n = 0; n < jumps; ++n) { // remember what we found at each target
+    uint8_t len = res.wireLength() - offsets[n];
+    if(d_nameBytesUsed + len > sizeof(d_nameBytes)) { // full, start over
+      d_nameCacheValid = 0;
+      d_nameBytesUsed = 0;
+    }
+    auto slot = targets[n] % nameCacheSize;
+    d_nameCache[slot] = {targets[n], d_nameBytesUsed, len};
+    d_nameCacheValid |= 1U << slot;
+    memcpy(d_nameBytes + d_nameBytesUsed, res.data() + offsets[n], len);
+    d_nameBytesUsed += len;
   }
 }
 
@@ -63,8 +200,9 @@ void DNSMessageReader::getQuestion(DNSName& name, DNSType& type) const
   name = d_qname; type = d_qtype;
 }
 
-bool DNSMessageReader::getEDNS(uint16_t* bufsize, bool* doBit) const
+bool DNSMessageReader::getEDNS(uint16_t* bufsize, bool* doBit)
 {
+  findEDNS();
   if(!d_haveEDNS)
     return false;
   *bufsize = d_bufsize;
@@ -72,6 +210,68 @@ bool DNSMessageReader::getEDNS(uint16_t* bufsize, bool* doBit) const
   return true;
 }
 
+DNSMessageReader::EDNSOptions DNSMessageReader::getEDNSOptions()
+{
+  findEDNS();
+  if(!d_haveEDNS)
+    return EDNSOptions(nullptr, nullptr);
+  size_t pos = d_optRData, end = pos + get16(pos - 2);
+  if(end > payload.size())
+    throw std::out_of_range("OPT record does not fit in the DNS message");
+  // check once that every option fits, so iterating needs no checks
+  while(pos < end) {
+    if(pos + 4 > end || pos + 4 + get16(pos + 2) > end)
+      throw std::out_of_range("EDNS option does not fit in the OPT record");
+    pos += 4 + get16(pos + 2);
+  }
+  return EDNSOptions(payload.data() + d_optRData, payload.data() + end);
+}
+
+bool DNSMessageReader::EDNSOptions::find(EDNSOptionCode code, EDNSOption& opt) const
+{
+  for(const auto& o : *this) {
+    if(o.code == code) {
+      opt = o;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool DNSMessageReader::EDNSOption::getSubnet(ComboAddress& address, uint8_t& sourcePrefix, uint8_t& scopePrefix) const
+{
+  if(code != EDNSOptionCode::ClientSubnet || size < 4)
+    return false;
+  uint16_t family = data[0] << 8 | data[1];
+  sourcePrefix = data[2];
+  scopePrefix = data[3];
+  unsigned int bytes = (sourcePrefix + 7) / 8;  // the address is cut short after the prefix
+  if(size != 4 + bytes)
+    return false;
+  address = ComboAddress{};
+  if(family == 1 && bytes <= 4) {
+    address.sin4.sin_family = AF_INET;
+    address.sin4.sin_addr.s_addr = 0;  // only the prefix is in the option
+    memcpy(&address.sin4.sin_addr.s_addr, data + 4, bytes);
+  }
+  else if(family == 2 && bytes <= 16) {
+    address.sin6.sin6_family = AF_INET6;
+    memset(&address.sin6.sin6_addr.s6_addr, 0, 16);
+    memcpy(&address.sin6.sin6_addr.s6_addr, data + 4, bytes);
+  }
+  else
+    return false;
+  return true;
+}
+
+bool DNSMessageReader::EDNSOption::getTimeout(uint16_t& timeout) const
+{
+  if(code != EDNSOptionCode::TCPKeepalive || size != 2)
+    return false;
+  timeout = data[0] << 8 | data[1];
+  return true;
+}
+
 void DNSMessageReader::skipRRs(int num)
 {
   for(int n = 0; n < num; ++n) {
@@ -86,34 +286,134 @@ void DNSMessageReader::skipRRs(int num)
 
 bool DNSMessageReader::getRR(DNSSection& section, DNSName& name, DNSType& type, uint32_t& ttl, std::unique_ptr<RRGen>& content)
 {
-  if(payloadpos == payload.size())
+  if(payloadpos == payload.size()) {
+    if(rrpos == rrCount())
+      d_ednsKnown = true; // we saw every record, see below
     return false;
-  if(rrpos < ntohs(dh.ancount))
-    section = DNSSection::Answer;
-  else if(rrpos < ntohs(dh.ancount) + ntohs(dh.nscount))
-    section = DNSSection::Authority;
-  else
-    section = DNSSection::Additional;
-  ++rrpos;
-  name = getName();
-  type=(DNSType)getUInt16();
-  /* uint16_t lclass = */ getUInt16(); // class
-  xfrUInt32(ttl);
-  auto len = getUInt16();
+  }
+  section = sectionOf(rrpos++);
+  xfrName(name);
+  uint16_t lclass, len;
+  const uint8_t* rdata = nullptr; // set if all of the record is in the message
+  size_t pos = payloadpos;
+  if(!d_checkEveryRead && pos + 10 <= payload.size() && pos + 10 + get16(pos + 8) <= payload.size()) {
+    const uint8_t* p = payload.data() + pos;
+    type = (DNSType)(p[0] << 8 | p[1]);
+    lclass = p[2] << 8 | p[3];
+    ttl = (uint32_t)p[4] << 24 | p[5] << 16 | p[6] << 8 | p[7];
+    len = p[8] << 8 | p[9];
+    payloadpos += 10;
+    rdata = p + 10;
+  }
+  else {
+    type=(DNSType)getUInt16();
+    lclass = getUInt16();
+    xfrUInt32(ttl);
+    len = getUInt16();
+  }
+  if(type == DNSType::OPT && section == DNSSection::Additional && name.empty() && !d_haveEDNS)
+    gotOPT(lclass, ttl, payloadpos);
   d_endofrecord = payloadpos + len;
+  content = makeRR(type, len, rdata);
+  return true;
+}
+
+//! Makes the generator for the rdata at payloadpos. 'rdata' points there if all of it is known to be in the message
+std::unique_ptr<RRGen> DNSMessageReader::makeRR(DNSType type, uint16_t len, const uint8_t* rdata)
+{
+  if(rdata && type == DNSType::A && len == 4) {
+    payloadpos += 4;
+    return std::make_unique<AGen>((uint32_t)rdata[0] << 24 | rdata[1] << 16 | rdata[2] << 8 | rdata[3]);
+  }
+  if(rdata && type == DNSType::AAAA && len == 16) {
+    payloadpos += 16;
+    return std::make_unique<AAAAGen>(rdata);
+  }
   // this should care about RP, AFSDB too (RFC3597).. if anyone cares
-#define CONVERT(x) if(type == DNSType::x) { content = std::make_unique<x##Gen>(*this);} else
+#define CONVERT(x) if(type == DNSType::x) { return std::make_unique<x##Gen>(*this);} else
   CONVERT(A) CONVERT(AAAA) CONVERT(NS) CONVERT(SOA) CONVERT(MX) CONVERT(CNAME)
   CONVERT(NAPTR) CONVERT(SRV)
   CONVERT(TXT) CONVERT(RRSIG)
   CONVERT(PTR) 
   {
-    content = std::make_unique<UnknownGen>(type, getBlob(len));
+    return std::make_unique<UnknownGen>(type, getBlob(len));
   }
 #undef CONVERT
+}
+
+bool DNSMessageReader::nextRR(DNSSection& section, DNSName& name, DNSType& type, uint32_t& ttl, uint16_t& len)
+{
+  if(payloadpos == payload.size()) {
+    if(rrpos == rrCount())
+      d_ednsKnown = true;
+    return false;
+  }
+  section = sectionOf(rrpos++);
+  xfrName(name);
+  size_t pos = payloadpos;
+  if(pos + 10 > payload.size() || pos + 10 + get16(pos + 8) > payload.size())
+    throw std::out_of_range("Record does not fit in the DNS message");
+  const uint8_t* p = payload.data() + pos;
+  type = (DNSType)(p[0] << 8 | p[1]);
+  ttl = (uint32_t)p[4] << 24 | p[5] << 16 | p[6] << 8 | p[7];
+  len = p[8] << 8 | p[9];
+  payloadpos += 10;
+  if(type == DNSType::OPT && section == DNSSection::Additional && name.empty() && !d_haveEDNS)
+    gotOPT(p[2] << 8 | p[3], ttl, payloadpos);
+  d_endofrecord = payloadpos + len;
   return true;
 }
 
+const uint8_t* DNSMessageReader::RRView::rdata() const
+{
+  return d_reader.payload.data() + d_rdpos;
+}
+
+DNSName DNSMessageReader::RRView::getName(uint16_t pos) const
+{
+  if(pos >= rdlength)
+    throw std::out_of_range("Name beyond the end of the rdata");
+  uint16_t p = d_rdpos + pos;
+  return d_reader.getName(&p);
+}
+
+uint16_t DNSMessageReader::RRView::getUInt16(uint16_t pos) const
+{
+  if(pos + 2 > rdlength)
+    throw std::out_of_range("16 bit integer beyond the end of the rdata");
+  return d_reader.get16(d_rdpos + pos);
+}
+
+uint32_t DNSMessageReader::RRView::getUInt32(uint16_t pos) const
+{
+  if(pos + 4 > rdlength)
+    throw std::out_of_range("32 bit integer beyond the end of the rdata");
+  return (uint32_t)d_reader.get16(d_rdpos + pos) << 16 | d_reader.get16(d_rdpos + pos + 2);
+}
+
+ComboAddress DNSMessageReader::RRView::getIP() const
+{
+  ComboAddress ca{};
+  if(type == DNSType::A && rdlength == 4) {
+    ca.sin4.sin_family = AF_INET;
+    memcpy(&ca.sin4.sin_addr.s_addr, rdata(), 4);
+  }
+  else if(type == DNSType::AAAA && rdlength == 16) {
+    ca.sin6.sin6_family = AF_INET6;
+    memcpy(&ca.sin6.sin6_addr.s6_addr, rdata(), 16);
+  }
+  else
+    throw std::runtime_error(string("Not an A or AAAA record of the right size: ")+toString(type));
+  return ca;
+}
+
+std::unique_ptr<RRGen> DNSMessageReader::RRView::make() const
+{
+  d_reader.payloadpos = d_rdpos; // visitRRs moves on to the next record after this one anyway
+  d_reader.d_endofrecord = d_rdpos + rdlength;
+  return d_reader.makeRR(type, rdlength, rdata());
+}
+
 // this is required to make the std::unique_ptr to DNSZone work. Long story.
 DNSMessageWriter::~DNSMessageWriter() = default;
 
@@ -124,50 +424,184 @@ void DNSMessageWriter::randomizeID()
 
 void DNSMessageWriter::xfrName(const DNSName& name, bool compress)
 {
-  DNSName oname(name);
-  //  cout<<"Attempt to emit "<<oname<<" (compress = "<<compress<<", d_nocompress= "<<d_nocompress<<")"<<endl;
-  DNSName fname(oname), flast;
-
-  if(compress && !d_nocompress)  {
-    auto node = d_comptree->find(fname, flast);
-    
-    if(node) {
-      //      cout<<" Did lookup for "<<oname<<", left: "<<fname<<", node: "<<flast<<", pos: "<<node->namepos<<endl;
-      if(flast.size() >= 1) {
-        uint16_t pos = node->namepos;
-        //        cout<<" Using the pointer we found to pos "<<pos<<", have to emit "<<fname.size()<<" labels first"<<endl;
-
-        DNSName sname(oname);
-        for(const auto& lab : fname) {
-          auto anode = d_comptree->add(sname);
-          if(!anode->namepos) {
-            //            cout<<"Storing that "<<sname<<" can be found at " << payloadpos + 12 << endl;
-            anode->namepos = payloadpos + 12;
-          }
-          sname.pop_front();
-          xfrUInt8(lab.size());
-          xfrBlob(lab.d_s);
-        }
-        xfrUInt8((pos>>8) | (uint8_t)0xc0 );
-        xfrUInt8(pos & 0xff);
-        return;
-      }
-    }
+  xfrLabels(name.data(), name.wireLength(), compress);
+}
+
+void DNSMessageWriter::xfrLabels(const uint8_t* data, size_t len, bool compress)
+{
+  if(d_nocompress) { // and there is no need to remember where we put it
+    if(len)
+      xfrBlob(data, len);
+    xfrUInt8(0);
+    return;
   }
-  // if we are here, we know we need to write out the whole thing
-  for(const auto& l : name) {
-    if(!d_nocompress) { // even with compress=false, we want to store this name, unless this is a nocompress message (AXFR)
-      auto anode = d_comptree->add(oname);
-      if(!anode->namepos) {
-        //        cout<<"Storing that "<<oname<<" can be found at " << payloadpos + 12 << endl;
-        anode->namepos = payloadpos + 12;
-      }
+  uint8_t starts[DNSName::maxLength / 2];
+  unsigned int count = 0;
+  for(size_t n = 0; n < len; n += 1 + data[n])
+    starts[count++] = n;
+  // the labels from 'known' on were written before, at 'parent'
+  unsigned int known = count;
+  uint16_t parent = 0;
+  while(known) {
+    uint16_t pos = findSuffix(parent, data + starts[known - 1]);
+    if(!pos)
+      break;
+    parent = pos;
+    --known;
+  }
+
+  uint16_t here = payloadpos + sizeof(dnsheader);
+  if(compress && known < count) {
+    if(known)
+      xfrBlob(data, starts[known]);
+    xfrUInt8((parent>>8) | (uint8_t)0xc0 );
+    xfrUInt8(parent & 0xff);
+  }
+  else {
+    if(len)
+      xfrBlob(data, len);
+    xfrUInt8(0);
+  }
+  // even with compress=false, we want to store the labels that were new
+  for(unsigned int n = known; n--; ) {
+    uint16_t pos = here + starts[n];
+    if(pos > 0x3fff) // beyond what a pointer can reach, as are the labels before it
+      break;
+    addSuffix(parent, data + starts[n], pos);
+    parent = pos;
+  }
+}
+
+uint16_t DNSMessageWriter::findSuffix(uint16_t parent, const uint8_t* label) const
+{
+  uint64_t hash = d_compHash.extend(parent, label + 1, *label);
+  uint16_t tag = hash >> 48;
+  for(size_t n = hash & (d_compression.size() - 1); d_compression[n].gen == d_compGen; n = (n + 1) & (d_compression.size() - 1)) {
+    const auto& e = d_compression[n];
+    // the length bytes are compared along, dnsFoldCompare leaves those alone
+    if(e.tag == tag && e.parent == parent &&
+       !dnsFoldCompare(&payload[e.offset - sizeof(dnsheader)], label, 1 + *label))
+      return e.offset;
+  }
+  return 0;
+}
+
+void DNSMessageWriter::addSuffix(uint16_t parent, const uint8_t* label, uint16_t offset)
+{
+  if(d_compCount >= d_compression.size() / 2)
+    growCompression();
+  uint64_t hash = d_compHash.extend(parent, label + 1, *label);
+  size_t n = hash & (d_compression.size() - 1);
+  while(d_compression[n].gen == d_compGen)
+    n = (n + 1) & (d_compression.size() - 1);
+  d_compression[n] = CompressionEntry{d_compGen, (uint16_t)(hash >> 48), parent, offset};
+  ++d_compCount;
+}
+
+void DNSMessageWriter::growCompression()
+{
+  // a 512 byte answer rarely has more than 32 labels worth remembering
+  auto old = std::move(d_compression);
+  d_compression.assign(old.empty() ? 64 : 2 * old.size(), CompressionEntry{});
+  d_compCount = 0;
+  for(const auto& e : old)
+    if(e.gen == d_compGen)
+      addSuffix(e.parent, &payload[e.offset - sizeof(dnsheader)], e.offset);
+}
+
+DNSName RDataView::getName(uint16_t pos) const
+{
+  DNSName ret;
+  for(;;) {
+    if(pos >= size)
+      throw std::runtime_error("Name in rdata runs beyond its end");
+    uint8_t labellen = data[pos];
+    if(!labellen)
+      break;
+    if(labellen & 0xc0 || pos + 1 + labellen > size)
+      throw std::runtime_error("Invalid name in pre-rendered rdata");
+    ret.push_back(data + pos + 1, labellen);
+    pos += 1 + labellen;
+  }
+  return ret;
+}
+
+std::string makeWireRData(RRGen& rr)
+{
+  static thread_local DNSMessageWriter dmw(DNSName(), DNSType::A, DNSClass::IN, 65535);
+  dmw.d_nocompress = true;
+  auto start = dmw.payloadpos;
+  try {
+    visitRR(rr, [](auto& gen) { gen.toMessage(dmw); });
+  }
+  catch(...) {
+    dmw.payloadpos = start;
+    throw;
+  }
+  std::string ret((const char*)&dmw.payload.at(0) + start, dmw.payloadpos - start);
+  dmw.payloadpos = start;
+  return ret;
+}
+
+void DNSMessageWriter::xfrRData(const RDataView& rr)
+{
+  uint16_t pos = 0;
+  auto blob = [&](uint16_t len) {
+    if(pos + len > rr.size)
+      throw std::runtime_error("Pre-rendered "+std::string(toString(rr.type))+" rdata is too short");
+    if(len)
+      xfrBlob(rr.data + pos, len);
+    pos += len;
+  };
+  auto name = [&]() { // straight from the rdata, checked like DNSName::push_back would
+    size_t len = 0;
+    for(;;) {
+      if(pos + len >= rr.size)
+        throw std::runtime_error("Name in rdata runs beyond its end");
+      uint8_t labellen = rr.data[pos + len];
+      if(!labellen)
+        break;
+      if(labellen & 0xc0 || pos + len + 1 + labellen > rr.size)
+        throw std::runtime_error("Invalid name in pre-rendered rdata");
+      len += 1 + labellen;
+      if(len > DNSName::maxLength - 1)
+        throw std::out_of_range("name too long");
     }
-    oname.pop_front();
-    xfrUInt8(l.size());
-    xfrBlob(l.d_s);
+    xfrLabels(rr.data + pos, len, true);
+    pos += len + 1;
+  };
+  auto txt = [&]() {
+    if(pos >= rr.size)
+      throw std::runtime_error("Pre-rendered "+std::string(toString(rr.type))+" rdata is too short");
+    blob(1 + rr.data[pos]);
+  };
+
+  // the layouts below follow what the RRGens do in doConv/toMessage
+  switch(rr.type) {
+  case DNSType::NS:
+  case DNSType::CNAME:
+  case DNSType::PTR:
+    name();
+    break;
+  case DNSType::MX:
+    blob(2); name();
+    break;
+  case DNSType::SOA:
+    name(); name();
+    break;
+  case DNSType::SRV:
+    blob(6); name();
+    break;
+  case DNSType::NAPTR:
+    blob(4); txt(); txt(); txt(); name();
+    break;
+  case DNSType::RRSIG:
+    blob(18); name();
+    break;
+  default:
+    break;
   }
-  xfrUInt8(0);
+  blob(rr.size - pos); // the rest is copied as is
 }
 
 static void nboInc(uint16_t& counter) // network byte order inc
@@ -176,14 +610,28 @@ static void nboInc(uint16_t& counter) // network byte order inc
 }
 
 void DNSMessageWriter::putRR(DNSSection section, const DNSName& name, uint32_t ttl, const std::unique_ptr<RRGen>& content, DNSClass dclass)
+{
+  putRR(section, name, content->getType(), ttl, dclass, [this, &content]() {
+      visitRR(*content, [this](auto& gen) { gen.toMessage(*this); }); // a direct call, the generators are final
+    });
+}
+
+void DNSMessageWriter::putRR(DNSSection section, const DNSName& name, uint32_t ttl, const RDataView& rr, DNSClass dclass)
+{
+  putRR(section, name, rr.type, ttl, dclass, [this, &rr]() { xfrRData(rr); });
+}
+
+//! This does the actual work for both putRR variants, writeRData writes the rdata
+template<typename T>
+void DNSMessageWriter::putRR(DNSSection section, const DNSName& name, DNSType type, uint32_t ttl, DNSClass dclass, T writeRData)
 {
   auto cursize = payloadpos;
   try {
     xfrName(name);
-    xfrUInt16((int)content->getType()); xfrUInt16((int)dclass);
+    xfrUInt16((int)type); xfrUInt16((int)dclass);
     xfrUInt32(ttl);
     auto pos = xfrUInt16(0); // placeholder
-    content->toMessage(*this);
+    writeRData();
     xfrUInt16At(pos, payloadpos-pos-2);
   }
   catch(...) {
@@ -213,7 +661,23 @@ void DNSMessageWriter::putEDNS(uint16_t bufsize, RCode ercode, bool doBit)
   try {
     xfrUInt8(0); xfrUInt16((uint16_t)DNSType::OPT); // 'root' name, our type
     xfrUInt16(bufsize); xfrUInt8(((int)ercode)>>4); xfrUInt8(0); xfrUInt8(doBit ? 0x80 : 0); xfrUInt8(0);
-    xfrUInt16(0);
+    size_t rdlen = d_ednsOptions.size();
+    int padding = -1;
+    if(d_padBlock) {
+      size_t total = sizeof(dnsheader) + payloadpos + 2 + rdlen + 4;
+      // pad up to the block, or as far as there is room for, or not at all if not even the option fits
+      padding = std::min<int>((d_padBlock - total % d_padBlock) % d_padBlock, (int)payload.size() - (int)(payloadpos + 2 + rdlen + 4));
+      if(padding >= 0)
+        rdlen += 4 + padding;
+    }
+    xfrUInt16(rdlen);
+    xfrBlob(d_ednsOptions);
+    if(padding >= 0) {
+      xfrUInt16((uint16_t)EDNSOptionCode::Padding);
+      xfrUInt16(padding);
+      for(int n = 0; n < padding; ++n)
+        xfrUInt8(0);
+    }
   }
   catch(...) {  // went beyond message size, roll it all back
     payloadpos = cursize;
@@ -226,12 +690,18 @@ DNSMessageWriter::DNSMessageWriter(const DNSName& name, DNSType type, DNSClass q
 {
   memset(&dh, 0, sizeof(dh));
   payload.resize(maxsize - sizeof(dh));
+  growCompression();
   clearRRs();
 }
 
 void DNSMessageWriter::clearRRs()
 {
-  d_comptree = std::make_unique<DNSNode>();
+  if(!++d_compGen) { // wrapped around, so some entries would look current again
+    for(auto& e : d_compression)
+      e.gen = 0;
+    d_compGen = 1;
+  }
+  d_compCount = 0;
   dh.qdcount = htons(1) ; dh.ancount = dh.arcount = dh.nscount = 0;
   payloadpos=0;
   xfrName(d_qname, false);
@@ -253,7 +723,7 @@ string DNSMessageWriter::serialize()
   }
   catch(std::out_of_range& e) {
     cout<<"Got truncated while adding EDNS! Truncating. haveEDNS="<<haveEDNS<<", payloadpos="<<payloadpos<<endl;
-    DNSMessageWriter act(d_qname, d_qtype);
+    DNSMessageWriter act(d_qname, d_qtype); // without our EDNS options, they may be what did not fit
     act.dh = dh;
     act.putEDNS(payload.size() + sizeof(dnsheader), d_ercode, d_doBit);
     std::string ret((const char*)&act.dh, ((const char*)&act.dh) + sizeof(dnsheader));
@@ -270,3 +740,35 @@ void DNSMessageWriter::setEDNS(uint16_t newsize, bool doBit, RCode ercode)
   d_ercode = ercode;
   haveEDNS=true;
 }
+
+void DNSMessageWriter::addEDNSOption(EDNSOptionCode code, const uint8_t* data, uint16_t size)
+{
+  uint8_t head[4] = {(uint8_t)((uint16_t)code >> 8), (uint8_t)code, (uint8_t)(size >> 8), (uint8_t)size};
+  d_ednsOptions.append((const char*)head, 4);
+  d_ednsOptions.append((const char*)data, size);
+}
+
+void DNSMessageWriter::addEDNSSubnet(const ComboAddress& address, uint8_t sourcePrefix, uint8_t scopePrefix)
+{
+  uint8_t opt[4 + 16] = {0, 1, sourcePrefix, scopePrefix};
+  const uint8_t* ip;
+  unsigned int maxbits;
+  if(address.sin4.sin_family == AF_INET) {
+    ip = (const uint8_t*)&address.sin4.sin_addr.s_addr;
+    maxbits = 32;
+  }
+  else if(address.sin4.sin_family == AF_INET6) {
+    opt[1] = 2;
+    ip = (const uint8_t*)address.sin6.sin6_addr.s6_addr;
+    maxbits = 128;
+  }
+  else
+    throw std::runtime_error("Client Subnet needs an IPv4 or IPv6 address");
+  if(sourcePrefix > maxbits || scopePrefix > maxbits)
+    throw std::runtime_error("Client Subnet prefix longer than the address");
+  unsigned int bytes = (sourcePrefix + 7) / 8;
+  memcpy(opt + 4, ip, bytes);
+  if(sourcePrefix % 8) // the bits beyond the prefix must be zero
+    opt[4 + bytes - 1] &= 0xff << (8 - sourcePrefix % 8);
+  addEDNSOption(EDNSOptionCode::ClientSubnet, opt, 4 + bytes);
+}
@@ -9,14 +9,60 @@
   @brief Defines DNSMessageReader and DNSMessageWriter
 */
 
+//! The EDNS options we know by name, others can be read and written by number
+COMBOENUM4(EDNSOptionCode, ClientSubnet, 8, Cookie, 10, TCPKeepalive, 11, Padding, 12);
+
 //! A class that parses a DNS Message 
+/*! The constructors copy the message. view() parses the caller's buffer where it is instead,
+    which saves a copy and an allocation per message. The buffer must then stay as it is for as
+    long as the reader, or any copy of it, is in use. */
 class DNSMessageReader
 {
 public:
-  DNSMessageReader(const char* input, uint16_t length);
+  DNSMessageReader(const char* input, uint16_t length) : DNSMessageReader(input, length, true) {}
   DNSMessageReader(const std::string& str) : DNSMessageReader(str.c_str(), str.size()) {}
+  //! Reads from 'input' without copying it, see above for how long it has to live
+  static DNSMessageReader view(const char* input, uint16_t length)
+  {
+    return DNSMessageReader(input, length, false);
+  }
+
+  //! The part of the message after the header, either a copy of our own or a view of the caller's
+  class Payload
+  {
+  public:
+    Payload() {}
+    Payload(const uint8_t* data, uint16_t size, bool copy) :
+      d_copy(copy ? data : data + size, data + size), d_data(copy ? d_copy.data() : data), d_size(size) {}
+    Payload(const Payload& rhs) : d_copy(rhs.d_copy), d_data(d_copy.empty() ? rhs.d_data : d_copy.data()), d_size(rhs.d_size) {}
+    Payload& operator=(const Payload& rhs)
+    {
+      d_copy = rhs.d_copy;
+      d_data = d_copy.empty() ? rhs.d_data : d_copy.data();
+      d_size = rhs.d_size;
+      return *this;
+    }
+    Payload(Payload&&) = default;            // the vector's buffer goes along, so d_data stays valid
+    Payload& operator=(Payload&&) = default;
+
+    //! Throws std::out_of_range beyond the end, like std::vector::at
+    const uint8_t& at(size_t pos) const
+    {
+      if(pos >= d_size)
+        throw std::out_of_range("Reading beyond the end of the DNS message");
+      return d_data[pos];
+    }
+    size_t size() const { return d_size; }
+    //! For reads that were bounds checked already
+    const uint8_t* data() const { return d_data; }
+  private:
+    std::vector<uint8_t> d_copy;
+    const uint8_t* d_data{nullptr};
+    size_t d_size{0};
+  };
+
   struct dnsheader dh=dnsheader{}; //!< the DNS header
-  std::vector<uint8_t> payload;    //!< The payload
+  Payload payload;                 //!< The payload
   uint16_t payloadpos{0};          //!< Current position of processing
   uint16_t rrpos{0};               //!< Used in getRR to set section correctly
   uint16_t d_endofrecord;
@@ -29,17 +75,138 @@ public:
   //! Copies the qname and type to you
   void getQuestion(DNSName& name, DNSType& type) const;
   //! Returns true if there was an EDNS record, plus copies details
-  bool getEDNS(uint16_t* newsize, bool* doBit) const;
+  /*! The OPT record is looked for the first time this is called, unless getRR already went past
+      all records. It can be anywhere in the additional section. Throws std::runtime_error
+      if a record before it does not fit in the message. */
+  bool getEDNS(uint16_t* newsize, bool* doBit);
+
+  //! An EDNS option as getEDNSOptions() hands it out, 'data' points into the message
+  /*! A Cookie is the 8 byte client cookie, followed by the server cookie if there is one.
+      Padding is just 'size' bytes, which should be zero. */
+  struct EDNSOption
+  {
+    EDNSOptionCode code; //!< may well be one we don't know by name
+    const uint8_t* data;
+    uint16_t size;
+    //! For Client Subnet, the address and prefix lengths. False if it is not a well formed one
+    bool getSubnet(ComboAddress& address, uint8_t& sourcePrefix, uint8_t& scopePrefix) const;
+    //! For TCP keepalive, the timeout in units of 100ms. False if there is none, as in a query
+    bool getTimeout(uint16_t& timeout) const;
+  };
+
+  //! The options of the OPT record, all checked to be within it when this was made
+  /*! Nothing is copied, so this is only good for as long as the reader, and its buffer if it is a view */
+  class EDNSOptions
+  {
+  public:
+    class iterator
+    {
+    public:
+      explicit iterator(const uint8_t* p) : d_p(p) {}
+      EDNSOption operator*() const
+      {
+        return EDNSOption{(EDNSOptionCode)(d_p[0] << 8 | d_p[1]), d_p + 4, (uint16_t)(d_p[2] << 8 | d_p[3])};
+      }
+      iterator& operator++() { d_p += 4 + (d_p[2] << 8 | d_p[3]); return *this; }
+      bool operator==(const iterator& rhs) const { return d_p == rhs.d_p; }
+      bool operator!=(const iterator& rhs) const { return d_p != rhs.d_p; }
+    private:
+      const uint8_t* d_p;
+    };
+    iterator begin() const { return iterator(d_begin); }
+    iterator end() const { return iterator(d_end); }
+    bool empty() const { return d_begin == d_end; }
+    //! Sets 'opt' to the first option with 'code', returns false if there is none
+    bool find(EDNSOptionCode code, EDNSOption& opt) const;
+  private:
+    friend class DNSMessageReader;
+    EDNSOptions(const uint8_t* b, const uint8_t* e) : d_begin(b), d_end(e) {}
+    const uint8_t* d_begin;
+    const uint8_t* d_end;
+  };
+  //! The options in the OPT record, none if there is no such record
+  /*! The options are not looked at before this is called, and then only checked to fit.
+      Throws std::out_of_range if one of them does not. */
+  EDNSOptions getEDNSOptions();
 
   //! Puts the next RR in content, unless at 'end of message', in which case it returns false
+  /*! Once the name is read, the rest of the record is checked to be in the message in one go,
+      after which the fixed fields, and the rdata of A and AAAA records, are read without further checks.
+      If the record does not fit, it is read field by field, which throws where it runs out. */
   bool getRR(DNSSection& section, DNSName& name, DNSType& type, uint32_t& ttl, std::unique_ptr<RRGen>& content);
+  //! Makes getRR always read field by field. It returns the same either way, this is there to prove that
+  bool d_checkEveryRead{false};
+
+  //! A record in the message, as visitRRs() hands it out. It points into the reader, so it is only good during the call
+  /*! Nothing is decoded until asked for, and nothing is allocated, unless make() is called */
+  class RRView
+  {
+  public:
+    DNSSection section;
+    const DNSName& name;
+    DNSType type;
+    uint32_t ttl;
+    uint16_t rdlength;
+
+    //! The rdata as it is in the message, so names in it may be compressed
+    const uint8_t* rdata() const;
+    //! The name that starts at 'pos' in the rdata, decompressed
+    DNSName getName(uint16_t pos) const;
+    //! The 16 or 32 bit integer at 'pos' in the rdata
+    uint16_t getUInt16(uint16_t pos) const;
+    uint32_t getUInt32(uint16_t pos) const;
+    //! The address in an A or AAAA record
+    ComboAddress getIP() const;
+    //! A generator of our own for this record, as getRR would have made
+    std::unique_ptr<RRGen> make() const;
+  private:
+    friend class DNSMessageReader;
+    RRView(DNSMessageReader& reader, DNSSection s, const DNSName& n, DNSType t, uint32_t tt, uint16_t len) :
+      section(s), name(n), type(t), ttl(tt), rdlength(len), d_reader(reader), d_rdpos(reader.payloadpos) {}
+    DNSMessageReader& d_reader;
+    uint16_t d_rdpos;
+  };
+
+  //! Calls 'f' with an RRView of each record from where we are on, like getRR but without making an RRGen
+  /*! Unlike getRR, this throws std::out_of_range if the rdata of a record is not all in the message */
+  template<typename F>
+  void visitRRs(F&& f)
+  {
+    DNSSection section;
+    DNSName name;
+    DNSType type;
+    uint32_t ttl;
+    uint16_t len;
+    while(nextRR(section, name, type, ttl, len)) {
+      uint16_t end = payloadpos + len;
+      f(RRView(*this, section, name, type, ttl, len));
+      payloadpos = end;
+    }
+  }
   void skipRRs(int n); //!< Skip over n RRs
+
+  //! Where a record is in the message, see index()
+  struct RRPosition
+  {
+    uint16_t pos;        //!< where its name starts
+    uint16_t rdata;      //!< where its rdata starts, its length is in the two bytes before that
+    DNSType type;
+    DNSSection section;
+  };
+  //! All records in the message, in order. Made the first time this is called, without decoding any names
+  const std::vector<RRPosition>& index();
+  //! Makes the next getRR() return record 'n' of index(), or nothing if there is no such record
+  void seekRR(size_t n);
+  //! Makes the next getRR() return the first record of 'section', or nothing if that is empty
+  void seekSection(DNSSection section);
   
-  uint8_t d_ednsVersion{0};
+  uint8_t d_ednsVersion{0}; //!< valid once getEDNS() returned true
 
   void xfrName(DNSName& ret, uint16_t* pos=0); //!< put the next name in ret, or copy it from pos
   //! Convenience form of xfrName that returns its result
   DNSName getName(uint16_t* pos=0) { DNSName res; xfrName(res, pos); return res;}
+  //! Same, for a record field. The name is not interned yet, so this takes no lock, see InternedName
+  void xfrName(InternedName& ret) { ret = InternedName(getName()); }
   //! Gets the next 8 bit unsigned integer from the message, or the one from 'pos'
   void xfrUInt8(uint8_t&res, uint16_t* pos = 0)
   {
@@ -104,11 +271,58 @@ public:
   DNSName d_qname;
   DNSType d_qtype{(DNSType)0};
   DNSClass d_qclass{(DNSClass)0};
+private:
+  DNSMessageReader(const char* input, uint16_t length, bool copy);
+  void findEDNS();                              //!< looks for the OPT record, once
+  //! OPT keeps its EDNS details in class and TTL, the options in the rdata at 'rdata'
+  void gotOPT(uint16_t bufsize, uint32_t ttl, uint16_t rdata);
+  void gotOPT(const RRPosition& rr);
+  RRPosition peekRR(size_t pos, unsigned int n) const; //!< record 'n', which starts at 'pos'
+  //! Reads the next record up to its rdata, which must all be in the message. False at the end
+  bool nextRR(DNSSection& section, DNSName& name, DNSType& type, uint32_t& ttl, uint16_t& len);
+  std::unique_ptr<RRGen> makeRR(DNSType type, uint16_t len, const uint8_t* rdata);
+  DNSSection sectionOf(unsigned int n) const;
+  unsigned int rrCount() const { return ntohs(dh.ancount) + ntohs(dh.nscount) + ntohs(dh.arcount); }
+  uint16_t get16(size_t pos) const { return payload.at(pos) << 8 | payload.at(pos + 1); }
+  std::vector<RRPosition> d_index;
+  bool d_indexed{false};
+  //! Names that compression pointers led to, by where they start, so the next pointer there is a copy
+  /*! Each offset has one slot, a later name there replaces an earlier one. A slot has the labels
+      of its name in d_nameBytes, which starts over once it is full. All of it is inline, so
+      reading a message allocates nothing for it. */
+  struct NameCacheEntry
+  {
+    uint16_t target;  //!< where the pointer went to in the payload
+    uint16_t pos;     //!< where the labels are in d_nameBytes
+    uint8_t len;      //!< their length, without the terminating zero byte
+  };
+  static constexpr size_t nameCacheSize = 32;
+  NameCacheEntry d_nameCache[nameCacheSize];
+  uint32_t d_nameCacheValid{0};  //!< one bit per slot of d_nameCache that is in use
+  static_assert(nameCacheSize <= 32, "d_nameCacheValid has a bit per slot");
+  uint8_t d_nameBytes[512];
+  uint16_t d_nameBytesUsed{0};
+  uint16_t d_rrstart{0};    //!< where the records start, after the question
   uint16_t d_bufsize;
+  uint16_t d_optRData{0};   //!< where the options of the OPT record start, if d_haveEDNS
   bool d_doBit{false};
   bool d_haveEDNS{false};
+  bool d_ednsKnown{false};  //!< we know if there is an OPT record
 }; 
 
+//! The rdata of a record in uncompressed wire format, stored elsewhere (for example in a ZoneImage)
+struct RDataView
+{
+  DNSType type;
+  const uint8_t* data;
+  uint16_t size;
+  //! decodes the (uncompressed) name that starts at 'pos'
+  DNSName getName(uint16_t pos) const;
+};
+
+//! Renders the rdata of 'rr' in uncompressed wire format, so it can be stored pre-rendered
+std::string makeWireRData(RRGen& rr);
+
 //! A DNS Message writer
 class DNSMessageWriter
 {
@@ -131,7 +345,19 @@ public:
   void randomizeID(); //!< Randomize the id field of our dnsheader
   void clearRRs();
   void putRR(DNSSection section, const DNSName& name, uint32_t ttl, const std::unique_ptr<RRGen>& rr, DNSClass dclass = DNSClass::IN);
+  //! Same, but for pre-rendered rdata
+  void putRR(DNSSection section, const DNSName& name, uint32_t ttl, const RDataView& rr, DNSClass dclass = DNSClass::IN);
   void setEDNS(uint16_t bufsize, bool doBit, RCode ercode = (RCode)0);
+  //! Adds an option to the OPT record that setEDNS() asks for
+  void addEDNSOption(EDNSOptionCode code, const uint8_t* data, uint16_t size);
+  void addEDNSOption(EDNSOptionCode code, const std::string& data)
+  {
+    addEDNSOption(code, (const uint8_t*)data.c_str(), data.size());
+  }
+  //! Adds a Client Subnet option for the first 'sourcePrefix' bits of 'address', see RFC 7871
+  void addEDNSSubnet(const ComboAddress& address, uint8_t sourcePrefix, uint8_t scopePrefix = 0);
+  //! Pads the message with a Padding option to a multiple of 'block' bytes, or as close as fits (RFC 7830)
+  void setEDNSPadding(uint16_t block) { d_padBlock = block; }
   std::string serialize();
 
   void xfrUInt8(uint8_t val)
@@ -185,10 +411,39 @@ public:
     payloadpos += size;
   }
   
+  //! Writes 'name', ending in a pointer to the longest part of it we wrote before, if any
+  /*! Not if 'compress' is false or d_nocompress is set. Unless d_nocompress is set, the name
+      is remembered for later names to point to either way. */
   void xfrName(const DNSName& name, bool compress=true);
+  //! Copies pre-rendered rdata, compressing the names in there like the RRGen for that type would
+  void xfrRData(const RDataView& rr);
 private:
-  std::unique_ptr<DNSNode> d_comptree;
+  //! xfrName() for the labels of a name in wire format, 'len' bytes without the terminating zero byte
+  void xfrLabels(const uint8_t* data, size_t len, bool compress);
+  template<typename T> void putRR(DNSSection section, const DNSName& name, DNSType type, uint32_t ttl, DNSClass dclass, T writeRData);
+  //! The suffixes of names we wrote, so later names can point there. Emptied by clearRRs() in one go
+  /*! An entry is the first label of a suffix, plus where the rest of the suffix is, which is an entry
+      too. A name is looked up label by label from the root, and an entry confirmed by comparing just
+      its label with what is in the message. */
+  struct CompressionEntry
+  {
+    uint16_t gen;     //!< the entry is empty unless this is d_compGen
+    uint16_t tag;     //!< more bits of the hash, so most wrong entries are told apart without the message
+    uint16_t parent;  //!< where the rest of the suffix is, 0 for the root
+    uint16_t offset;  //!< where the label is, from the start of the message
+  };
+  //! A power of two, at most half full. Starts small and doubles as names get written
+  std::vector<CompressionEntry> d_compression;
+  uint16_t d_compGen{0};
+  uint16_t d_compCount{0};
+  DNSNameHash d_compHash;
+  //! Where the label at 'label', followed by the suffix at 'parent', is, or 0 if we did not write it
+  uint16_t findSuffix(uint16_t parent, const uint8_t* label) const;
+  void addSuffix(uint16_t parent, const uint8_t* label, uint16_t offset);
+  void growCompression(); //!< doubles d_compression, keeping what is in there
   void putEDNS(uint16_t bufsize, RCode ercode, bool doBit);
+  std::string d_ednsOptions;  //!< in wire format, with the code and length of each
+  uint16_t d_padBlock{0};
   bool d_serialized{false};  // needed to make serialize() idempotent
 };
 
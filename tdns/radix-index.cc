@@ -0,0 +1,147 @@
+#include "radix-index.hh"
+#include <algorithm>
+
+/*!
+   @file
+   @brief Implements RadixIndex
+*/
+
+using namespace std;
+
+RadixIndex::RadixIndex(const DNSNode& root)
+{
+  vector<Key> keys;
+  string key;
+  collect(root, key, 0, keys);
+  sort(keys.begin(), keys.end(), [](const Key& a, const Key& b) { return a.key < b.key; });
+  build(keys);
+}
+
+void RadixIndex::collect(const DNSNode& node, string& key, uint8_t labels, vector<Key>& keys)
+{
+  keys.push_back({key, (uint32_t)d_entries.size()});
+  d_entries.push_back({&node, node.findChild(DNSLabel("*")), labels, node.rrsets.count(DNSType::NS) > 0});
+  auto len = key.size();
+  for(const auto& c : node.children) {
+    key.append(1, (char)c.d_name.d_folded.size());
+    key.append(c.d_name.d_folded);
+    collect(c, key, labels + 1, keys);
+    key.resize(len);
+  }
+}
+
+/* Lays out the nodes breadth first, so the children of a node are next to each other. Each
+   node covers a range of the sorted keys that share their first 'depth' bytes. Its edge is
+   what they all share beyond that, and its children each cover the keys that have the same
+   byte after the edge. */
+void RadixIndex::build(vector<Key>& keys)
+{
+  struct Todo
+  {
+    size_t lo, hi, depth;
+  };
+  vector<Todo> todo{{0, keys.size(), 0}};
+  d_nodes.resize(1);
+  for(size_t idx = 0; idx < todo.size(); ++idx) {
+    auto lo = todo[idx].lo, hi = todo[idx].hi, depth = todo[idx].depth;
+    const string& first = keys[lo].key;
+    const string& last = keys[hi - 1].key;
+    size_t end = depth;
+    while(end < first.size() && end < last.size() && first[end] == last[end])
+      ++end;
+
+    Node& node = d_nodes[idx];
+    node.edgelen = end - depth;
+    node.first = end > depth ? first[depth] : 0;
+    node.entry = -1;
+    if(node.edgelen <= sizeof(node.edge)) // saves a trip to d_bytes, most edges are this short
+      memcpy(&node.edge, first.c_str() + depth, node.edgelen);
+    else {
+      node.edge = d_bytes.size();
+      d_bytes.append(first, depth, end - depth);
+    }
+    if(first.size() == end) { // sorted, so only the first key can end here
+      node.entry = keys[lo].entry;
+      ++lo;
+    }
+    node.children = d_nodes.size();
+    node.count = 0;
+    while(lo < hi) {
+      uint8_t c = keys[lo].key[end];
+      size_t next = lo + 1;
+      while(next < hi && (uint8_t)keys[next].key[end] == c)
+        ++next;
+      todo.push_back({lo, next, end});
+      ++node.count;
+      lo = next;
+    }
+    d_nodes.resize(todo.size()); // invalidates 'node'
+  }
+}
+
+const DNSNode* RadixIndex::find(DNSName& name, DNSName& last, bool wildcards, const DNSNode** passedZonecut, const DNSNode** passedWcard) const
+{
+  // our key for 'name', from the last label to the first
+  uint8_t key[DNSName::maxLength];
+  size_t len = 0;
+  for(auto iter = name.end(); iter != name.begin(); ) {
+    --iter;
+    key[len++] = iter.size();
+    auto data = (const uint8_t*)iter.data();
+    for(uint8_t n = 0; n < iter.size(); ++n) {
+      uint8_t c = data[n];
+      key[len++] = (c >= 'A' && c <= 'Z') ? c + 0x20 : c;
+    }
+  }
+
+  bool wasRelative = !last.empty(); // DNSNode::find considers the root a zone cut only then
+  const Entry* best = nullptr;
+  size_t pos = 0;
+  for(uint32_t idx = 0;;) {
+    const Node& node = d_nodes[idx];
+    if(node.edgelen) {
+      if(pos + node.edgelen > len)
+        break;
+      auto edge = node.edgelen <= sizeof(node.edge) ? (const char*)&node.edge : d_bytes.c_str() + node.edge;
+      if(memcmp(edge, key + pos, node.edgelen))
+        break;
+      pos += node.edgelen;
+    }
+    if(node.entry >= 0) {
+      best = &d_entries[node.entry];
+      if(best->cut && (best->labels || wasRelative) && passedZonecut)
+        *passedZonecut = best->node;
+    }
+    if(pos == len || !node.count)
+      break;
+    auto children = d_nodes.data() + node.children;
+    auto iter = lower_bound(children, children + node.count, key[pos],
+                            [](const Node& a, uint8_t b) { return a.first < b; });
+    if(iter == children + node.count || iter->first != key[pos])
+      break;
+    idx = iter - d_nodes.data();
+  }
+
+  for(uint8_t n = 0; n < best->labels; ++n) {
+    last.push_front(name.back());
+    name.pop_back();
+  }
+  if(name.empty() || !wildcards || !best->wildcard)
+    return best->node;
+
+  // Had wildcard match, picking that, matching all labels
+  if(passedWcard)
+    *passedWcard = best->wildcard;
+  while(!name.empty()) {
+    last.push_front(name.back());
+    name.pop_back();
+  }
+  if(passedZonecut && best->wildcard->rrsets.count(DNSType::NS))
+    *passedZonecut = best->wildcard;
+  return best->wildcard;
+}
+
+size_t RadixIndex::memoryUsage() const
+{
+  return d_nodes.capacity() * sizeof(Node) + d_bytes.capacity() + d_entries.capacity() * sizeof(Entry);
+}
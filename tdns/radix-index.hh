@@ -0,0 +1,70 @@
+#pragma once
+#include <string>
+#include <vector>
+#include "dns-storage.hh"
+
+/*!
+   @file
+   @brief Defines RadixIndex, which finds names in a frozen DNSNode tree in one descent
+
+   DNSNode::find descends the tree a label at a time, and at each level looks
+   up the next label among the children of a node somewhere else in memory.
+   A RadixIndex instead turns every name in the tree into a single key: its
+   labels from right to left, each as a length byte followed by the label in
+   lowercase. The key of a node is a prefix of the keys of all nodes below it,
+   so the best matching node is the longest stored key that is a prefix of the
+   key of the query.
+
+   These keys live in a radix tree, in which runs of bytes that no two keys
+   differ in are stored only once, as the 'edge' of a node. All nodes and
+   edges are in two arrays. Finding a name is then a walk through these
+   arrays that notes zone cuts and the best match on the way, and finally
+   checks for a wildcard there.
+
+   DNSNode::freeze(FindEngine::Radix) builds one, after which DNSNode::find
+   uses it. A later add() to that tree drops it again.
+*/
+
+class RadixIndex
+{
+public:
+  //! Indexes 'root' and every node below it
+  explicit RadixIndex(const DNSNode& root);
+
+  //! Same semantics as DNSNode::find, for the root we were built for
+  const DNSNode* find(DNSName& name, DNSName& last, bool wildcards=false, const DNSNode** passedZonecut=0, const DNSNode** passedWcard=0) const;
+
+  size_t size() const { return d_entries.size(); } //!< number of names indexed
+  size_t memoryUsage() const;
+
+private:
+  //! A name that was indexed, which is where a key ends
+  struct Entry
+  {
+    const DNSNode* node;
+    const DNSNode* wildcard; //!< our '*' child, if we have one
+    uint8_t labels;          //!< number of labels below the root
+    bool cut;                //!< has NS records, so is a zone cut if it is not the root
+  };
+  struct Node
+  {
+    uint32_t edge;       //!< offset of our edge in d_bytes, or the edge itself if it is 4 bytes or less
+    uint32_t children;   //!< index of our first child in d_nodes, the others follow it
+    int32_t entry;       //!< the name whose key ends here, or -1
+    uint8_t edgelen;
+    uint8_t first;       //!< first byte of our edge, our children are sorted on this
+    uint16_t count;      //!< number of children, up to 256
+  };
+
+  struct Key
+  {
+    std::string key;
+    uint32_t entry;
+  };
+  void build(std::vector<Key>& keys);
+  void collect(const DNSNode& node, std::string& key, uint8_t labels, std::vector<Key>& keys);
+
+  std::vector<Node> d_nodes;        //!< breadth first, so siblings are next to each other. d_nodes[0] is the root
+  std::string d_bytes;              //!< all edges
+  std::vector<Entry> d_entries;
+};
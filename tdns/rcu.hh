@@ -0,0 +1,225 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*!
+   @file
+   @brief RCUPtr, an object that can be replaced while other threads are reading it
+
+   tauth answers from a tree of zones that does not change once it is loaded.
+   To reload the zones anyway, a new tree is built on the side and then put
+   in place of the old one in one go, after which the old tree has to live
+   on until the last question that was being answered from it is done.
+
+   Readers take no locks to do this. A reader pins the current object in a
+   slot of its own, and then checks it is still current. The writer swaps in
+   the new object, and only frees an old one once no slot holds it anymore.
+   This is read-copy-update, with a hazard pointer per reader.
+
+   Building a whole new object for every change is expensive if it is large
+   and the change is small. DoubleBuffered keeps a second copy instead, and
+   makes each change to both copies in turn, while readers use the other one.
+*/
+
+template<typename T>
+class RCUPtr
+{
+  struct Slot;
+public:
+  explicit RCUPtr(std::unique_ptr<T> initial) : d_current(initial.release()) {}
+  RCUPtr(const RCUPtr&) = delete;
+  RCUPtr& operator=(const RCUPtr&) = delete;
+  ~RCUPtr()
+  {
+    delete d_current.load();
+    for(auto p : d_retired)
+      delete p;
+  }
+
+  //! While this exists, the object that was current when it was made stays valid
+  class Pin
+  {
+  public:
+    explicit Pin(const RCUPtr& rcu) : d_slot(rcu.claim())
+    {
+      T* p;
+      do { // if it was replaced before we stored it, the writer might not have seen our slot
+        p = rcu.d_current.load();
+        d_slot->ptr.store(p);
+      } while(p != rcu.d_current.load());
+      d_ptr = p;
+    }
+    ~Pin()
+    {
+      d_slot->ptr.store(nullptr, std::memory_order_release);
+      d_slot->busy.store(false, std::memory_order_release);
+    }
+    Pin(const Pin&) = delete;
+    Pin& operator=(const Pin&) = delete;
+
+    const T& operator*() const { return *d_ptr; }
+    const T* operator->() const { return d_ptr; }
+    const T* get() const { return d_ptr; }
+  private:
+    Slot* d_slot;
+    const T* d_ptr;
+  };
+
+  //! Makes 'replacement' current, the previous object is freed by reclaim() once nobody reads it
+  void publish(std::unique_ptr<T> replacement)
+  {
+    std::lock_guard<std::mutex> lock(d_lock);
+    d_retired.push_back(d_current.exchange(replacement.release()));
+    reclaimLocked();
+  }
+
+  //! Makes 'replacement' current, waits until nobody reads the previous object anymore, and returns that
+  std::unique_ptr<T> exchange(std::unique_ptr<T> replacement)
+  {
+    std::lock_guard<std::mutex> lock(d_lock);
+    T* old = d_current.exchange(replacement.release());
+    for(;;) {
+      bool held = false;
+      for(const auto& s : d_slots)
+        held = held || s.ptr.load() == old;
+      if(!held)
+        return std::unique_ptr<T>(old);
+      std::this_thread::yield();
+    }
+  }
+
+  //! Frees the objects that were replaced and that nobody reads anymore, returns how many are left
+  size_t reclaim()
+  {
+    std::lock_guard<std::mutex> lock(d_lock);
+    return reclaimLocked();
+  }
+
+  static constexpr size_t slotCount = 256; //!< readers at the same time, more have to wait for a free slot
+
+private:
+  //! Padded to a cache line, so readers don't slow each other down
+  struct Slot
+  {
+    std::atomic<bool> busy{false};
+    std::atomic<T*> ptr{nullptr};
+    char pad[64 - sizeof(std::atomic<bool>) - sizeof(std::atomic<T*>)];
+  };
+
+  Slot* claim() const
+  {
+    // threads start looking in different places, so they rarely contend for a slot
+    size_t start = std::hash<std::thread::id>()(std::this_thread::get_id());
+    for(;;) {
+      for(size_t n = 0; n < slotCount; ++n) {
+        Slot& s = d_slots[(start + n) % slotCount];
+        bool expected = false;
+        if(!s.busy.load(std::memory_order_relaxed) &&
+           s.busy.compare_exchange_strong(expected, true, std::memory_order_acquire))
+          return &s;
+      }
+      std::this_thread::yield();
+    }
+  }
+
+  size_t reclaimLocked()
+  {
+    std::vector<T*> held;
+    for(const auto& s : d_slots)
+      if(auto p = s.ptr.load())
+        held.push_back(p);
+    auto iter = d_retired.begin();
+    while(iter != d_retired.end()) {
+      if(std::find(held.begin(), held.end(), *iter) == held.end()) {
+        delete *iter;
+        iter = d_retired.erase(iter);
+      }
+      else
+        ++iter;
+    }
+    return d_retired.size();
+  }
+
+  std::atomic<T*> d_current;
+  mutable std::array<Slot, slotCount> d_slots;
+  std::mutex d_lock;          //!< for writers only
+  std::vector<T*> d_retired;  //!< replaced, but maybe still read
+};
+
+//! Two copies of an object, readers use one through an RCUPtr while a change goes into the other
+/*! update() changes the standby copy, makes it current, waits for the readers of the other
+    copy to finish, and then makes the same change to that one, which is the standby from then on.
+    Each change is made twice, but nothing that does not change gets copied.
+
+    tauth keeps what it serves like this. Zones it serves from their trees are changed with
+    DNSNode::apply() on a reload, if their remotes can tell it what changed. */
+template<typename T>
+class DoubleBuffered
+{
+public:
+  //! Makes a copy of an object, for the standby. It has to be the same in every way update() relies on
+  typedef std::function<std::unique_ptr<T>(const T&)> Copier;
+
+  //! The standby is made with 'copy', which is also used to make it anew when a change fails
+  DoubleBuffered(std::unique_ptr<T> current, Copier copy) :
+    d_copy(std::move(copy)), d_standby(d_copy(*current)), d_rcu(std::move(current)) {}
+
+  //! For readers, pin this
+  const RCUPtr<T>& rcu() const { return d_rcu; }
+
+  //! Calls 'change' on both copies, one after the other. It must do the same to both
+  /*! If it throws on the first copy, readers never see that, and the exception is passed on.
+      If it throws on the second, the change is in place already, and the second copy is made
+      anew from the first one instead. Either way, the copies are the same again afterwards. */
+  template<typename F>
+  void update(F&& change)
+  {
+    std::lock_guard<std::mutex> lock(d_lock);
+    if(!d_standby) // a copy after an earlier failure failed too
+      d_standby = copyCurrent();
+    try {
+      change(*d_standby);
+    }
+    catch(...) {
+      d_standby.reset();
+      d_standby = copyCurrent();
+      throw;
+    }
+    d_standby = d_rcu.exchange(std::move(d_standby));
+    try {
+      change(*d_standby);
+    }
+    catch(...) {
+      d_standby.reset();
+      d_standby = copyCurrent();
+    }
+  }
+
+  //! Makes 'replacement' current once nobody reads the previous one anymore, and the standby a copy of it
+  /*! For when making a change twice costs more than making a new object */
+  void replace(std::unique_ptr<T> replacement)
+  {
+    std::lock_guard<std::mutex> lock(d_lock);
+    d_standby.reset();
+    d_rcu.exchange(std::move(replacement));
+    d_standby = copyCurrent(); // if this fails, update() tries again
+  }
+
+private:
+  std::unique_ptr<T> copyCurrent()
+  {
+    typename RCUPtr<T>::Pin pin(d_rcu); // only we replace it, but this is how it is read
+    return d_copy(*pin);
+  }
+
+  Copier d_copy;
+  std::unique_ptr<T> d_standby;
+  RCUPtr<T> d_rcu;
+  std::mutex d_lock;
+};
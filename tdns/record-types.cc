@@ -72,8 +72,7 @@ void DNSStringReader::xfrName(DNSName& name)
     ++d_iter;
   }
   
-  std::string tmp(begin, d_iter);
-  name=makeDNSName(tmp);
+  name=DNSName::parse(d_string.c_str() + (begin - d_string.cbegin()), d_iter - begin);
 }
 
 void DNSStringReader::xfrType(DNSType& name)
@@ -406,3 +405,73 @@ void RRSIGGen::xfrSignature(DNSStringReader& dmw)
 }
 
 BOILERPLATE(RRSIG)
+
+///////////////////////////////
+
+DNSName getTargetName(const std::unique_ptr<RRGen>& rr)
+{
+  switch(rr->d_kind) {
+  case RRKind::NS:
+    return static_cast<NSGen&>(*rr).d_name;
+  case RRKind::CNAME:
+    return static_cast<CNAMEGen&>(*rr).d_name;
+  case RRKind::PTR:
+    return static_cast<PTRGen&>(*rr).d_name;
+  case RRKind::MX:
+    return static_cast<MXGen&>(*rr).d_name;
+  default:
+    break;
+  }
+  throw std::runtime_error("Record of type "+std::string(toString(rr->getType()))+" has no target name");
+}
+
+DNSName getTargetName(const RDataView& rr)
+{
+  switch(rr.type) {
+  case DNSType::NS:
+  case DNSType::CNAME:
+  case DNSType::PTR:
+    return rr.getName(0);
+  case DNSType::MX:
+    return rr.getName(2);
+  default:
+    throw std::runtime_error("Record of type "+std::string(toString(rr.type))+" has no target name");
+  }
+}
+
+uint32_t getSOAMinimum(const std::unique_ptr<RRGen>& rr)
+{
+  if(auto soa = rrCast<SOAGen>(rr))
+    return soa->d_minimum;
+  throw std::runtime_error("Record of type "+std::string(toString(rr->getType()))+" is not a SOA");
+}
+
+//! Returns field 'n' of the five numbers at the end of a pre-rendered SOA record
+static uint32_t getSOANumber(const RDataView& rr, int n)
+{
+  // mname, rname, then serial, refresh, retry, expire and minimum
+  uint16_t pos = rr.getName(0).wireLength() + 1;
+  pos += rr.getName(pos).wireLength() + 1;
+  if(pos + 20 > rr.size)
+    throw std::runtime_error("SOA record too short");
+  uint32_t ret;
+  memcpy(&ret, rr.data + pos + 4 * n, 4);
+  return ntohl(ret);
+}
+
+uint32_t getSOAMinimum(const RDataView& rr)
+{
+  return getSOANumber(rr, 4);
+}
+
+uint32_t getSOASerial(const RDataView& rr)
+{
+  return getSOANumber(rr, 0);
+}
+
+std::unique_ptr<RRGen> cloneRR(const RRGen& rr)
+{
+  return visitRR(rr, [](const auto& gen) -> std::unique_ptr<RRGen> {
+      return std::unique_ptr<RRGen>(new std::decay_t<decltype(gen)>(gen));
+    });
+}
@@ -1,11 +1,14 @@
 #pragma once
 #include <memory>
+#include <stdexcept>
+#include <type_traits>
 #include "dns-storage.hh"
 #include "dnsmessages.hh"
 #include "comboaddress.hh"
 
 class DNSMessageReader;
 class DNSStringWriter;
+struct RDataView;
 
 //! Class that reads a string in 'zonefile format' on behalf of an RRGen
 struct DNSStringReader
@@ -14,6 +17,7 @@ struct DNSStringReader
   void skipSpaces();
                                             
   void xfrName(DNSName& name);
+  void xfrName(InternedName& name) { DNSName tmp; xfrName(tmp); name = InternedName(tmp); }
   void xfrType(DNSType& name);
   void xfrUInt8(uint8_t& v);
   void xfrUInt16(uint16_t& v);
@@ -56,17 +60,29 @@ struct DNSStringReader
    std::unique_ptr<RRGen> rr;
    
    if(dmr.getRR(rrsection, dn, dt, ttl, rr)) {
-     auto aaaa = dynamic_cast<AAAAGen*>(rr.get());
+     auto aaaa = rrCast<AAAAGen>(rr);
      if(aaaa) {
         sendto(sock, "hello", 5, aaaa->getIP(), aaaa->getIP().getSocklen(), 0);
      }
    }
    ```
+
+   The set of generators is closed. Each one is tagged with its RRKind, so rrCast()
+   is a compare instead of a dynamic_cast, and visitRR() calls a function with
+   the concrete generator, without going through the vtable.
  */
 
+//! Base of all generators, sets the RRKind tag
+template<RRKind K>
+struct RRGenOf : RRGen
+{
+  static constexpr RRKind kind = K;
+  RRGenOf() : RRGen(K) {}
+};
+
 
 //! IP address, A record generator
-struct AGen : RRGen
+struct AGen final : RRGenOf<RRKind::A>
 {
   AGen(uint32_t ip) : d_ip(ip) {}
   AGen(DNSMessageReader& dmr);
@@ -83,10 +99,10 @@ struct AGen : RRGen
   uint32_t d_ip; //!< the actual IP
 };
 //! Generates an AAAA (IPv6 address) record
-struct AAAAGen : RRGen
+struct AAAAGen final : RRGenOf<RRKind::AAAA>
 {
   AAAAGen(DNSMessageReader& dmr);
-  AAAAGen(unsigned char ip[16])
+  AAAAGen(const unsigned char ip[16])
   {
     memcpy(d_ip, ip, 16);
   }
@@ -105,7 +121,7 @@ struct AAAAGen : RRGen
 };
 
 //! Generates a SOA Resource Record
-struct SOAGen : RRGen
+struct SOAGen final : RRGenOf<RRKind::SOA>
 {
   SOAGen(const DNSName& mname, const DNSName& rname, uint32_t serial, uint32_t refresh=10800, uint32_t retry=3600, uint32_t expire=604800, uint32_t minimum=3600) :
     d_mname(mname), d_rname(rname), d_serial(serial), d_refresh(refresh), d_retry(retry), d_expire(expire), d_minimum(minimum)
@@ -127,7 +143,7 @@ struct SOAGen : RRGen
 };
 
 //! Generates a SRV Resource Record
-struct SRVGen : RRGen
+struct SRVGen final : RRGenOf<RRKind::SRV>
 {
   SRVGen(uint16_t preference, uint16_t weight, uint16_t port, const DNSName& target) : 
     d_preference(preference), d_weight(weight), d_port(port), d_target(target)
@@ -142,11 +158,11 @@ struct SRVGen : RRGen
   template<typename X> void doConv(X& x);
 
   uint16_t d_preference, d_weight, d_port;
-  DNSName d_target;
+  InternedName d_target;
 };
 
 //! Generates a NAPTR Resource Record
-struct NAPTRGen : RRGen
+struct NAPTRGen final : RRGenOf<RRKind::NAPTR>
 {
   NAPTRGen(uint16_t order, uint16_t pref, const std::string& flags,
            const std::string& services, const std::string& regexp,
@@ -168,7 +184,7 @@ struct NAPTRGen : RRGen
 
 
 //! Generates a CNAME Resource Record
-struct CNAMEGen : RRGen
+struct CNAMEGen final : RRGenOf<RRKind::CNAME>
 {
   CNAMEGen(const DNSName& name) : d_name(name) {}
   CNAMEGen(DNSMessageReader& dmr);
@@ -180,11 +196,11 @@ struct CNAMEGen : RRGen
   std::string toString() const override;
   DNSType getType() const override { return DNSType::CNAME; }
   
-  DNSName d_name;
+  InternedName d_name;
 };
 
 //! Generates a PTR Resource Record
-struct PTRGen : RRGen
+struct PTRGen final : RRGenOf<RRKind::PTR>
 {
   PTRGen(const DNSName& name) : d_name(name) {}
   PTRGen(DNSMessageReader& dmr);
@@ -195,11 +211,11 @@ struct PTRGen : RRGen
   void toMessage(DNSMessageWriter& dpw) override;
   std::string toString() const override;
   DNSType getType() const override { return DNSType::PTR; }
-  DNSName d_name;
+  InternedName d_name;
 };
 
 //! Generates an NS Resource Record
-struct NSGen : RRGen
+struct NSGen final : RRGenOf<RRKind::NS>
 {
   NSGen(const DNSName& name) : d_name(name) {}
   NSGen(DNSMessageReader& dmr);
@@ -210,11 +226,11 @@ struct NSGen : RRGen
   void toMessage(DNSMessageWriter& dpw) override;
   std::string toString() const override;
   DNSType getType() const override { return DNSType::NS; }
-  DNSName d_name;
+  InternedName d_name;
 };
 
 //! Generates an MX Resource Record
-struct MXGen : RRGen
+struct MXGen final : RRGenOf<RRKind::MX>
 {
   MXGen(uint16_t prio, const DNSName& name) : d_prio(prio), d_name(name) {}
   MXGen(DNSMessageReader& dmr);
@@ -227,11 +243,11 @@ struct MXGen : RRGen
   std::string toString() const override;
   DNSType getType() const override { return DNSType::MX; }
   uint16_t d_prio;
-  DNSName d_name;
+  InternedName d_name;
 };
 
 //! Generates an RRSIG Resource Record
-struct RRSIGGen : RRGen
+struct RRSIGGen final : RRGenOf<RRKind::RRSIG>
 {
   RRSIGGen(DNSType type, uint16_t tag, const DNSName& signer, const std::string& signature,
         uint32_t origttl, uint32_t expire, uint32_t inception, uint8_t algo, uint8_t labels) :
@@ -246,7 +262,7 @@ struct RRSIGGen : RRGen
   template<typename X> void doConv(X& x);
   DNSType d_type;
   uint16_t d_tag;
-  DNSName d_signer;
+  InternedName d_signer;
   std::string d_signature;
   uint32_t d_origttl, d_expire, d_inception;
   uint8_t d_algo, d_labels;
@@ -259,7 +275,7 @@ struct RRSIGGen : RRGen
 
 
 //! Generates an TXT Resource Record
-struct TXTGen : RRGen
+struct TXTGen final : RRGenOf<RRKind::TXT>
 {
   TXTGen(const std::vector<std::string>& txts) : d_txts(txts) {}
   TXTGen(DNSMessageReader& dr);
@@ -274,7 +290,7 @@ struct TXTGen : RRGen
 };
 
 //! This implements 'unknown record types'
-struct UnknownGen : RRGen
+struct UnknownGen final : RRGenOf<RRKind::Unknown>
 {
   UnknownGen(DNSType type, const std::string& rr) : d_type(type), d_rr(rr) {}
   DNSType d_type;
@@ -285,7 +301,7 @@ struct UnknownGen : RRGen
 };
 
 //! This implements a fun dynamic TXT record type 
-struct ClockTXTGen : RRGen
+struct ClockTXTGen final : RRGenOf<RRKind::ClockTXT>
 {
   ClockTXTGen(const std::string& format) : d_format(format) {}
   static std::unique_ptr<RRGen> make(const std::string& format)
@@ -295,5 +311,64 @@ struct ClockTXTGen : RRGen
   void toMessage(DNSMessageWriter& dpw) override;
   std::string toString() const override { return d_format; }
   DNSType getType() const override { return DNSType::TXT; }
+  bool isDynamic() const override { return true; }
   std::string d_format;
 };
+
+//! Returns rr as a T if it is one, nullptr otherwise. Like dynamic_cast, but only compares a tag
+template<typename T>
+T* rrCast(RRGen* rr)
+{
+  return rr && rr->d_kind == T::kind ? static_cast<T*>(rr) : nullptr;
+}
+template<typename T>
+const T* rrCast(const RRGen* rr)
+{
+  return rr && rr->d_kind == T::kind ? static_cast<const T*>(rr) : nullptr;
+}
+template<typename T>
+T* rrCast(const std::unique_ptr<RRGen>& rr)
+{
+  return rrCast<T>(rr.get());
+}
+
+//! T, const if G is
+template<typename T, typename G>
+using SameConst = std::conditional_t<std::is_const<G>::value, const T, T>;
+
+//! Calls f with rr as its concrete generator type, const if rr is, and returns what f returns
+template<typename G, typename F>
+decltype(auto) visitRR(G& rr, F&& f)
+{
+  static_assert(std::is_same<std::remove_const_t<G>, RRGen>::value, "visitRR is for RRGen");
+  switch(rr.d_kind) {
+  case RRKind::A:        return f(static_cast<SameConst<AGen, G>&>(rr));
+  case RRKind::AAAA:     return f(static_cast<SameConst<AAAAGen, G>&>(rr));
+  case RRKind::NS:       return f(static_cast<SameConst<NSGen, G>&>(rr));
+  case RRKind::CNAME:    return f(static_cast<SameConst<CNAMEGen, G>&>(rr));
+  case RRKind::MX:       return f(static_cast<SameConst<MXGen, G>&>(rr));
+  case RRKind::SOA:      return f(static_cast<SameConst<SOAGen, G>&>(rr));
+  case RRKind::TXT:      return f(static_cast<SameConst<TXTGen, G>&>(rr));
+  case RRKind::SRV:      return f(static_cast<SameConst<SRVGen, G>&>(rr));
+  case RRKind::NAPTR:    return f(static_cast<SameConst<NAPTRGen, G>&>(rr));
+  case RRKind::PTR:      return f(static_cast<SameConst<PTRGen, G>&>(rr));
+  case RRKind::RRSIG:    return f(static_cast<SameConst<RRSIGGen, G>&>(rr));
+  case RRKind::Unknown:  return f(static_cast<SameConst<UnknownGen, G>&>(rr));
+  case RRKind::ClockTXT: return f(static_cast<SameConst<ClockTXTGen, G>&>(rr));
+  }
+  throw std::runtime_error("Unknown record kind");
+}
+
+//! The name a CNAME, NS, PTR or MX record points to
+DNSName getTargetName(const std::unique_ptr<RRGen>& rr);
+//! Same, for a pre-rendered record
+DNSName getTargetName(const RDataView& rr);
+//! The 'minimum' field of a SOA record, which caps the TTL of negative answers
+uint32_t getSOAMinimum(const std::unique_ptr<RRGen>& rr);
+//! Same, for a pre-rendered record
+uint32_t getSOAMinimum(const RDataView& rr);
+//! The serial of a pre-rendered SOA record
+uint32_t getSOASerial(const RDataView& rr);
+
+//! A copy of 'rr', of the same generator type, allocated like any other record
+std::unique_ptr<RRGen> cloneRR(const RRGen& rr);
@@ -4,18 +4,67 @@
 
 using namespace std;
 
-void launchDNSServer(vector<ComboAddress> locals);
+void launchDNSServer(vector<ComboAddress> locals, const std::string& snapshotdir, FindEngine engine, bool compile);
+
+static int syntax()
+{
+  cerr<<"Syntax: tdns [--snapshot-dir directory] [--find-engine tree|radix] [--serve-from image|tree] ipaddress:port [ipaddress:port] .. [[ipv6address]:port]] .."<<endl;
+  return(EXIT_FAILURE);
+}
 
 int main(int argc, char** argv)
 {
-  if(argc < 2) {
-    cerr<<"Syntax: tdns ipaddress:port [ipaddress:port] .. [[ipv6address]:port]] .."<<endl;
-    return(EXIT_FAILURE);
+  string snapshotdir;
+  FindEngine engine = FindEngine::Tree;
+  bool compile = true;
+  int n = 1;
+  for(; n < argc && string(argv[n]).compare(0, 2, "--") == 0; n += 2) {
+    string option(argv[n]);
+    if(n + 1 >= argc) {
+      cerr<<"Option "<<option<<" needs a value"<<endl;
+      return syntax();
+    }
+    string value(argv[n + 1]);
+    if(option == "--snapshot-dir") // zones are saved there, and loaded from there on the next start
+      snapshotdir = value;
+    else if(option == "--find-engine") {
+      if(value == "tree")
+        engine = FindEngine::Tree;
+      else if(value == "radix")
+        engine = FindEngine::Radix;
+      else {
+        cerr<<"Unknown find engine '"<<value<<"'"<<endl;
+        return syntax();
+      }
+    }
+    else if(option == "--serve-from") { // trees take more memory, but a reload can change them in place
+      if(value == "image")
+        compile = true;
+      else if(value == "tree")
+        compile = false;
+      else {
+        cerr<<"Unknown way to serve zones '"<<value<<"'"<<endl;
+        return syntax();
+      }
+    }
+    else {
+      cerr<<"Unknown option "<<option<<endl;
+      return syntax();
+    }
   }
+  if(argc <= n)
+    return syntax();
 
   vector<ComboAddress> locals;
-  for(int n= 1; n < argc; ++n)
-    locals.emplace_back(argv[n], 53);
+  for(; n < argc; ++n) {
+    try {
+      locals.emplace_back(argv[n], 53);
+    }
+    catch(std::exception& e) {
+      cerr<<"Not an address to listen on: "<<argv[n]<<endl;
+      return syntax();
+    }
+  }
 
-  launchDNSServer(locals);
+  launchDNSServer(locals, snapshotdir, engine, compile);
 }
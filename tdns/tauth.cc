@@ -6,6 +6,8 @@
    @file 
    @brief This is the main file of the tdns authoritative server
 */
+#include <atomic>
+#include <cerrno>
 #include <cstdint>
 #include <vector>
 #include <map>
@@ -16,6 +18,8 @@
 #include "record-types.hh"
 #include "dns-storage.hh"
 #include "tdnssec.hh"
+#include "zone-image.hh"
+#include "rcu.hh"
 
 using namespace std;
 
@@ -30,7 +34,8 @@ using namespace std;
     DNSMessageReader is used to read DNS messages. A UDP DNS Packet is also a DNS message.
     DNSMessageWriter is used to create DNS messages.
 
-    A DNS name is stored in a DNSName object and internally consists of DNSLabel's. 
+    A DNS name is stored in a DNSName object and consists of DNSLabel's, which it
+    keeps in wire format in a buffer of its own. 
 
     DNS messages also mostly have a query name, which is a DNSName and a query type which is a DNSType. They also have a DNSClass but we don't do much with that.
 
@@ -53,10 +58,159 @@ using namespace std;
     by the DNSNode class, for which see dns-storage.hh
 */
 
-void addAdditional(const DNSNode* bestzone, const DNSName& zone, const vector<DNSName>& toresolve, DNSMessageWriter& response);
+template<typename Node>
+void addAdditional(const Node* bestzone, const DNSName& zone, const vector<DNSName>& toresolve, DNSMessageWriter& response);
 
 void reportQuery(DNSName qname, DNSClass qclass, DNSType qtype, const ComboAddress& remote);
 
+//! What questions are answered from. A reload replaces all of it in one go, or changes the zones in it
+struct ServedZones
+{
+  std::unique_ptr<DNSNode> tree;
+  //! Worked out once per tree for CH TXT memory.tdns, so a question never walks the zones
+  std::vector<std::pair<DNSName, MemoryUsage>> memory;
+  //! The zones we retrieved, and from where. A reload asks there what changed, see refreshZones()
+  std::vector<std::pair<DNSName, ComboAddress>> remotes;
+};
+
+//! How often findExact() answered for a zone, and how often we had to go to find(). See CH TXT stats.tdns
+static std::atomic<uint64_t> g_exactHits{0}, g_exactMisses{0};
+
+/** \brief Answers a question from the zone we found for it
+
+   This is the second half of processQuestion, after the best zone has been
+   found. qname is relative to zonename. It is a template so it can answer
+   from a DNSNode tree, or from its compiled form, a ZoneImage::Node. */
+template<typename Node>
+void answerFromZone(const Node* bestzone, const DNSName& zonename, const DNSName& qname, DNSType qtype, bool doBit, DNSMessageWriter& response)
+{
+  auto soaiter = bestzone->rrsets.find(DNSType::SOA);
+  if(soaiter == bestzone->rrsets.end())
+    throw std::runtime_error("Zone "+zonename.toString()+" has no SOA record");
+  const auto& soarrset = soaiter->second;
+
+  // if they wanted DNSSEC and we got it!
+  bool mustDoDNSSEC= doBit && !soarrset.signatures.empty();
+  
+  DNSName searchname(qname), lastnode;
+  const Node* passedZonecut=0, *passedWcard=0;
+  int CNAMELoopCount = 0;
+  
+loopCNAME:;
+  /* search for the best node, where we want to benefit from wildcard synthesis
+     note that this is the same 'find' we used to find the best zone, but we did not
+     want any wildcard processing there.
+
+     Names that exist and are not delegated are a single hash lookup away, for those
+     find() would match all labels and pass no zone cut or wildcard */
+
+  auto node = bestzone->findExact(searchname);
+  if(node) {
+    g_exactHits.fetch_add(1, std::memory_order_relaxed);
+    lastnode = searchname;
+    searchname.clear();
+  }
+  else {
+    g_exactMisses.fetch_add(1, std::memory_order_relaxed);
+    node = bestzone->find(searchname, lastnode, true, &passedZonecut, &passedWcard);
+  }
+  if(passedZonecut) {
+    response.dh.aa = false;
+    cout<<"\tThis is a delegation, zonecutname: '"<<passedZonecut->getName()<<"'"<<endl;
+    vector<DNSName> toresolve;
+
+    auto iter = passedZonecut->rrsets.find(DNSType::NS);  // is there an NS record here? should be!
+    if(iter != passedZonecut->rrsets.end()) {
+      const auto& rrset = iter->second;
+
+      for(const auto& rr : rrset.contents) {
+        /* add the NS records to the authority section. Note that for this we have to make
+           the name absolute again: zonecutname + zonename */
+        response.putRR(DNSSection::Authority, passedZonecut->getName()+zonename, rrset.ttl, rr);
+        // and add for additional processing
+        toresolve.push_back(getTargetName(rr));
+      }
+    }
+    if(mustDoDNSSEC) 
+      addDSToDelegation(response, passedZonecut, zonename);
+    
+    addAdditional(bestzone, zonename, toresolve, response);
+  }
+  else if(!searchname.empty()) { // we had parts of the qname that did not match
+    cout<<"\tThis is an NXDOMAIN situation, unmatched parts: "<<searchname<<", lastnode: "<<lastnode<<endl;
+
+    const auto& rrset = soarrset; // fetch the SOA record to indicate NXDOMAIN ttl
+    auto ttl = min(rrset.ttl, getSOAMinimum(rrset.contents[0])); // 2308 3
+
+    response.putRR(DNSSection::Authority, zonename, ttl, rrset.contents[0]);
+    
+    if(mustDoDNSSEC) { // should do DNSSEC
+      addNXDOMAINDNSSEC(response, rrset, qname, node, passedZonecut, zonename);
+    }
+    if(!CNAMELoopCount) // RFC 1034, 4.3.2, step 3.c
+      response.dh.rcode = (int)RCode::Nxdomain;
+  }
+  else {
+    cout<<"\tFound node in zone '"<<zonename<<"' for lhs '"<<qname<<"', searchname now '"<<searchname<<"', lastnode '"<<lastnode<<"', passedZonecut="<<passedZonecut<<endl;
+    
+    auto iter = node->rrsets.end();
+
+    vector<DNSName> additional;
+    // first we always check for a CNAME, which should be the only RRType at a node if present
+    if(iter = node->rrsets.find(DNSType::CNAME), iter != node->rrsets.end()) {
+      cout<<"\tCNAME"<<endl;
+      const auto& rrset = iter->second;
+      response.putRR(DNSSection::Answer, lastnode+zonename, rrset.ttl, rrset.contents[0]);
+      if(mustDoDNSSEC) {
+        addSignatures(response, rrset, lastnode, passedWcard, zonename);
+      }
+
+      DNSName target=getTargetName(rrset.contents[0]);
+
+      // we'll only follow in-zone CNAMEs, which is not quite per-RFC, but a good idea
+      if(target.makeRelative(zonename)) {
+        cout<<"\tFound CNAME, chasing to "<<target<<endl;
+        searchname = target; 
+        if(qtype != DNSType::CNAME && CNAMELoopCount++ < 10) {  // do not loop if they *wanted* the CNAME
+          lastnode.clear();
+          goto loopCNAME;
+        }
+      }
+    }  // we have a node, and it might even have RRSets we want
+    else if(iter = node->rrsets.find(qtype), iter != node->rrsets.end() || (!node->rrsets.empty() && qtype==DNSType::ANY)) {
+      if(passedWcard)
+        cout<<"\tWe had a wildcard synthesised match. Name of wildcard: "<<passedWcard->getName()<<endl;
+      auto range = make_pair(iter, iter);
+      
+      if(qtype == DNSType::ANY) // if ANY, loop over all types
+        range = make_pair(node->rrsets.begin(), node->rrsets.end());
+      else
+        ++range.second;         // only the qtype they wanted
+      for(auto i2 = range.first; i2 != range.second; ++i2) {
+        const auto& rrset = i2->second;
+        for(const auto& rr : rrset.contents) {
+          cout<<"\tAdding a " << i2->first <<" RR\n";
+          response.putRR(DNSSection::Answer, lastnode+zonename, rrset.ttl, rr);
+          if(i2->first == DNSType::MX)
+            additional.push_back(getTargetName(rr));
+        }
+        if(mustDoDNSSEC) 
+          addSignatures(response, rrset, lastnode, passedWcard, zonename);
+      }
+    }
+    else {
+      cout<<"\tNode exists, qtype doesn't, NOERROR situation, inserting SOA"<<endl;
+      const auto& rrset = soarrset;
+      auto ttl = min(rrset.ttl, getSOAMinimum(rrset.contents[0])); // 2308 3
+
+      response.putRR(DNSSection::Authority, zonename, ttl, rrset.contents[0]);
+      if(mustDoDNSSEC) 
+        addNoErrorDNSSEC(response, node, rrset, zonename);
+    }
+    addAdditional(bestzone, zonename, additional, response);
+  }
+}
+
 /** \brief This is the main DNS logic function
 
    This is the main 'DNS logic' function. It receives a set of zones,
@@ -68,10 +222,14 @@ void reportQuery(DNSName qname, DNSClass qclass, DNSType qtype, const ComboAddre
 
    Returns false if no response should be sent.
 
+   The reader is usually a DNSMessageReader::view() of the listener's buffer,
+   so this function must not keep it, or a copy of it, around after returning.
+
    This function implements "the algorithm" from RFC 1034 and is key to 
    unstanding DNS */
-bool processQuestion(const DNSNode& zones, DNSMessageReader& dm, const ComboAddress& remote, DNSMessageWriter& response)
+bool processQuestion(const ServedZones& served, DNSMessageReader& dm, const ComboAddress& remote, DNSMessageWriter& response)
 {
+  const DNSNode& zones = *served.tree;
   if(dm.dh.qr) {
     cerr<<"Dropping non-query from "<<remote.toStringWithPort()<<endl;
     return false; // should not send ANY kind of response, loop potential
@@ -122,6 +280,18 @@ bool processQuestion(const DNSNode& zones, DNSMessageReader& dm, const ComboAddr
           response.putRR(DNSSection::Answer, qname, 3600, TXTGen::make({"tdns compiled on " __DATE__ " " __TIME__ }), dm.d_qclass);
           return true;
         }
+        if(qname == DNSName({"memory", "tdns"})) { // one TXT record per zone, see MemoryUsage
+          for(const auto& z : served.memory) {
+            auto txts = z.second.describe();
+            txts.insert(txts.begin(), z.first.toString());
+            response.putRR(DNSSection::Answer, qname, 0, TXTGen::make(txts), dm.d_qclass);
+          }
+          return true;
+        }
+        if(qname == DNSName({"stats", "tdns"})) {
+          response.putRR(DNSSection::Answer, qname, 0, TXTGen::make({"exact-match hits "+to_string(g_exactHits.load())+" misses "+to_string(g_exactMisses.load())}), dm.d_qclass);
+          return true;
+        }
       }
       response.dh.rcode = (int)RCode::Refused;
       return true;
@@ -134,7 +304,7 @@ bool processQuestion(const DNSNode& zones, DNSMessageReader& dm, const ComboAddr
     // find the best zone for this query
     DNSName zonename;
     auto fnd = zones.find(qname, zonename); 
-    if(!fnd || !fnd->zone) {  // check if we found an actual zone
+    if(!fnd || !fnd->hasZone()) {  // check if we found an actual zone
       cout<<"\tNo zone matched ("<< (void*)fnd<<")" <<endl;
       if(fnd)
         cout<<"\tLast match was "<<fnd->getName()<<", zone = "<<(void*)fnd->zone.get()<<endl;
@@ -145,7 +315,7 @@ bool processQuestion(const DNSNode& zones, DNSMessageReader& dm, const ComboAddr
         if(!fnd) break;
 
         cout<<"\tTrying parent node"<<endl;
-        if(fnd->zone) {
+        if(fnd->hasZone()) {
           zonename = fnd->getName();
           break;
         }
@@ -160,117 +330,11 @@ bool processQuestion(const DNSNode& zones, DNSMessageReader& dm, const ComboAddr
     // qname is now relative to the zonename
     cout<<"\tFound best zone: "<<zonename<<", qname now "<<qname<<endl;
     response.dh.aa = 1; 
-    
-    auto bestzone = fnd->zone.get(); // this loads a pointer to the zone contents
 
-    // if they wanted DNSSEC and we got it!
-    bool mustDoDNSSEC= doBit && !bestzone->rrsets[DNSType::SOA].signatures.empty();
-    
-    DNSName searchname(qname), lastnode;
-    const DNSNode* passedZonecut=0, *passedWcard=0;
-    int CNAMELoopCount = 0;
-    
-  loopCNAME:;
-    /* search for the best node, where we want to benefit from wildcard synthesis
-       note that this is the same 'find' we used to find the best zone, but we did not
-       want any wildcard processing there */
-    
-    auto node = bestzone->find(searchname, lastnode, true, &passedZonecut, &passedWcard);
-    if(passedZonecut) {
-      response.dh.aa = false;
-      cout<<"\tThis is a delegation, zonecutname: '"<<passedZonecut->getName()<<"'"<<endl;
-      vector<DNSName> toresolve;
-
-      auto iter = passedZonecut->rrsets.find(DNSType::NS);  // is there an NS record here? should be!
-      if(iter != passedZonecut->rrsets.end()) {
-        const auto& rrset = iter->second;
-
-        for(const auto& rr : rrset.contents) {
-          /* add the NS records to the authority section. Note that for this we have to make
-             the name absolute again: zonecutname + zonename */
-          response.putRR(DNSSection::Authority, passedZonecut->getName()+zonename, rrset.ttl, rr);
-          // and add for additional processing
-          toresolve.push_back(dynamic_cast<NSGen*>(rr.get())->d_name);
-        }
-      }
-      if(mustDoDNSSEC) 
-        addDSToDelegation(response, passedZonecut, zonename);
-      
-      addAdditional(bestzone, zonename, toresolve, response);
-    }
-    else if(!searchname.empty()) { // we had parts of the qname that did not match
-      cout<<"\tThis is an NXDOMAIN situation, unmatched parts: "<<searchname<<", lastnode: "<<lastnode<<endl;
-
-      const auto& rrset = bestzone->rrsets[DNSType::SOA]; // fetch the SOA record to indicate NXDOMAIN ttl
-      auto ttl = min(rrset.ttl, dynamic_cast<SOAGen*>(rrset.contents[0].get())->d_minimum); // 2308 3
-
-      response.putRR(DNSSection::Authority, zonename, ttl, rrset.contents[0]);
-      
-      if(mustDoDNSSEC) { // should do DNSSEC
-        addNXDOMAINDNSSEC(response, rrset, qname, node, passedZonecut, zonename);
-      }
-      if(!CNAMELoopCount) // RFC 1034, 4.3.2, step 3.c
-        response.dh.rcode = (int)RCode::Nxdomain;
-    }
-    else {
-      cout<<"\tFound node in zone '"<<zonename<<"' for lhs '"<<qname<<"', searchname now '"<<searchname<<"', lastnode '"<<lastnode<<"', passedZonecut="<<passedZonecut<<endl;
-      
-      decltype(node->rrsets)::const_iterator iter;
-
-      vector<DNSName> additional;
-      // first we always check for a CNAME, which should be the only RRType at a node if present
-      if(iter = node->rrsets.find(DNSType::CNAME), iter != node->rrsets.end()) {
-        cout<<"\tCNAME"<<endl;
-        const auto& rrset = iter->second;
-        response.putRR(DNSSection::Answer, lastnode+zonename, rrset.ttl, rrset.contents[0]);
-        if(mustDoDNSSEC) {
-          addSignatures(response, rrset, lastnode, passedWcard, zonename);
-        }
-
-        DNSName target=dynamic_cast<CNAMEGen*>(rrset.contents[0].get())->d_name;
-
-        // we'll only follow in-zone CNAMEs, which is not quite per-RFC, but a good idea
-        if(target.makeRelative(zonename)) {
-          cout<<"\tFound CNAME, chasing to "<<target<<endl;
-          searchname = target; 
-          if(qtype != DNSType::CNAME && CNAMELoopCount++ < 10) {  // do not loop if they *wanted* the CNAME
-            lastnode.clear();
-            goto loopCNAME;
-          }
-        }
-      }  // we have a node, and it might even have RRSets we want
-      else if(iter = node->rrsets.find(qtype), iter != node->rrsets.end() || (!node->rrsets.empty() && qtype==DNSType::ANY)) {
-        if(passedWcard)
-          cout<<"\tWe had a wildcard synthesised match. Name of wildcard: "<<passedWcard->getName()<<endl;
-        auto range = make_pair(iter, iter);
-        
-        if(qtype == DNSType::ANY) // if ANY, loop over all types
-          range = make_pair(node->rrsets.begin(), node->rrsets.end());
-        else
-          ++range.second;         // only the qtype they wanted
-        for(auto i2 = range.first; i2 != range.second; ++i2) {
-          const auto& rrset = i2->second;
-          for(const auto& rr : rrset.contents) {
-            cout<<"\tAdding a " << i2->first <<" RR\n";
-            response.putRR(DNSSection::Answer, lastnode+zonename, rrset.ttl, rr);
-            if(i2->first == DNSType::MX)
-              additional.push_back(dynamic_cast<MXGen*>(rr.get())->d_name);
-          }
-          if(mustDoDNSSEC) 
-            addSignatures(response, rrset, lastnode, passedWcard, zonename);
-        }
-      }
-      else {
-        cout<<"\tNode exists, qtype doesn't, NOERROR situation, inserting SOA"<<endl;
-        const auto& rrset = bestzone->rrsets[DNSType::SOA];
-        auto ttl = min(rrset.ttl, dynamic_cast<SOAGen*>(rrset.contents[0].get())->d_minimum); // 2308 3
-
-        response.putRR(DNSSection::Authority, zonename, ttl, rrset.contents[0]);
-        if(mustDoDNSSEC) 
-          addNoErrorDNSSEC(response, node, rrset, zonename);
-      }
-      addAdditional(bestzone, zonename, additional, response);
-    }
+    if(fnd->image) // the compiled form of the zone, see ZoneImage
+      answerFromZone(fnd->image->apex(), zonename, qname, qtype, doBit, response);
+    else
+      answerFromZone(fnd->zone.get(), zonename, qname, qtype, doBit, response);
     return true;
   }
   catch(std::out_of_range& e) { // exceeded packet size
@@ -287,21 +351,27 @@ bool processQuestion(const DNSNode& zones, DNSMessageReader& dm, const ComboAddr
 
 /* this is where all UDP questions come in. Note that 'zones' is const, 
    which protects us from accidentally changing anything */
-void udpThread(ComboAddress local, Socket* sock, const DNSNode* zones)
+void udpThread(ComboAddress local, Socket* sock, const RCUPtr<ServedZones>* zones)
 {
   DNSName qname;
   DNSType qtype;
+  char message[512];
 
   for(;;) {
     ComboAddress remote(local);
     try {
-      string message = SRecvfrom(*sock, 512, remote);
-      DNSMessageReader dm(message);
+      // straight into our buffer, which the reader then parses where it is
+      socklen_t remlen = sizeof(remote);
+      auto len = recvfrom(*sock, message, sizeof(message), 0, (struct sockaddr*)&remote, &remlen);
+      if(len < 0)
+        throw std::runtime_error("Receiving UDP query: "+string(strerror(errno)));
+      auto dm = DNSMessageReader::view(message, len);
       dm.getQuestion(qname, qtype);
       
       DNSMessageWriter response(qname, qtype, dm.d_qclass);
-      
-      if(processQuestion(*zones, dm, remote, response)) {
+
+      RCUPtr<ServedZones>::Pin pin(*zones); // a reload won't free these zones while we answer from them
+      if(processQuestion(*pin, dm, remote, response)) {
         if(response.dh.rcode)
           cout<<"\tSending response with rcode "<<(RCode)response.dh.rcode <<endl;
         
@@ -325,7 +395,8 @@ void udpThread(ComboAddress local, Socket* sock, const DNSNode* zones)
    out of zone data anyhow, but no RFC tells us we should not add that data.
 
    But we don't */
-void addAdditional(const DNSNode* bestzone, const DNSName& zone, const vector<DNSName>& toresolve, DNSMessageWriter& response)
+template<typename Node>
+void addAdditional(const Node* bestzone, const DNSName& zone, const vector<DNSName>& toresolve, DNSMessageWriter& response)
 try
 {
   for(auto addname : toresolve ) {
@@ -384,8 +455,59 @@ uint16_t tcpGetLen(int sock)
   return htons(len);
 }
 
+/*! \brief Sends the zone at 'node' as an AXFR
+
+   Returns false if this zone has no SOA, in which case nothing was sent. This is
+   a template so it can send from a DNSNode tree or from a ZoneImage */
+template<typename Node>
+static bool sendAXFR(int sock, const Node* node, const DNSName& zone, DNSMessageWriter& response)
+{
+  auto soaiter = node->rrsets.find(DNSType::SOA);
+  if(soaiter == node->rrsets.end())
+    return false;
+  const auto& soa = soaiter->second;
+
+  // send SOA, which is how an AXFR must start
+  response.putRR(DNSSection::Answer, zone, soa.ttl, soa.contents[0]);
+
+  writeTCPMessage(sock, response);
+  response.clearRRs();
+
+  // send all other records
+  const Node* n=node;
+  while(n) {
+    for(const auto& p : n->rrsets) {
+      for(const auto part : { &p.second.contents, &p.second.signatures} ) {
+        if(p.first == DNSType::SOA && part == &p.second.contents) // skip the SOA, as it indicates end of AXFR
+          continue;
+    
+        for(const auto& rr : *part) {
+        retry:
+          try {
+            response.putRR(DNSSection::Answer, n->getName()+zone, p.second.ttl, rr);
+          }
+          catch(std::out_of_range& e) { // exceeded packet size 
+            writeTCPMessage(sock, response);
+            response.clearRRs();
+            goto retry;
+          }
+        }
+      }
+    }
+    n=n->next();
+  }
+
+  writeTCPMessage(sock, response);
+  response.clearRRs();
+
+  // send SOA again
+  response.putRR(DNSSection::Answer, zone, soa.ttl, soa.contents[0]);
+  writeTCPMessage(sock, response);
+  return true;
+}
+
 /*! spawned for each new TCP/IP client. In actual production this is not a good idea. */
-void tcpClientThread(ComboAddress remote, int s, const DNSNode* zones)
+void tcpClientThread(ComboAddress remote, int s, const RCUPtr<ServedZones>* zones)
 try
 {
   signal(SIGPIPE, SIG_IGN);
@@ -408,13 +530,14 @@ try
     }
 
     std::string message = SRead(sock, len);
-    DNSMessageReader dm(message);
+    auto dm = DNSMessageReader::view(message.c_str(), message.size());
 
     DNSName name;
     DNSType type;
     dm.getQuestion(name, type);
 
     DNSMessageWriter response(name, type, DNSClass::IN, 16384);
+    RCUPtr<ServedZones>::Pin pin(*zones); // per question, so a long lived connection does not hold on to old zones
 
     if(type == DNSType::AXFR || type == DNSType::IXFR) {
       if(dm.dh.opcode || dm.dh.qr) {
@@ -430,57 +553,25 @@ try
       
       DNSName zone;
       // as in processQuestion, find the best zone
-      auto fnd = zones->find(name, zone);
-      if(!fnd || !fnd->zone || !name.empty() || !fnd->zone->rrsets.count(DNSType::SOA)) {
+      auto fnd = pin->tree->find(name, zone);
+      bool sent = false;
+      if(fnd && fnd->hasZone() && name.empty()) {
+        cout<<"Answering from zone "<<zone<<endl;
+        if(fnd->image)
+          sent = sendAXFR(sock, fnd->image->apex(), zone, response);
+        else
+          sent = sendAXFR(sock, fnd->zone.get(), zone, response);
+      }
+      if(!sent) {
         cout<<"   This was not a zone, or zone had no SOA"<<endl;
         response.dh.rcode = (int)RCode::Refused;
         writeTCPMessage(sock, response);
         continue;
       }
-      cout<<"Answering from zone "<<zone<<endl;
-      auto node = fnd->zone.get();
-
-      // send SOA, which is how an AXFR must start
-      response.putRR(DNSSection::Answer, zone, node->rrsets[DNSType::SOA].ttl, node->rrsets[DNSType::SOA].contents[0]);
-
-      writeTCPMessage(sock, response);
-      response.clearRRs();
-
-      // send all other records
-      const DNSNode* n=node;
-      while(n) {
-        for(const auto& p : n->rrsets) {
-          for(const auto part : { &p.second.contents, &p.second.signatures} ) {
-            if(p.first == DNSType::SOA && part == &p.second.contents) // skip the SOA, as it indicates end of AXFR
-              continue;
-        
-            for(const auto& rr : *part) {
-            retry:
-              try {
-                response.putRR(DNSSection::Answer, n->getName()+zone, p.second.ttl, rr);
-              }
-              catch(std::out_of_range& e) { // exceeded packet size 
-                writeTCPMessage(sock, response);
-                response.clearRRs();
-                goto retry;
-              }
-            }
-          }
-        }
-        n=n->next();
-      }
-
-      writeTCPMessage(sock, response);
-      response.clearRRs();
-
-      // send SOA again
-      response.putRR(DNSSection::Answer, zone, node->rrsets[DNSType::SOA].ttl, node->rrsets[DNSType::SOA].contents[0]);
-
-      writeTCPMessage(sock, response);
       return;
     }
     else {
-      if(processQuestion(*zones, dm, remote, response)) {
+      if(processQuestion(*pin, dm, remote, response)) {
         writeTCPMessage(sock, response);
       }
       else
@@ -503,7 +594,11 @@ std::unique_ptr<DNSNode> retrieveZone(const ComboAddress& remote, const DNSName&
   DNSMessageWriter dmw(zone, DNSType::AXFR);
   writeTCPMessage(tcp, dmw);
 
+  // the zone, its nodes and its records all live in one arena, which goes with the zone
+  auto arena = std::make_unique<Arena>();
+  ArenaScope scope(arena.get());
   auto ret = std::make_unique<DNSNode>();
+  ret->d_arena = std::move(arena);
   
   int soaCount=0;
   uint32_t rrcount=0;
@@ -511,7 +606,7 @@ std::unique_ptr<DNSNode> retrieveZone(const ComboAddress& remote, const DNSName&
     uint16_t len = tcpGetLen(tcp);
     string message = SRead(tcp, len);
     
-    DNSMessageReader dmr(message);
+    auto dmr = DNSMessageReader::view(message.c_str(), message.size());
 
     if(dmr.dh.rcode != (int)RCode::Noerror) {
       cout<<"Got error "<<(RCode)dmr.dh.rcode<<" from auth "<<remote.toStringWithPort()<< " when attempting to retrieve "<<zone<<endl;
@@ -538,26 +633,247 @@ std::unique_ptr<DNSNode> retrieveZone(const ComboAddress& remote, const DNSName&
   }
  done:
   cout<<"Done with AXFR of "<<zone<<" from "<<remote.toStringWithPort()<<", retrieved "<<rrcount<<" records"<<endl;
+  if(rrcount)
+    cout<<"Zone uses "<<ret->d_arena->reserved()<<" bytes of arena, "<<ret->d_arena->used()/rrcount<<" per record"<<endl;
+  return ret;
+}
+
+IXFRReader retrieveChanges(const ComboAddress& remote, const DNSName& zone, const SOAGen& soa)
+{
+  cout<<"Asking "<<remote.toStringWithPort()<<" what changed in "<<zone<<" since serial "<<soa.d_serial<<endl;
+  Socket tcp(remote.sin4.sin_family, SOCK_STREAM);
+  SConnect(tcp, remote);
+
+  // only the serial matters to the remote, but this is what we have
+  DNSMessageWriter dmw(zone, DNSType::IXFR);
+  dmw.putRR(DNSSection::Authority, zone, 0, SOAGen::make(soa.d_mname, soa.d_rname, soa.d_serial, soa.d_refresh, soa.d_retry, soa.d_expire, soa.d_minimum));
+  writeTCPMessage(tcp, dmw);
+
+  IXFRReader ret;
+  for(;;) {
+    uint16_t len = tcpGetLen(tcp);
+    if(!len)
+      throw std::runtime_error("IXFR of "+zone.toString()+" ended early");
+    string message = SRead(tcp, len);
+    auto dmr = DNSMessageReader::view(message.c_str(), message.size());
+    if(dmr.dh.rcode != (int)RCode::Noerror)
+      throw std::runtime_error("IXFR of "+zone.toString()+" got "+toString((RCode)dmr.dh.rcode));
+
+    DNSName rrname;
+    DNSType rrtype;
+    DNSSection rrsection;
+    uint32_t ttl;
+    std::unique_ptr<RRGen> rr;
+    while(dmr.getRR(rrsection, rrname, rrtype, ttl, rr)) {
+      if(rrsection != DNSSection::Answer || !rrname.makeRelative(zone))
+        continue;
+      if(!ret.add(rrname, ttl, std::move(rr)))
+        return ret;
+    }
+    if(ret.complete()) // we were up to date already
+      return ret;
+  }
+}
+
+//! Asks 'remote' for the SOA serial of 'zone'
+static uint32_t retrieveSerial(const ComboAddress& remote, const DNSName& zone)
+{
+  Socket tcp(remote.sin4.sin_family, SOCK_STREAM);
+  SConnect(tcp, remote);
+  DNSMessageWriter dmw(zone, DNSType::SOA);
+  writeTCPMessage(tcp, dmw);
+  uint16_t len = tcpGetLen(tcp);
+  DNSMessageReader dmr(SRead(tcp, len));
+
+  DNSSection section;
+  DNSName name;
+  DNSType type;
+  uint32_t ttl;
+  std::unique_ptr<RRGen> rr;
+  while(dmr.getRR(section, name, type, ttl, rr)) {
+    if(section == DNSSection::Answer && name == zone)
+      if(auto soa = rrCast<SOAGen>(rr))
+        return soa->d_serial;
+  }
+  throw std::runtime_error("no SOA for "+zone.toString()+" from "+remote.toStringWithPort());
+}
+
+static std::string g_snapshotdir; //!< where we keep zone snapshots, empty for none
+static bool g_reloading;          //!< if set, snapshots are only used if the remote still has the same serial
+static bool g_compile{true};      //!< if not set, zones are served from their trees, which a reload can change
+static std::vector<std::pair<DNSName, ComboAddress>> g_retrieved; //!< by addRemoteZone, see ServedZones
+
+void addRemoteZone(DNSNode& zones, const ComboAddress& remote, const DNSName& zone)
+{
+  if(!g_snapshotdir.empty()) {
+    auto fname = snapshotName(g_snapshotdir, zone);
+    try {
+      auto image = ZoneImage::load(fname);
+      if(!(image->zoneName() == zone))
+        throw std::runtime_error("it contains zone "+image->zoneName().toString());
+      // the snapshot is of what we serve now, so the zone only has to be built anew if it changed since
+      if(g_reloading) {
+        auto serial = retrieveSerial(remote, zone);
+        if(serial != image->serial())
+          throw std::runtime_error("serial "+to_string(image->serial())+" is not the current "+to_string(serial));
+      }
+      cout<<"Loaded zone "<<zone<<" with serial "<<image->serial()<<" from snapshot "<<fname<<endl;
+      zones.add(zone)->image = std::move(image);
+      return;
+    }
+    catch(std::exception& e) {
+      cout<<"Not using snapshot "<<fname<<": "<<e.what()<<endl;
+    }
+  }
+  auto tree = retrieveZone(remote, zone);
+  if(tree)
+    g_retrieved.push_back({zone, remote});
+  zones.add(zone)->zone = std::move(tree);
+}
+
+//! Loads all zones into a new tree, which is read-only from then on
+static std::unique_ptr<ServedZones> buildZones(FindEngine engine)
+{
+  auto served = std::make_unique<ServedZones>();
+  served->tree = std::make_unique<DNSNode>();
+  g_retrieved.clear();
+  loadZones(*served->tree);
+  served->remotes = std::move(g_retrieved);
+  served->tree->freeze(engine);
+  auto is = InternedName::stats();
+  cout<<"All zones share "<<is.names<<" interned names over "<<is.references<<" references, saving "<<is.saved()<<" bytes"<<endl;
+  if(g_compile)
+    compileZones(*served->tree, g_snapshotdir);
+  served->memory = zonesMemoryUsage(*served->tree);
+  return served;
+}
+
+//! For DoubleBuffered. The trees are copied, the images they hold are shared
+static std::unique_ptr<ServedZones> copyZones(const ServedZones& from)
+{
+  auto ret = std::make_unique<ServedZones>();
+  ret->tree = from.tree->clone();
+  ret->memory = from.memory;
+  ret->remotes = from.remotes;
   return ret;
 }
 
+//! The apex of 'zone' if we serve it from a tree, nullptr otherwise
+static DNSNode* servedTree(DNSNode& tree, DNSName zone)
+{
+  DNSNode* node = &tree;
+  for(; node && !zone.empty(); zone.pop_back())
+    node = const_cast<DNSNode*>(node->findChild(zone.back()));
+  return node ? node->zone.get() : nullptr;
+}
+
+/*! Asks the remote of each zone we retrieved what changed since, with an IXFR, and makes
+    those changes to both copies of the zones. Returns false, changing nothing, if one of the
+    zones is served from an image, or its remote sent the whole zone, in which case all zones
+    have to be loaded anew */
+static bool refreshZones(DoubleBuffered<ServedZones>& zones)
+{
+  std::map<DNSName, IXFRReader> changes;
+  {
+    RCUPtr<ServedZones>::Pin pin(zones.rcu());
+    for(const auto& r : pin->remotes) {
+      auto apex = servedTree(*pin->tree, r.first);
+      if(!apex)
+        return false;
+      auto iter = apex->rrsets.find(DNSType::SOA);
+      if(iter == apex->rrsets.end() || iter->second.contents.empty())
+        return false;
+      auto ixfr = retrieveChanges(r.second, r.first, *rrCast<SOAGen>(iter->second.contents[0]));
+      if(ixfr.full())
+        return false;
+      if(!ixfr.changesets.empty())
+        changes.emplace(r.first, std::move(ixfr));
+    }
+  }
+  if(changes.empty()) {
+    cout<<"All retrieved zones are up to date"<<endl;
+    return true;
+  }
+  zones.update([&](ServedZones& served) {
+      for(const auto& c : changes) {
+        auto apex = servedTree(*served.tree, c.first);
+        for(const auto& cs : c.second.changesets)
+          apex->apply(cs);
+        for(auto& m : served.memory)
+          if(m.first == c.first)
+            m.second = apex->memoryUsage();
+      }
+    });
+  for(const auto& c : changes)
+    cout<<"Applied "<<c.second.changesets.size()<<" changesets to "<<c.first<<endl;
+  return true;
+}
+
+/*! Reloads all zones on SIGHUP. If all zones we retrieved are served from trees, and their
+    remotes can tell us what changed, only those changes are made, see refreshZones(). Otherwise
+    a new tree is built while we keep answering from the old one, and replaces it in one go.
+    The old tree goes once the last question that was being answered from it is done */
+static void reloadThread(DoubleBuffered<ServedZones>* zones, FindEngine engine)
+{
+  sigset_t hup;
+  sigemptyset(&hup);
+  sigaddset(&hup, SIGHUP);
+  for(;;) {
+    int sig;
+    if(sigwait(&hup, &sig))
+      continue;
+    try {
+      if(refreshZones(*zones))
+        continue;
+    }
+    catch(std::exception& e) {
+      cout<<"Could not get the changes, reloading: "<<e.what()<<endl;
+    }
+    cout<<"Reloading & retrieving zone data"<<endl;
+    try {
+      g_reloading = true; // snapshots could be older than what the remote has, so check their serial
+      auto fresh = buildZones(engine);
+      g_reloading = false;
+      zones->replace(std::move(fresh));
+    }
+    catch(std::exception& e) {
+      g_reloading = false;
+      cerr<<"Reload failed, still serving the previous zones: "<<e.what()<<endl;
+      continue;
+    }
+    cout<<"Reload done"<<endl;
+  }
+}
+
 //! This is the main tdns function
-void launchDNSServer(vector<ComboAddress> locals)
+void launchDNSServer(vector<ComboAddress> locals, const std::string& snapshotdir, FindEngine engine, bool compile)
 try
 {
   cout<<"Hello and welcome to tdns, the teaching authoritative nameserver"<<endl;
   signal(SIGPIPE, SIG_IGN);
 
-  DNSNode zones;
+  // only reloadThread takes SIGHUP, and the threads we start inherit this mask
+  sigset_t hup;
+  sigemptyset(&hup);
+  sigaddset(&hup, SIGHUP);
+  pthread_sigmask(SIG_BLOCK, &hup, nullptr);
+
+  g_compile = compile;
+  if(compile)
+    g_snapshotdir = snapshotdir;
+  else if(!snapshotdir.empty())
+    cout<<"Zones are served from their trees, so there are no snapshots to use"<<endl;
   cout<<"Loading & retrieving zone data"<<endl;
-  loadZones(zones);
+  DoubleBuffered<ServedZones> zones(buildZones(engine), copyZones);
+  thread reloader(reloadThread, &zones, engine);
+  reloader.detach();
 
   auto tcploop = [&](Socket* tcplistener, const ComboAddress local) {
     cout<<"Listening on TCP on "<<local.toStringWithPort()<<endl;
     for(;;) {
       ComboAddress remote(local); // this sets the family correctly
       int client = SAccept(*tcplistener, remote);
-      thread t(tcpClientThread, remote, client, &zones);
+      thread t(tcpClientThread, remote, client, &zones.rcu());
       t.detach();
     }
   };
@@ -566,7 +882,7 @@ try
     auto udplistener = new Socket(local.sin4.sin_family, SOCK_DGRAM);
     SBind(*udplistener, local);
     cout<<"Listening on UDP on "<<local.toStringWithPort()<<endl;
-    thread udpServer(udpThread, local, udplistener, &zones);
+    thread udpServer(udpThread, local, udplistener, &zones.rcu());
     udpServer.detach();
 
     auto tcplistener = new Socket(local.sin4.sin_family, SOCK_STREAM);
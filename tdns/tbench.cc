@@ -0,0 +1,696 @@
+#include <chrono>
+#include <cstdlib>
+#include <new>
+#include <string>
+#include <vector>
+#include <unordered_set>
+#include <functional>
+#include <unistd.h>
+#include "dns-storage.hh"
+#include "dnsmessages.hh"
+#include "record-types.hh"
+#include "zone-image.hh"
+#include "radix-index.hh"
+#include "rcu.hh"
+
+/*!
+   @file
+   @brief Microbenchmarks for the hot paths of tdns
+
+   Each benchmark reports nanoseconds and heap allocations per operation.
+   Run `./tbench` for all of them, or `./tbench name` for just one.
+*/
+
+using namespace std;
+
+static uint64_t g_allocs, g_allocbytes;
+
+/* Every allocation and deallocation function is replaced, so each new is paired with a delete
+   of our own, and they all agree on malloc and free. These two stay out of line, or the compiler
+   sees a new expression's pointer go to free() and thinks they are mismatched */
+__attribute__((noinline)) static void* countedAlloc(size_t n)
+{
+  ++g_allocs;
+  g_allocbytes += n;
+  return malloc(n ? n : 1);
+}
+
+__attribute__((noinline)) static void countedFree(void* p)
+{
+  free(p);
+}
+
+void* operator new(size_t n)
+{
+  if(auto p = countedAlloc(n))
+    return p;
+  throw std::bad_alloc();
+}
+
+void* operator new[](size_t n)
+{
+  if(auto p = countedAlloc(n))
+    return p;
+  throw std::bad_alloc();
+}
+
+void* operator new(size_t n, const std::nothrow_t&) noexcept { return countedAlloc(n); }
+void* operator new[](size_t n, const std::nothrow_t&) noexcept { return countedAlloc(n); }
+void operator delete(void* p) noexcept { countedFree(p); }
+void operator delete[](void* p) noexcept { countedFree(p); }
+void operator delete(void* p, size_t) noexcept { countedFree(p); }
+void operator delete[](void* p, size_t) noexcept { countedFree(p); }
+void operator delete(void* p, const std::nothrow_t&) noexcept { countedFree(p); }
+void operator delete[](void* p, const std::nothrow_t&) noexcept { countedFree(p); }
+
+//! runs 'func' 'rounds' times, reports time and allocations per round
+static void bench(const std::string& name, unsigned int rounds, std::function<void()> func)
+{
+  auto allocs = g_allocs;
+  auto start = chrono::steady_clock::now();
+  for(unsigned int n = 0; n < rounds; ++n)
+    func();
+  auto finish = chrono::steady_clock::now();
+  allocs = g_allocs - allocs;
+  double nsec = chrono::duration_cast<chrono::nanoseconds>(finish - start).count();
+  cout << name << ": " << nsec/rounds << " ns/op, " << 1.0*allocs/rounds << " allocs/op" << endl;
+}
+
+//! A zone with 'count' hosts, spread over a few subzones, like you'd find in the real world
+static void fillZone(DNSNode& zone, unsigned int count)
+{
+  for(unsigned int n = 0; n < count; ++n) {
+    zone.add({"host"+to_string(n), "sub"+to_string(n%16)})->addRRs(AGen::make(ComboAddress("192.0.2.1")));
+  }
+}
+
+//! Building a zone from scratch, as retrieveZone does, on the heap and in an Arena
+static void benchZone()
+{
+  const unsigned int count = 100000;
+  for(int useArena = 0; useArena < 2; ++useArena) {
+    auto allocs = g_allocs, bytes = g_allocbytes;
+    auto start = chrono::steady_clock::now();
+    {
+      auto arena = std::make_unique<Arena>();
+      ArenaScope scope(useArena ? arena.get() : nullptr);
+      auto zone = std::make_unique<DNSNode>();
+      fillZone(*zone, count);
+      allocs = g_allocs - allocs;
+      bytes = g_allocbytes - bytes + arena->reserved();
+      zone->d_arena = std::move(arena);
+    }
+    auto finish = chrono::steady_clock::now(); // includes tearing it down again
+    double nsec = chrono::duration_cast<chrono::nanoseconds>(finish - start).count();
+    cout << "Zone of " << count << " records" << (useArena ? " in an arena" : " on the heap") << ": "
+         << nsec/count << " ns/record, " << 1.0*allocs/count << " allocs/record, "
+         << 1.0*bytes/count << " bytes/record" << endl;
+  }
+}
+
+//! A delegation heavy zone, like the root or a TLD, where every NS record points to one of a few names
+static void benchIntern()
+{
+  const unsigned int count = 100000;
+  DNSNode zone;
+  vector<DNSName> servers;
+  for(int n = 0; n < 4; ++n)
+    servers.push_back({"ns"+to_string(n), "nic", "example"});
+  auto before = InternedName::stats();
+  unsigned int n = 0;
+  bench("Zone of 100k NS records", count, [&]() {
+      zone.add({"delegation"+to_string(n)})->addRRs(NSGen::make(servers[n % servers.size()]));
+      ++n;
+    });
+  bench("Freezing it, which interns the names", 1, [&]() { zone.freeze(); });
+  auto after = InternedName::stats();
+  cout << "Interned " << after.names - before.names << " names for " << after.references - before.references
+       << " references, saving " << (after.saved() - before.saved())/count << " bytes/record" << endl;
+}
+
+static void benchNames()
+{
+  DNSName zone({"example", "com"});
+  bench("DNSName construction", 1000000, [&]() {
+      DNSName dn({"www", "example", "com"});
+      if(dn.empty()) abort();
+    });
+
+  DNSName dn({"www", "example", "com"}), res;
+  bench("DNSName copy", 1000000, [&]() {
+      res = dn;
+    });
+
+  bench("DNSName concatenation", 1000000, [&]() {
+      res = DNSName({"www"}) + zone;
+    });
+
+  bench("DNSName makeRelative", 1000000, [&]() {
+      res = dn;
+      if(!res.makeRelative(zone)) abort();
+    });
+
+  DNSName other({"WWW", "EXAMPLE", "COM"});
+  bench("DNSName equality", 1000000, [&]() {
+      if(!(dn == other)) abort();
+    });
+
+  DNSName longer({"a-rather-long-hostname-label", "example", "com"}), longer2({"A-RATHER-LONG-HOSTNAME-LABEM", "example", "com"});
+  bench("DNSName less than", 1000000, [&]() {
+      if(!(longer < longer2)) abort();
+    });
+
+  DNSLabel lab("a-rather-long-hostname-label"), lab2("A-RATHER-LONG-HOSTNAME-LABEM");
+  bench("DNSLabel less than", 1000000, [&]() {
+      if(!(lab < lab2)) abort();
+    });
+}
+
+//! Hashing names, and looking them up in a hashed set against an ordered one
+static void benchHash()
+{
+  DNSNameHash h;
+  DNSName dn({"www", "example", "com"});
+  DNSName longer({"a-rather-long-hostname-label", "Some-Department", "example", "com"});
+  bench("DNSNameHash, www.example.com", 1000000, [&]() {
+      if(h(dn) == 1) abort();
+    });
+  bench("DNSNameHash, long name", 1000000, [&]() {
+      if(h(longer) == 1) abort();
+    });
+  bench("ExactIndex::hash (FNV-1a), long name", 1000000, [&]() {
+      if(ExactIndex::hash(longer) == 1) abort();
+    });
+
+  set<DNSName> ordered;
+  unordered_set<DNSName, DNSNameHash, DNSNameEqual> hashed;
+  vector<DNSName> names;
+  for(unsigned int n = 0; n < 10000; ++n) {
+    names.push_back({"host"+to_string(n), "sub"+to_string(n%16), "example", "com"});
+    ordered.insert(names.back());
+    hashed.insert(names.back());
+  }
+  unsigned int pos = 0;
+  bench("std::set<DNSName>::find, 10k names", 1000000, [&]() {
+      if(!ordered.count(names[pos++ % names.size()])) abort();
+    });
+  pos = 0;
+  bench("std::unordered_set<DNSName>::find, 10k names", 1000000, [&]() {
+      if(!hashed.count(names[pos++ % names.size()])) abort();
+    });
+}
+
+//! makeDNSName as it was before DNSName::parse, one std::string per label and no escapes
+static DNSName oldMakeDNSName(const std::string& str)
+{
+  DNSName ret;
+  if(str==".")
+    return ret;
+
+  string part;
+  for(const auto& c: str) {
+    if(c=='.') {
+      ret.push_back(part);
+      part.clear();
+    }
+    else part.append(1, c);
+  }
+  if(!part.empty())
+    ret.push_back(part);
+  return ret;
+}
+
+//! Names as they come out of zone files, short and long
+static void benchParse()
+{
+  vector<string> mix{"www.example.com.", "ns1.example.net", "a.b.c.d.e.f.g.h.",
+      "_sip._tcp.a-rather-long-subdomain-name.example-hosting-provider.co.uk.",
+      "1.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.8.b.d.0.1.0.0.2.ip6.arpa.",
+      "mail-server-in-the-basement.department-of-redundancy-department.example.org."};
+  size_t bytes = 0;
+  for(const auto& m : mix)
+    bytes += m.size();
+  cout << "Mix of " << mix.size() << " names, " << bytes << " bytes" << endl;
+
+  unsigned int pos = 0;
+  bench("makeDNSName, old, per name", 1000000, [&]() {
+      if(oldMakeDNSName(mix[pos++ % mix.size()]).empty()) abort();
+    });
+  pos = 0;
+  bench("DNSName::parse, per name", 1000000, [&]() {
+      const auto& m = mix[pos++ % mix.size()];
+      if(DNSName::parse(m.c_str(), m.size()).empty()) abort();
+    });
+  string escaped("weird\\.name\\032with\\255escapes.example.com.");
+  bench("DNSName::parse, escapes", 1000000, [&]() {
+      if(DNSName::parse(escaped.c_str(), escaped.size()).empty()) abort();
+    });
+}
+
+static void benchFind()
+{
+  DNSNode zone;
+  fillZone(zone, 100000);
+  vector<DNSName> names;
+  for(unsigned int n = 0; n < 1000; ++n)
+    names.push_back({"host"+to_string(n*97), "sub"+to_string((n*97)%16)});
+
+  unsigned int pos = 0;
+  bench("DNSNode::find", 1000000, [&]() {
+      DNSName name = names[pos++ % names.size()], last;
+      zone.find(name, last);
+      if(!name.empty()) abort();
+    });
+
+  DNSName nxname({"nosuchhost", "sub1"});
+  bench("DNSNode::find wildcard miss", 1000000, [&]() {
+      DNSName name(nxname), last;
+      zone.find(name, last, true);
+    });
+
+  zone.freeze();
+  bench("DNSNode::find frozen", 1000000, [&]() {
+      DNSName name = names[pos++ % names.size()], last;
+      zone.find(name, last);
+      if(!name.empty()) abort();
+    });
+
+  bench("DNSNode::find frozen wildcard miss", 1000000, [&]() {
+      DNSName name(nxname), last;
+      zone.find(name, last, true);
+    });
+
+  ZoneImage image(zone, {"example", "com"});
+  auto apex = image.apex();
+  cout << "ZoneImage of " << image.size() << " bytes" << endl;
+  bench("ZoneImage::Node::find", 1000000, [&]() {
+      DNSName name = names[pos++ % names.size()], last;
+      apex->find(name, last);
+      if(!name.empty()) abort();
+    });
+
+  bench("ZoneImage::Node::find wildcard miss", 1000000, [&]() {
+      DNSName name(nxname), last;
+      apex->find(name, last, true);
+    });
+}
+
+/* Compares the find engines on a mix of queries, like a server sees them:
+   names that exist, names that don't, names below a wildcard and names below a delegation.
+   And on a tree of many zones, where each query finds its zone first */
+static void benchRadix()
+{
+  DNSNode zone;
+  fillZone(zone, 100000);
+  zone.add({"*", "sub3"})->addRRs(AGen::make("192.0.2.1"));
+  for(unsigned int n = 0; n < 1000; ++n)
+    zone.add({"delegation"+to_string(n)})->addRRs(NSGen::make({"ns1", "example", "com"}));
+
+  vector<DNSName> mix;
+  for(unsigned int n = 0; n < 1000; ++n) {
+    switch(n % 10) {
+    case 0: case 1: case 2: case 3: case 4: case 5:
+      mix.push_back({"host"+to_string(n*97), "sub"+to_string((n*97)%16)});
+      break;
+    case 6: case 7:
+      mix.push_back({"nosuchhost"+to_string(n), "sub"+to_string(n%16)});
+      break;
+    case 8:
+      mix.push_back({"www", "host"+to_string(n), "sub3"});
+      break;
+    case 9:
+      mix.push_back({"www", "delegation"+to_string(n)});
+      break;
+    }
+  }
+
+  DNSNode zones;
+  vector<DNSName> zonemix;
+  for(unsigned int n = 0; n < 100000; ++n)
+    zones.add({"domain"+to_string(n), n % 2 ? "com" : "net"})->zone = make_unique<DNSNode>();
+  for(unsigned int n = 0; n < 1000; ++n)
+    zonemix.push_back({"www", "domain"+to_string(n*97), n*97 % 2 ? "com" : "net"});
+
+  auto run = [](const string& name, const DNSNode& root, const vector<DNSName>& names) {
+    unsigned int pos = 0;
+    bench(name, 1000000, [&]() {
+        DNSName qname = names[pos++ % names.size()], last;
+        const DNSNode* zonecut = nullptr;
+        const DNSNode* wildcard = nullptr;
+        root.find(qname, last, true, &zonecut, &wildcard);
+      });
+  };
+  for(auto engine : {FindEngine::Tree, FindEngine::Radix}) {
+    string suffix = engine == FindEngine::Tree ? ", tree" : ", radix";
+    zone.freeze(engine);
+    zones.freeze(engine);
+    run("DNSNode::find query mix"+suffix, zone, mix);
+    run("DNSNode::find 100k zones"+suffix, zones, zonemix);
+    if(zone.d_radix)
+      cout << "RadixIndex of " << zone.d_radix->size() << " names uses " << zone.d_radix->memoryUsage() << " bytes" << endl;
+  }
+
+  // as answerFromZone does it, the exact match first. 'zone' is not the apex of a zone, so it has no ExactIndex of its own
+  ExactIndex exact(zone);
+  unsigned int pos = 0;
+  bench("ExactIndex::find, then DNSNode::find query mix", 1000000, [&]() {
+      DNSName qname = mix[pos++ % mix.size()], last;
+      const DNSNode* zonecut = nullptr;
+      const DNSNode* wildcard = nullptr;
+      if(!exact.find(qname))
+        zone.find(qname, last, true, &zonecut, &wildcard);
+    });
+
+  ZoneImage image(zone, {"example", "com"});
+  auto apex = image.apex();
+  bench("ZoneImage::Node::find query mix", 1000000, [&]() {
+      DNSName qname = mix[pos++ % mix.size()], last;
+      const ZoneImage::Node* zonecut = nullptr;
+      const ZoneImage::Node* wildcard = nullptr;
+      apex->find(qname, last, true, &zonecut, &wildcard);
+    });
+  bench("ZoneImage::Node::findExact, then find query mix", 1000000, [&]() {
+      DNSName qname = mix[pos++ % mix.size()], last;
+      const ZoneImage::Node* zonecut = nullptr;
+      const ZoneImage::Node* wildcard = nullptr;
+      if(!apex->findExact(qname))
+        apex->find(qname, last, true, &zonecut, &wildcard);
+    });
+}
+
+static void benchXfrName()
+{
+  DNSName qname({"www", "example", "com"});
+  DNSMessageWriter dmw(qname, DNSType::A, DNSClass::IN, 16384);
+  vector<DNSName> names;
+  for(unsigned int n = 0; n < 10; ++n)
+    names.push_back({"ns"+to_string(n), "example", "com"});
+
+  bench("DNSMessageWriter::xfrName", 100000, [&]() {
+      dmw.clearRRs();
+      for(const auto& name : names)
+        dmw.xfrName(name);
+    });
+
+  dmw.d_nocompress = true;
+  bench("DNSMessageWriter::xfrName uncompressed", 100000, [&]() {
+      dmw.clearRRs();
+      for(const auto& name : names)
+        dmw.xfrName(name);
+    });
+
+  // a referral from the root to com, 13 NS records with glue, in a new writer each time like tauth does
+  DNSName com({"com"});
+  vector<DNSName> servers;
+  for(char c = 'a'; c <= 'm'; ++c)
+    servers.push_back({string(1, c), "gtld-servers", "net"});
+  auto a = AGen::make(ComboAddress("192.0.2.1")), aaaa = AAAAGen::make(ComboAddress("2001:db8::1"));
+  vector<std::unique_ptr<RRGen>> nses;
+  for(const auto& s : servers)
+    nses.push_back(NSGen::make(s));
+  bench("DNSMessageWriter, root referral to com with glue", 100000, [&]() {
+      DNSMessageWriter referral(qname, DNSType::A, DNSClass::IN, 4096);
+      for(const auto& ns : nses)
+        referral.putRR(DNSSection::Authority, com, 172800, ns);
+      for(const auto& s : servers) {
+        referral.putRR(DNSSection::Additional, s, 172800, a);
+        referral.putRR(DNSSection::Additional, s, 172800, aaaa);
+      }
+      if(referral.serialize().size() < 500) abort();
+    });
+
+  // an AXFR message, as full as tauth makes them: hosts with an address, and a delegation now and then
+  DNSName zone({"example", "com"});
+  vector<DNSName> hosts;
+  for(unsigned int n = 0; n < 2000; ++n)
+    hosts.push_back(DNSName({"host" + to_string(n)}) + zone);
+  auto ns = NSGen::make(DNSName({"ns1"}) + zone);
+  DNSMessageWriter axfr(zone, DNSType::AXFR, DNSClass::IN, 16384);
+  bench("DNSMessageWriter, 16384 byte AXFR message", 10000, [&]() {
+      axfr.clearRRs();
+      unsigned int written = 0;
+      try {
+        for(const auto& host : hosts) {
+          axfr.putRR(DNSSection::Answer, host, 3600, (written % 8) ? a : ns);
+          ++written;
+        }
+      }
+      catch(std::out_of_range&) {} // full
+      if(written < 500) abort();
+    });
+}
+
+//! Parsing a typical query, copying the message or reading it where it is
+static void benchReader()
+{
+  DNSMessageWriter dmw(DNSName({"www", "example", "com"}), DNSType::A);
+  dmw.setEDNS(1232, true);
+  string query = dmw.serialize();
+  bench("DNSMessageReader, copying", 1000000, [&]() {
+      DNSMessageReader dmr(query);
+      uint16_t bufsize;
+      bool doBit;
+      if(!dmr.getEDNS(&bufsize, &doBit)) abort();
+    });
+  bench("DNSMessageReader::view", 1000000, [&]() {
+      auto dmr = DNSMessageReader::view(query.c_str(), query.size());
+      uint16_t bufsize;
+      bool doBit;
+      if(!dmr.getEDNS(&bufsize, &doBit)) abort();
+    });
+
+  // a query as a resolver might send it, with a subnet, a cookie and padding
+  DNSMessageWriter withOpts(DNSName({"www", "example", "com"}), DNSType::A);
+  withOpts.setEDNS(1232, true);
+  withOpts.addEDNSSubnet(ComboAddress("192.0.2.77"), 24);
+  withOpts.addEDNSOption(EDNSOptionCode::Cookie, "\x01\x02\x03\x04\x05\x06\x07\x08");
+  withOpts.setEDNSPadding(128);
+  string optQuery = withOpts.serialize();
+  bench("DNSMessageReader::view, query with EDNS options, not asking for them", 1000000, [&]() {
+      auto dmr = DNSMessageReader::view(optQuery.c_str(), optQuery.size());
+      uint16_t bufsize;
+      bool doBit;
+      if(!dmr.getEDNS(&bufsize, &doBit)) abort();
+    });
+  bench("DNSMessageReader::view, query with EDNS options, getting the subnet and cookie", 1000000, [&]() {
+      auto dmr = DNSMessageReader::view(optQuery.c_str(), optQuery.size());
+      auto opts = dmr.getEDNSOptions();
+      DNSMessageReader::EDNSOption opt;
+      ComboAddress ca;
+      uint8_t source, scope;
+      if(!opts.find(EDNSOptionCode::ClientSubnet, opt) || !opt.getSubnet(ca, source, scope)) abort();
+      if(!opts.find(EDNSOptionCode::Cookie, opt) || opt.size != 8) abort();
+    });
+  bench("DNSMessageWriter, query with EDNS options", 1000000, [&]() {
+      DNSMessageWriter w(DNSName({"www", "example", "com"}), DNSType::A);
+      w.setEDNS(1232, true);
+      w.addEDNSSubnet(ComboAddress("192.0.2.77"), 24);
+      w.addEDNSOption(EDNSOptionCode::Cookie, "\x01\x02\x03\x04\x05\x06\x07\x08");
+      w.setEDNSPadding(128);
+      if(w.serialize().size() != 128) abort();
+    });
+
+  DNSMessageWriter big(DNSName({"www", "example", "com"}), DNSType::A, DNSClass::IN, 16384);
+  big.setEDNS(4096, true);
+  for(int n = 0; n < 50; ++n)
+    big.putRR(DNSSection::Additional, {"host"+to_string(n), "example", "com"}, 3600,
+              n % 2 ? AGen::make(ComboAddress("192.0.2.1")) : AAAAGen::make(ComboAddress("2001:db8::1")));
+  string response = big.serialize();
+  bench("DNSMessageReader::view, response of 50 records, not asking for EDNS", 100000, [&]() {
+      auto dmr = DNSMessageReader::view(response.c_str(), response.size());
+      if(dmr.dh.qr) abort();
+    });
+  for(int checkEveryRead = 1; checkEveryRead >= 0; --checkEveryRead) {
+    bench(string("DNSMessageReader::getRR, all 50 A and AAAA records") + (checkEveryRead ? ", checking every read" : ""), 10000, [&]() {
+        auto dmr = DNSMessageReader::view(response.c_str(), response.size());
+        dmr.d_checkEveryRead = checkEveryRead;
+        DNSSection section;
+        DNSName name;
+        DNSType type;
+        uint32_t ttl;
+        std::unique_ptr<RRGen> rr;
+        while(dmr.getRR(section, name, type, ttl, rr))
+          ;
+      });
+  }
+  // a referral from the root to com, 13 NS records with glue, all names compressed
+  DNSName com({"com"});
+  DNSMessageWriter referral(DNSName({"www", "example", "com"}), DNSType::A, DNSClass::IN, 4096);
+  referral.setEDNS(4096, false);
+  for(char c = 'a'; c <= 'm'; ++c)
+    referral.putRR(DNSSection::Authority, com, 172800, NSGen::make({string(1, c), "gtld-servers", "net"}));
+  for(char c = 'a'; c <= 'm'; ++c) {
+    referral.putRR(DNSSection::Additional, {string(1, c), "gtld-servers", "net"}, 172800, AGen::make(ComboAddress("192.0.2.1")));
+    referral.putRR(DNSSection::Additional, {string(1, c), "gtld-servers", "net"}, 172800, AAAAGen::make(ComboAddress("2001:db8::1")));
+  }
+  string delegation = referral.serialize();
+  bench("DNSMessageReader::getRR, root referral to com with glue", 10000, [&]() {
+      auto dmr = DNSMessageReader::view(delegation.c_str(), delegation.size());
+      DNSSection section;
+      DNSName name;
+      DNSType type;
+      uint32_t ttl;
+      std::unique_ptr<RRGen> rr;
+      while(dmr.getRR(section, name, type, ttl, rr))
+        ;
+    });
+  bench("DNSMessageReader::visitRRs, root referral to com with glue, NS names and addresses", 10000, [&]() {
+      auto dmr = DNSMessageReader::view(delegation.c_str(), delegation.size());
+      dmr.visitRRs([](const DNSMessageReader::RRView& rr) {
+          if(rr.type == DNSType::NS) {
+            if(rr.getName(0).empty()) abort();
+          }
+          else if(rr.type == DNSType::A || rr.type == DNSType::AAAA)
+            rr.getIP();
+        });
+    });
+  bench("DNSMessageReader::index, 50 records", 100000, [&]() {
+      auto dmr = DNSMessageReader::view(response.c_str(), response.size());
+      if(dmr.index().size() != 51) abort();
+    });
+}
+
+static void benchPutRR()
+{
+  DNSName qname({"www", "example", "com"});
+  DNSMessageWriter dmw(qname, DNSType::A, DNSClass::IN, 16384);
+  DNSNode node;
+  node.addRRs(AGen::make("192.0.2.1"), AGen::make("192.0.2.2"), AGen::make("192.0.2.3"), AGen::make("192.0.2.4"));
+  node.addRRs(MXGen::make(10, {"mx1", "example", "com"}), MXGen::make(20, {"mx2", "example", "com"}));
+
+  ZoneImage image(node, DNSName({"example", "com"}));
+
+  for(auto type : {DNSType::A, DNSType::MX}) {
+    const auto& rrset = node.rrsets[type];
+    bench("DNSMessageWriter::putRR "+string(toString(type)), 100000, [&]() {
+        dmw.clearRRs();
+        for(const auto& rr : rrset.contents)
+          dmw.putRR(DNSSection::Answer, qname, rrset.ttl, rr);
+      });
+    auto view = image.apex()->rrsets.find(type)->second;
+    bench("DNSMessageWriter::putRR "+string(toString(type))+" pre-rendered, from a ZoneImage", 100000, [&]() {
+        dmw.clearRRs();
+        for(const auto& rr : view.contents)
+          dmw.putRR(DNSSection::Answer, qname, view.ttl, rr);
+      });
+  }
+}
+
+//! An AXFR style walk over a large zone with next(), as tree and as image
+static void benchWalk()
+{
+  const unsigned int count = 1000000;
+  DNSNode zone;
+  fillZone(zone, count);
+  unsigned int seen = 0;
+  auto walk = [&](const auto* start) {
+      seen = 0;
+      for(auto node = start; node; node = node->next())
+        ++seen;
+    };
+  auto prevs = [&](const auto* start) {
+      for(auto node = start; node; node = node->next())
+        if(node->d_parent && !node->prev()) abort();
+    };
+  bench("DNSNode::next walk over 1M names", 1, [&]() { walk(&zone); });
+  bench("DNSNode::prev over 1M names", 1, [&]() { prevs(&zone); });
+  zone.freeze();
+  bench("DNSNode::next walk over 1M names frozen", 1, [&]() { walk(&zone); });
+  bench("DNSNode::prev over 1M names frozen", 1, [&]() { prevs(&zone); });
+  ZoneImage image(zone, DNSName({"example", "com"}));
+  bench("ZoneImage::Node::next walk over 1M names", 1, [&]() { walk(image.apex()); });
+  cout << "walked " << seen << " nodes" << endl;
+}
+
+//! Startup: compiling a zone into an image, versus mapping a snapshot of it
+static void benchSnapshot()
+{
+  DNSNode zone;
+  fillZone(zone, 100000);
+  DNSName zonename({"example", "com"});
+  unique_ptr<ZoneImage> image;
+  bench("ZoneImage compile 100k names", 1, [&]() {
+      image = make_unique<ZoneImage>(zone, zonename);
+    });
+
+  char tmpl[] = "/tmp/tbench-XXXXXX";
+  if(!mkdtemp(tmpl)) abort();
+  string fname = snapshotName(tmpl, zonename);
+  bench("ZoneImage save 100k names", 1, [&]() {
+      image->save(fname);
+    });
+  bench("ZoneImage load 100k names", 100, [&]() {
+      auto loaded = ZoneImage::load(fname);
+      if(loaded->serial() != image->serial()) abort();
+    });
+  unlink(fname.c_str());
+  rmdir(tmpl);
+}
+
+//! What every question pays to keep its zones from being freed by a reload
+static void benchRCU()
+{
+  RCUPtr<DNSNode> zones(make_unique<DNSNode>());
+  bench("RCUPtr::Pin", 10000000, [&]() {
+      RCUPtr<DNSNode>::Pin pin(zones);
+      if(!pin.get()) abort();
+    });
+  bench("RCUPtr::publish", 10000, [&]() {
+      zones.publish(make_unique<DNSNode>());
+    });
+}
+
+//! Changing one record in a large zone, against loading it again
+static void benchUpdate()
+{
+  DNSNode zones;
+  DNSName zonename({"example", "com"});
+  auto& zone = *(zones.add(zonename)->zone = make_unique<DNSNode>());
+  bench("Zone of 100k names, build and freeze", 1, [&]() {
+      fillZone(zone, 100000);
+      zones.freeze();
+    });
+
+  // moves a host to a new name and back, so each round adds and removes a node
+  Changeset there, back;
+  there.remove({"host5", "sub5"}, AGen::make("192.0.2.1"));
+  there.add({"moved5", "sub5"}, 3600, AGen::make("192.0.2.1"));
+  back.remove({"moved5", "sub5"}, AGen::make("192.0.2.1"));
+  back.add({"host5", "sub5"}, 3600, AGen::make("192.0.2.1"));
+  unsigned int n = 0;
+  bench("DNSNode::apply, one record moved", 1000, [&]() {
+      zone.apply(n++ % 2 ? back : there);
+    });
+
+  DoubleBuffered<DNSNode> db(zone.clone(), [](const DNSNode& z) { return z.clone(); });
+  bench("DoubleBuffered::update, one record moved", 1000, [&]() {
+      db.update([&](DNSNode& z) { z.apply(n % 2 ? back : there); });
+      ++n;
+    });
+}
+
+int main(int argc, char** argv)
+{
+  vector<pair<string, std::function<void()>>> benches{
+    {"names", benchNames},
+    {"parse", benchParse},
+    {"hash", benchHash},
+    {"find", benchFind},
+    {"radix", benchRadix},
+    {"xfrname", benchXfrName},
+    {"reader", benchReader},
+    {"putrr", benchPutRR},
+    {"zone", benchZone},
+    {"intern", benchIntern},
+    {"walk", benchWalk},
+    {"snapshot", benchSnapshot},
+    {"rcu", benchRCU},
+    {"update", benchUpdate}
+  };
+
+  for(const auto& b : benches) {
+    if(argc > 1 && b.first != argv[1])
+      continue;
+    b.second();
+  }
+}
@@ -140,32 +140,18 @@ int TDNSLookupIPs(TDNSContext* context, const char* name, int timeoutMsec, int l
       return 3; 
     }
     //    cout<<"Received response with RCode "<<(RCode)dmr.dh.rcode<<", qname " <<rrdn<<", qtype "<<rrdt<<endl;
-      
-    std::unique_ptr<RRGen> rr;
-
-
-    DNSSection rrsection;
-    uint32_t rrttl;
-    
-    while(dmr.getRR(rrsection, rrdn, rrdt, rrttl, rr)) {
-      if(rrttl < resttl)
-        resttl = rrttl;
-      //      cout << rrsection << " " << rrdn<< " IN " << rrdt << " " << rrttl << " " <<rr->toString()<<endl;
-      if(rrsection != DNSSection::Answer || rrdt != dt)
-        continue;
-      ComboAddress ca;
-      if(dt == DNSType::A) {
-        auto agen =dynamic_cast<AGen*>(rr.get());
-        ca = agen->getIP();
-      }
-      else {
-        auto agen =dynamic_cast<AAAAGen*>(rr.get());
-        ca = agen->getIP();
-      }
-      auto sa = new struct sockaddr_storage();
-      memcpy(sa, &ca, sizeof(ca));
-      sas->push_back(sa);
-    }
+
+    // we only need the addresses, so we read them straight from the message
+    dmr.visitRRs([&](const DNSMessageReader::RRView& rr) {
+        if(rr.ttl < resttl)
+          resttl = rr.ttl;
+        if(rr.section != DNSSection::Answer || rr.type != dt)
+          return;
+        ComboAddress ca = rr.getIP();
+        auto sa = new struct sockaddr_storage();
+        memcpy(sa, &ca, sizeof(ca));
+        sas->push_back(sa);
+      });
   }
   sas->push_back(0);
 
@@ -191,25 +177,17 @@ int TDNSLookupMXs(TDNSContext* context, const char* name, int timeoutMsec, struc
   dmr.getQuestion(rrdn, rrdt);
       
   //  cout<<"Received response with RCode "<<(RCode)dmr.dh.rcode<<", qname " <<rrdn<<", qtype "<<rrdt<<endl;
-      
-  std::unique_ptr<RRGen> rr;
-  DNSSection rrsection;
-  uint32_t rrttl;
-  
-  while(dmr.getRR(rrsection, rrdn, rrdt, rrttl, rr)) {
-    if(rrttl < resttl)
-      resttl = rrttl;
-    //    cout << rrsection << " " << rrdn<< " IN " << rrdt << " " << rrttl << " " <<rr->toString()<<endl;
-    if(rrsection != DNSSection::Answer || rrdt != DNSType::MX)
-        continue;
-    if(rrdt == DNSType::MX) {
-        auto mxgen =dynamic_cast<MXGen*>(rr.get());
-        auto sa = new struct TDNSMX();
-        sa->priority = mxgen->d_prio;
-        sa->name = strdup(mxgen->d_name.toString().c_str());
-        sas->push_back(sa);
-    }
-  }
+
+  dmr.visitRRs([&](const DNSMessageReader::RRView& rr) {
+      if(rr.ttl < resttl)
+        resttl = rr.ttl;
+      if(rr.section != DNSSection::Answer || rr.type != DNSType::MX)
+        return;
+      auto sa = new struct TDNSMX();
+      sa->priority = rr.getUInt16(0);
+      sa->name = strdup(rr.getName(2).toString().c_str());
+      sas->push_back(sa);
+    });
   sas->push_back(0);
 
   *ret = new struct TDNSMXs();
@@ -246,24 +224,16 @@ int TDNSLookupTXTs(TDNSContext* context, const char* name, int timeoutMsec, stru
   dmr.getQuestion(rrdn, rrdt);
       
   //  cout<<"Received response with RCode "<<(RCode)dmr.dh.rcode<<", qname " <<rrdn<<", qtype "<<rrdt<<endl;
-      
-  std::unique_ptr<RRGen> rr;
-  DNSSection rrsection;
-  uint32_t rrttl;
-  
-  while(dmr.getRR(rrsection, rrdn, rrdt, rrttl, rr)) {
-    if(rrttl < resttl)
-      resttl = rrttl;
-    //    cout << rrsection << " " << rrdn<< " IN " << rrdt << " " << rrttl << " " <<rr->toString()<<endl;
-    if(rrsection != DNSSection::Answer || rrdt != DNSType::TXT)
-        continue;
-    if(rrdt == DNSType::TXT) {
-        auto txtgen =dynamic_cast<TXTGen*>(rr.get());
-        auto sa = new struct TDNSTXT();
-        sa->content = strdup(txtgen->toString().c_str());
-        sas->push_back(sa);
-    }
-  }
+
+  dmr.visitRRs([&](const DNSMessageReader::RRView& rr) {
+      if(rr.ttl < resttl)
+        resttl = rr.ttl;
+      if(rr.section != DNSSection::Answer || rr.type != DNSType::TXT)
+        return;
+      auto sa = new struct TDNSTXT();
+      sa->content = strdup(rr.make()->toString().c_str()); // only the TXTs we want get made
+      sas->push_back(sa);
+    });
   sas->push_back(0);
 
   *ret = new struct TDNSTXTs();
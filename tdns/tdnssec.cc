@@ -1,9 +1,11 @@
 #include "tdnssec.hh"
+#include "zone-image.hh"
 #include <iostream>
 
 using namespace std;
 
-void addDSToDelegation(DNSMessageWriter& response, const DNSNode* passedZonecut, const DNSName& zonename)
+template<typename Node>
+void addDSToDelegation(DNSMessageWriter& response, const Node* passedZonecut, const DNSName& zonename)
 {
   auto iter = passedZonecut->rrsets.find(DNSType::DS);
   if( iter != passedZonecut->rrsets.end()) {
@@ -17,15 +19,17 @@ void addDSToDelegation(DNSMessageWriter& response, const DNSNode* passedZonecut,
   }
 }
 
-void addNoErrorDNSSEC(DNSMessageWriter& response, const DNSNode* node, const RRSet& rrset, const DNSName& zonename)
+template<typename Node, typename RRSetT>
+void addNoErrorDNSSEC(DNSMessageWriter& response, const Node* node, const RRSetT& rrset, const DNSName& zonename)
 {
   cout<<"\tAdding signatures for SOA (have "<<rrset.signatures.size()<<")"<<endl;
   for(const auto& sig : rrset.signatures) {
     response.putRR(DNSSection::Authority, zonename, rrset.ttl, sig);
   }
   
-  if(node->rrsets.count(DNSType::NSEC)) {
-    const auto& nsecrr = *node->rrsets.find(DNSType::NSEC);
+  auto nseciter = node->rrsets.find(DNSType::NSEC);
+  if(nseciter != node->rrsets.end()) {
+    const auto& nsecrr = *nseciter;
     cout<<"\tAdding NSEC & signatures (have "<<nsecrr.second.signatures.size()<<")"<<endl;
     
     response.putRR(DNSSection::Authority, node->getName()+zonename, rrset.ttl, nsecrr.second.contents[0]);
@@ -35,7 +39,8 @@ void addNoErrorDNSSEC(DNSMessageWriter& response, const DNSNode* node, const RRS
   }
 }
 
-void addSignatures(DNSMessageWriter& response, const RRSet& rrset, const DNSName& lastnode, const DNSNode* passedWcard, const DNSName& zonename)
+template<typename Node, typename RRSetT>
+void addSignatures(DNSMessageWriter& response, const RRSetT& rrset, const DNSName& lastnode, const Node* passedWcard, const DNSName& zonename)
 {
   for(const auto& sig : rrset.signatures) {
     response.putRR(DNSSection::Answer, lastnode+zonename, rrset.ttl, sig);
@@ -54,26 +59,37 @@ void addSignatures(DNSMessageWriter& response, const RRSet& rrset, const DNSName
   }
 }
 
-void addNXDOMAINDNSSEC(DNSMessageWriter& response, const RRSet& rrset, const DNSName& qname, const DNSNode* node, const DNSNode* passedZonecut, const DNSName& zonename)
+template<typename Node, typename RRSetT>
+void addNXDOMAINDNSSEC(DNSMessageWriter& response, const RRSetT& rrset, const DNSName& qname, const Node* node, const Node* passedZonecut, const DNSName& zonename)
 {
+  // these are the signatures of the SOA, which lives at the apex
   for(const auto& sig : rrset.signatures) {
-    response.putRR(DNSSection::Authority, passedZonecut->getName()+zonename, rrset.ttl, sig);
+    response.putRR(DNSSection::Authority, zonename, rrset.ttl, sig);
   }
         
   cout<<"\tAt the last node, we have "<< node->children.size()<< " children\n";
   cout<<"\tLast node left "<<qname.back()<<endl;
   
   auto place = node->children.lower_bound(qname.back());
-  cout<<"\tplace: "<<place->getName()<<endl;
-  
-  auto prev = place->prev();
+  const Node* prev;
+  if(place != node->children.end()) {
+    cout<<"\tplace: "<<place->getName()<<endl;
+    prev = place->prev();
+  }
+  else if(!node->children.empty()) // we sort after all children, so the NSEC is at the last one
+    prev = &*--place;
+  else
+    prev = node;
+
   for(;;) {
     if(!prev) {
       cout<<"\tNSEC should maybe loop? there is no previous???"<<endl;
+      return;
     }
     cout<<"\tNSEC should start at "<<prev->getName()<<endl;
     if(!prev->rrsets.count(DNSType::NSEC)) {
       cout<<"\tCould not find NSEC record at "<<prev->getName()<<", it is an ENT, going back further"<<endl;
+      return;
     }
     break;
   }
@@ -84,3 +100,13 @@ void addNXDOMAINDNSSEC(DNSMessageWriter& response, const RRSet& rrset, const DNS
     response.putRR(DNSSection::Authority, prev->getName()+zonename, nsecrr->second.ttl, sig);
   }
 }
+
+template void addDSToDelegation(DNSMessageWriter&, const DNSNode*, const DNSName&);
+template void addNoErrorDNSSEC(DNSMessageWriter&, const DNSNode*, const RRSet&, const DNSName&);
+template void addSignatures(DNSMessageWriter&, const RRSet&, const DNSName&, const DNSNode*, const DNSName&);
+template void addNXDOMAINDNSSEC(DNSMessageWriter&, const RRSet&, const DNSName&, const DNSNode*, const DNSNode*, const DNSName&);
+
+template void addDSToDelegation(DNSMessageWriter&, const ZoneImage::Node*, const DNSName&);
+template void addNoErrorDNSSEC(DNSMessageWriter&, const ZoneImage::Node*, const ZoneImage::RRSetView&, const DNSName&);
+template void addSignatures(DNSMessageWriter&, const ZoneImage::RRSetView&, const DNSName&, const ZoneImage::Node*, const DNSName&);
+template void addNXDOMAINDNSSEC(DNSMessageWriter&, const ZoneImage::RRSetView&, const DNSName&, const ZoneImage::Node*, const ZoneImage::Node*, const DNSName&);
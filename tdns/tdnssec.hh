@@ -2,8 +2,15 @@
 #include "dnsmessages.hh"
 #include "dns-storage.hh"
 
-void addDSToDelegation(DNSMessageWriter& response, const DNSNode* passedZonecut, const DNSName& zonename);
-void addNoErrorDNSSEC(DNSMessageWriter& response, const DNSNode* node, const RRSet& rrset, const DNSName& zonename);
-void addSignatures(DNSMessageWriter& response, const RRSet& rrset, const DNSName& lastnode, const DNSNode* passedWcard, const DNSName& zonename);
-void addNXDOMAINDNSSEC(DNSMessageWriter& response, const RRSet& rrset, const DNSName& qname, const DNSNode* node, const DNSNode* passedZonecut, const DNSName& zonename);
+
+/* These work on a DNSNode tree with RRSets, or on a ZoneImage::Node with
+   ZoneImage::RRSetViews. Both are instantiated in tdnssec.cc */
+template<typename Node>
+void addDSToDelegation(DNSMessageWriter& response, const Node* passedZonecut, const DNSName& zonename);
+template<typename Node, typename RRSetT>
+void addNoErrorDNSSEC(DNSMessageWriter& response, const Node* node, const RRSetT& rrset, const DNSName& zonename);
+template<typename Node, typename RRSetT>
+void addSignatures(DNSMessageWriter& response, const RRSetT& rrset, const DNSName& lastnode, const Node* passedWcard, const DNSName& zonename);
+template<typename Node, typename RRSetT>
+void addNXDOMAINDNSSEC(DNSMessageWriter& response, const RRSetT& rrset, const DNSName& qname, const Node* node, const Node* passedZonecut, const DNSName& zonename);
 
@@ -1,7 +1,18 @@
 #define CATCH_CONFIG_MAIN  // This tells Catch to provide a main() - only do this in one cpp file
 #include "ext/catch/catch.hpp"
+#include <fstream>
+#include <unistd.h>
 #include "dnsmessages.hh"
 #include "dns-storage.hh"
+#include "record-types.hh"
+#include "zone-image.hh"
+#include "radix-index.hh"
+#include "rcu.hh"
+#include "tdnssec.hh"
+#include "sclasses.hh"
+#include <thread>
+#include <unordered_set>
+#include <random>
 
 using namespace std;
 
@@ -13,6 +24,28 @@ TEST_CASE("DNSLabel equality", "[dnslabel]") {
         
 }
 
+TEST_CASE("DNSLabel and DNSName ordering", "[dnslabel]") {
+  // RFC 4034 canonical order: lowercase, compare as unsigned octets, shorter first
+  REQUIRE(DNSLabel("_") < DNSLabel("Z"));
+  REQUIRE(DNSLabel("a") < DNSLabel("aa"));
+  REQUIRE(DNSLabel("zz") < DNSLabel(std::string(1, (char)0xc8)));
+  REQUIRE(DNSLabel("Yljkjljk").compare(DNSLabel("yljkjljk")) == 0);
+  REQUIRE(DNSLabel("yljkjljk").d_s == "yljkjljk");
+  REQUIRE(DNSLabel("YLJKJLJK").d_s == "YLJKJLJK");
+
+  // long enough to use the 16 byte at a time compare, with the difference at the end
+  string base(40, 'x'), upper(40, 'X');
+  REQUIRE(DNSName({base + "a"}) == DNSName({upper + "A"}));
+  REQUIRE(DNSName({base + "a"}) < DNSName({upper + "B"}));
+  REQUIRE(DNSName({upper + "Z"}).compare(DNSName({base + "_"})) > 0);
+  REQUIRE(DNSName({upper}).compare(DNSName({base})) == 0);
+
+  REQUIRE(DNSName({"a", "b"}) < DNSName({"a", "b", "c"}));
+  REQUIRE(DNSName({"a", "c"}).compare(DNSName({"A", "B", "C"})) > 0);
+  REQUIRE(DNSName({"ab"}) < DNSName({"b"}));
+  REQUIRE(DNSName({"ab"}).compare(DNSName({"a", "b"})) > 0);
+}
+
 TEST_CASE( "DNSName escaping", "[escapes]" ) {
   DNSName test({"powerdns", "com."});
   ostringstream str;
@@ -29,6 +62,74 @@ TEST_CASE( "DNSName escaping", "[escapes]" ) {
   REQUIRE(str.str() == "p\\000werdns.com.");
 };
 
+TEST_CASE("DNSName parsing", "[escapes]") {
+  REQUIRE(makeDNSName("www.powerdns.com") == DNSName({"www", "powerdns", "com"}));
+  REQUIRE(makeDNSName("www.powerdns.com.") == DNSName({"www", "powerdns", "com"}));
+  REQUIRE(makeDNSName(".").empty());
+  REQUIRE(makeDNSName("").empty());
+  REQUIRE(makeDNSName("powerdns\\.com.") == DNSName({"powerdns.com"}));
+  REQUIRE(makeDNSName("back\\\\slash") == DNSName({"back\\slash"}));
+  REQUIRE(makeDNSName("p\\000werdns.com") == DNSName({std::string("p\0werdns", 8), "com"}));
+  REQUIRE(makeDNSName("\\255\\032\\a") == DNSName({"\xff a"}));
+  REQUIRE(makeDNSName("a-label-that-is-longer-than-sixteen-bytes.with\\.an-escape-after-that.example").size() == 3);
+
+  // what we print, we parse back to the same name, case and all
+  DNSName odd({std::string("\0\x01.\\ \x7f\xffMiXeD", 12), "Example"});
+  for(auto dn : {odd, DNSName({"www", "PowerDNS", "org"}), DNSName({string(63, 'x'), "y"})}) {
+    auto parsed = makeDNSName(dn.toString());
+    REQUIRE(parsed == dn);
+    REQUIRE(parsed.toString() == dn.toString());
+    REQUIRE(parsed.wireLength() == dn.wireLength());
+  }
+
+  REQUIRE_THROWS_AS(makeDNSName("www..com"), std::runtime_error);
+  REQUIRE_THROWS_AS(makeDNSName(".com"), std::runtime_error);
+  REQUIRE_THROWS_AS(makeDNSName("www.com.."), std::runtime_error);
+  REQUIRE_THROWS_AS(makeDNSName("escape\\"), std::runtime_error);
+  REQUIRE_THROWS_AS(makeDNSName("short\\12"), std::runtime_error);
+  REQUIRE_THROWS_AS(makeDNSName("big\\256"), std::runtime_error);
+  REQUIRE_THROWS_AS(makeDNSName(string(64, 'a')), std::out_of_range);
+  REQUIRE_NOTHROW(makeDNSName(string(63, 'a')));
+
+  string longname;
+  for(int n = 0; n < 4; ++n)
+    longname += string(62, 'a') + ".";
+  REQUIRE(makeDNSName(longname).wireLength() == 252);
+  REQUIRE_NOTHROW(makeDNSName(longname + "b"));
+  REQUIRE_THROWS_AS(makeDNSName(longname + "bb"), std::out_of_range);
+  REQUIRE_THROWS_AS(makeDNSName(longname + "\\098\\098"), std::out_of_range);
+}
+
+TEST_CASE("DNSName hashing", "[dnsname]") {
+  DNSNameHash h(42);
+  DNSName www({"www", "PowerDNS", "com"});
+  REQUIRE(h(www) == h(DNSName({"WWW", "powerdns", "COM"})));
+  REQUIRE(h(www) != h(DNSName({"www", "powerdns", "org"})));
+  REQUIRE(h(DNSLabel("Www")) == h(DNSName({"wWw"})));
+  REQUIRE(h(DNSName({"ab"})) != h(DNSName({"a", "b"})));
+  REQUIRE(h(DNSName()) != h(DNSName({"a"})));
+  REQUIRE(h.extend(h.extend(h.extend(h.start(), "com"), "powerdns"), "www") == h(www));
+  REQUIRE(DNSNameHash(43)(www) != h(www));
+  REQUIRE(DNSNameHash()(www) == DNSNameHash()(www));
+
+  // names that only differ deep inside a label should still spread over a small table
+  vector<unsigned int> buckets(256);
+  for(unsigned int n = 0; n < 256 * 16; ++n) {
+    string label("host-00000000-example");
+    label[5 + n % 8] = 'a' + n / 8 % 16;
+    label[13 + n / 128 % 8] = 'a' + n / 1024;
+    buckets[h(DNSName({label, "com"})) & 255]++;
+  }
+  REQUIRE(*max_element(buckets.begin(), buckets.end()) < 48);
+
+  unordered_set<DNSName, DNSNameHash, DNSNameEqual> names;
+  names.insert(www);
+  names.insert(DNSName({"WWW", "POWERDNS", "COM"}));
+  REQUIRE(names.size() == 1);
+  REQUIRE(names.count(DNSName({"www", "powerdns", "com"})));
+  REQUIRE(!names.count(DNSName({"powerdns", "com"})));
+}
+
 TEST_CASE("DNSName operations", "[dnsname]") {
   DNSName test({"www", "powerdns", "org"}), test2;
   test2 = test;
@@ -53,6 +154,33 @@ TEST_CASE("DNSName operations", "[dnsname]") {
   REQUIRE(unrelated.isPartOf(Org));
 }
 
+TEST_CASE("DNSName storage", "[dnsname]") {
+  DNSName test({"powerdns", "org"});
+  test.push_front("www");
+  REQUIRE(test.size() == 3);
+  REQUIRE(test.front() == "www");
+  REQUIRE(test.back() == "org");
+  REQUIRE(test.wireLength() == 17);
+
+  vector<string> labels;
+  for(auto iter = test.rbegin(); iter != test.rend(); ++iter)
+    labels.push_back((*iter).d_s);
+  REQUIRE(labels == vector<string>({"org", "powerdns", "www"}));
+
+  test.pop_front();
+  REQUIRE(test == DNSName({"POWERDNS", "org"}));
+  REQUIRE((DNSName({"www"}) + test) == DNSName({"www", "powerdns", "org"}));
+
+  DNSName longname;
+  for(int n = 0; n < 4; ++n)
+    longname.push_back(string(62, 'a'));
+  REQUIRE(longname.wireLength() == 252);
+  REQUIRE_THROWS_AS(longname.push_back("bb"), std::out_of_range);
+  REQUIRE_NOTHROW(longname.push_back("b"));
+  REQUIRE_THROWS_AS(longname + DNSName({"c"}), std::out_of_range);
+  REQUIRE_THROWS_AS(DNSLabel(string(64, 'a')), std::out_of_range);
+}
+
 TEST_CASE("DNS Messages", "[dnsmessage]") {
   DNSName qname({"www", "powerdns", "com"}), rname;
   DNSType rtype;
@@ -64,3 +192,1284 @@ TEST_CASE("DNS Messages", "[dnsmessage]") {
   REQUIRE(rname == qname);
   REQUIRE(rtype == DNSType::SOA);
 }
+
+TEST_CASE("DNSMessageReader views and copies", "[dnsmessage]") {
+  DNSName qname({"www", "powerdns", "com"}), rname;
+  DNSType rtype;
+  DNSMessageWriter dmw(qname, DNSType::SOA);
+  dmw.putRR(DNSSection::Answer, qname, 3600, AGen::make(ComboAddress("192.0.2.1")));
+  string ser = dmw.serialize();
+  // a view reads the same, and so does a copy of a reader whose buffer is gone
+  auto view = DNSMessageReader::view(ser.c_str(), ser.size());
+  REQUIRE(view.d_qname == qname);
+  REQUIRE(view.size() == ser.size());
+  std::unique_ptr<DNSMessageReader> owner(new DNSMessageReader(ser));
+  DNSMessageReader copy(*owner);
+  owner.reset();
+  for(auto* r : {&view, &copy}) {
+    DNSSection section;
+    uint32_t ttl;
+    std::unique_ptr<RRGen> rr;
+    REQUIRE(r->getRR(section, rname, rtype, ttl, rr));
+    REQUIRE(rtype == DNSType::A);
+    REQUIRE(rr->toString() == "192.0.2.1");
+    REQUIRE(!r->getRR(section, rname, rtype, ttl, rr));
+  }
+  REQUIRE_THROWS_AS(DNSMessageReader::view(ser.c_str(), ser.size() - 3).skipRRs(1), std::out_of_range);
+}
+
+//! A response with an A record, then OPT, then another A record, all in the additional section
+static string ednsInTheMiddle(const DNSName& qname)
+{
+  DNSMessageWriter edns(qname, DNSType::A);
+  edns.setEDNS(1232, true);
+  edns.putRR(DNSSection::Additional, qname, 3600, AGen::make(ComboAddress("192.0.2.1")));
+  string ser = edns.serialize();
+  // OPT need not be last, so add another A record after it, pointing back at the qname
+  ser.append("\xc0\x0c\x00\x01\x00\x01\x00\x00\x0e\x10\x00\x04\xc0\x00\x02\x02", 16);
+  ser[11]++;
+  return ser;
+}
+
+TEST_CASE("EDNS anywhere in the additional section", "[dnsmessage]") {
+  DNSName qname({"www", "powerdns", "com"}), rname;
+  DNSType rtype;
+  uint16_t bufsize;
+  bool doBit;
+  DNSMessageWriter plain(qname, DNSType::A);
+  REQUIRE(!DNSMessageReader(plain.serialize()).getEDNS(&bufsize, &doBit));
+
+  string ser = ednsInTheMiddle(qname);
+  for(int iterate = 0; iterate < 2; ++iterate) {
+    DNSMessageReader r(ser);
+    DNSSection section;
+    uint32_t ttl;
+    std::unique_ptr<RRGen> rr;
+    vector<DNSType> types;
+    while(iterate && r.getRR(section, rname, rtype, ttl, rr))
+      types.push_back(rtype);
+    REQUIRE(r.getEDNS(&bufsize, &doBit)); // either found while iterating, or looked for now
+    REQUIRE(bufsize == 1232);
+    REQUIRE(doBit);
+    REQUIRE(r.d_ednsVersion == 0);
+    if(iterate)
+      REQUIRE(types == vector<DNSType>({DNSType::A, DNSType::OPT, DNSType::A}));
+  }
+
+  // a query with a cut short additional record is malformed, which is not the same as out of room
+  DNSMessageWriter query(qname, DNSType::A);
+  query.putRR(DNSSection::Additional, qname, 3600, AGen::make(ComboAddress("192.0.2.1")));
+  ser = query.serialize();
+  ser.resize(ser.size() - 2);
+  DNSMessageReader cut(ser);
+  try {
+    cut.getEDNS(&bufsize, &doBit);
+    FAIL("no exception");
+  }
+  catch(std::out_of_range&) {
+    FAIL("std::out_of_range, which tauth takes to mean the response is too large");
+  }
+  catch(std::runtime_error&) {
+  }
+}
+
+TEST_CASE("Record index", "[dnsmessage]") {
+  DNSName qname({"www", "powerdns", "com"}), rname;
+  DNSType rtype;
+  uint16_t bufsize;
+  bool doBit;
+  string ser = ednsInTheMiddle(qname);
+  DNSMessageReader indexed(ser);
+  const auto& index = indexed.index();
+  REQUIRE(index.size() == 3);
+  REQUIRE(index[0].section == DNSSection::Additional);
+  REQUIRE(index[1].type == DNSType::OPT);
+  REQUIRE(index[2].type == DNSType::A);
+  REQUIRE(indexed.getEDNS(&bufsize, &doBit)); // found while indexing
+  DNSSection section;
+  uint32_t ttl;
+  std::unique_ptr<RRGen> rr;
+  indexed.seekRR(2);
+  REQUIRE(indexed.getRR(section, rname, rtype, ttl, rr));
+  REQUIRE(section == DNSSection::Additional);
+  REQUIRE(rname == qname);
+  REQUIRE(rr->toString() == "192.0.2.2");
+  REQUIRE(!indexed.getRR(section, rname, rtype, ttl, rr));
+  indexed.seekRR(0); // again, from the start
+  REQUIRE(indexed.getRR(section, rname, rtype, ttl, rr));
+  REQUIRE(rr->toString() == "192.0.2.1");
+  indexed.seekSection(DNSSection::Answer);
+  REQUIRE(indexed.getRR(section, rname, rtype, ttl, rr));
+  REQUIRE(section == DNSSection::Additional); // there are no answers
+  indexed.seekRR(3);
+  REQUIRE(!indexed.getRR(section, rname, rtype, ttl, rr));
+  REQUIRE_THROWS_AS(DNSMessageReader(ser.substr(0, ser.size() - 1)).index(), std::out_of_range);
+}
+
+//! A referral to com, with the NS names in 'expected' and an address for each, all names compressed
+static string referralTo(const vector<DNSName>& expected)
+{
+  DNSMessageWriter referral(DNSName({"www", "powerdns", "com"}), DNSType::A);
+  for(const auto& name : expected)
+    referral.putRR(DNSSection::Authority, {"com"}, 172800, NSGen::make(name));
+  for(const auto& name : expected)
+    referral.putRR(DNSSection::Additional, name, 172800, AGen::make(ComboAddress("192.0.2.1")));
+  return referral.serialize();
+}
+
+static vector<DNSName> gtldServers()
+{
+  vector<DNSName> ret;
+  for(char c = 'a'; c <= 'f'; ++c)
+    ret.push_back({string(1, c), "gtld-servers", "net"});
+  return ret;
+}
+
+TEST_CASE("Decompressed names are remembered", "[dnsmessage]") {
+  // the same suffixes over and over, the second time around they come from the reader's cache
+  auto expected = gtldServers();
+  DNSMessageReader names(referralTo(expected));
+  DNSSection section;
+  DNSName rname;
+  DNSType rtype;
+  uint32_t ttl;
+  std::unique_ptr<RRGen> rr;
+  for(int round = 0; round < 2; ++round) {
+    names.seekRR(0);
+    for(size_t n = 0; n < 2 * expected.size(); ++n) {
+      REQUIRE(names.getRR(section, rname, rtype, ttl, rr));
+      if(n < expected.size()) {
+        REQUIRE(rname == DNSName({"com"}));
+        REQUIRE(rr->toString() == expected[n].toString());
+      }
+      else
+        REQUIRE(rname.toString() == expected[n - expected.size()].toString());
+    }
+  }
+
+  // more long suffixes than the reader keeps, so it starts over along the way
+  DNSMessageWriter many(DNSName({"example"}), DNSType::A, DNSClass::IN, 16384);
+  vector<DNSName> owners;
+  for(int n = 0; n < 20; ++n) {
+    DNSName longer({string(60, 'a' + n), "example"});
+    for(const char* host : {"a", "b", "c"}) {
+      owners.push_back(DNSName({host}) + longer);
+      many.putRR(DNSSection::Answer, owners.back(), 3600, AGen::make(ComboAddress("192.0.2.1")));
+    }
+  }
+  DNSMessageReader manyNames(many.serialize());
+  for(const auto& owner : owners) {
+    REQUIRE(manyNames.getRR(section, rname, rtype, ttl, rr));
+    REQUIRE(rname.toString() == owner.toString());
+  }
+  REQUIRE(!manyNames.getRR(section, rname, rtype, ttl, rr));
+
+  // a pointer to itself, or to later on, is not followed
+  string loop("\x00\x01\x01\x00\x00\x01\x00\x00\x00\x00\x00\x00" "\xc0\x0c\x00\x01\x00\x01", 18);
+  REQUIRE_THROWS_AS(DNSMessageReader(loop), std::runtime_error);
+  loop[13] = 0x0e;
+  REQUIRE_THROWS_AS(DNSMessageReader(loop), std::runtime_error);
+}
+
+TEST_CASE("Record views", "[dnsmessage]") {
+  // only the records we make get allocated
+  auto expected = gtldServers();
+  string ser = referralTo(expected);
+  DNSMessageReader names(ser);
+  size_t n = 0;
+  names.visitRRs([&](const DNSMessageReader::RRView& rr) {
+      REQUIRE(rr.ttl == 172800);
+      if(n < expected.size()) {
+        REQUIRE(rr.section == DNSSection::Authority);
+        REQUIRE(rr.type == DNSType::NS);
+        REQUIRE(rr.name == DNSName({"com"}));
+        REQUIRE(rr.getName(0).toString() == expected[n].toString());
+        REQUIRE(rr.make()->toString() == expected[n].toString());
+        REQUIRE_THROWS_AS(rr.getIP(), std::runtime_error);
+      }
+      else {
+        REQUIRE(rr.section == DNSSection::Additional);
+        REQUIRE(rr.name.toString() == expected[n - expected.size()].toString());
+        REQUIRE(rr.getIP().toString() == "192.0.2.1");
+        REQUIRE(rr.getUInt32(0) == 0xc0000201);
+        REQUIRE(rr.rdata()[0] == 192);
+        REQUIRE_THROWS_AS(rr.getUInt16(3), std::out_of_range);
+      }
+      ++n;
+    });
+  REQUIRE(n == 2 * expected.size());
+  ser.resize(ser.size() - 1);
+  REQUIRE_THROWS_AS(DNSMessageReader(ser).visitRRs([](const DNSMessageReader::RRView&) {}), std::out_of_range);
+}
+
+//! Everything getRR makes of a message, up to where it throws, if it does
+static string parseAll(const string& message, bool checkEveryRead)
+{
+  ostringstream out;
+  try {
+    DNSMessageReader dmr(message);
+    dmr.d_checkEveryRead = checkEveryRead;
+    DNSSection section;
+    DNSName name;
+    DNSType type;
+    uint32_t ttl;
+    std::unique_ptr<RRGen> rr;
+    while(dmr.getRR(section, name, type, ttl, rr))
+      out << section << " " << name << " " << type << " " << ttl << " " << rr->toString() << "\n";
+  }
+  catch(std::exception& e) {
+    out << "error: " << e.what() << "\n";
+  }
+  return out.str();
+}
+
+TEST_CASE("Record parsing agrees with and without checking every read", "[dnsmessage]") {
+  // a corpus of messages with every kind of record, and then many broken versions of those
+  vector<string> corpus;
+  DNSName qname({"www", "powerdns", "com"}), zone({"powerdns", "com"});
+  for(int n = 0; n < 4; ++n) {
+    DNSMessageWriter dmw(qname, DNSType::ANY);
+    if(n & 1)
+      dmw.setEDNS(1232, true);
+    dmw.putRR(DNSSection::Answer, qname, 3600, AGen::make(ComboAddress("192.0.2.1")));
+    dmw.putRR(DNSSection::Answer, qname, 3600, AAAAGen::make(ComboAddress("2001:db8::1")));
+    dmw.putRR(DNSSection::Answer, qname, 3600, MXGen::make(25, DNSName({"mx"}) + zone));
+    dmw.putRR(DNSSection::Answer, qname, 3600, TXTGen::make({"hello", "world"}));
+    if(n & 2) {
+      dmw.putRR(DNSSection::Authority, zone, 3600, SOAGen::make(DNSName({"ns1"}) + zone, DNSName({"admin"}) + zone, 2018));
+      dmw.putRR(DNSSection::Authority, zone, 3600, NSGen::make(DNSName({"ns1"}) + zone));
+      dmw.putRR(DNSSection::Additional, DNSName({"ns1"}) + zone, 3600, AGen::make(ComboAddress("192.0.2.53")));
+    }
+    corpus.push_back(dmw.serialize());
+  }
+
+  std::mt19937 rng(2018); // the same corpus every time
+  size_t seeds = corpus.size();
+  for(int n = 0; n < 4000; ++n) {
+    string m = corpus[rng() % seeds];
+    switch(rng() % 3) {
+    case 0: // change a few bytes
+      for(unsigned int i = 1 + rng() % 3; i; --i)
+        m[12 + rng() % (m.size() - 12)] = rng();
+      break;
+    case 1: // cut it short
+      m.resize(12 + rng() % (m.size() - 12));
+      break;
+    case 2: // a byte to 0 or 0xff, lengths and counts like that
+      m[12 + rng() % (m.size() - 12)] = (rng() & 1) ? 0 : 0xff;
+      break;
+    }
+    corpus.push_back(m);
+  }
+
+  unsigned int errors = 0;
+  for(const auto& m : corpus) {
+    auto fast = parseAll(m, false);
+    REQUIRE(fast == parseAll(m, true));
+    if(fast.find("error: ") != string::npos)
+      ++errors;
+  }
+  // both the good and the broken ones should be well represented
+  REQUIRE(errors > corpus.size() / 4);
+  REQUIRE(errors < corpus.size() * 3 / 4);
+  REQUIRE(parseAll(corpus[0], false).find("192.0.2.1") != string::npos);
+}
+
+TEST_CASE("Name compression", "[dnsmessage]") {
+  DNSName qname({"www", "powerdns", "com"});
+  DNSMessageWriter dmw(qname, DNSType::A);
+  // the qname is at 12, so powerdns.com is at 16 and com at 25, the records start at 34
+  dmw.xfrName({"ns1", "PowerDNS", "COM"});
+  dmw.xfrName({"ns1", "powerdns", "com"});
+  dmw.xfrName({"com"});
+  dmw.xfrName({"org"});
+  dmw.xfrName({"www", "example", "org"}, false); // written out, but remembered
+  dmw.xfrName({"Example", "org"});
+  dmw.xfrName(DNSName());
+  string expected("\x03ns1\xc0\x10" "\xc0\x22" "\xc0\x19" "\x03org\x00"
+                  "\x03www\x07" "example\x03org\x00" "\xc0\x35" "\x00", 35);
+  REQUIRE(string((const char*)&dmw.payload.at(22), dmw.payloadpos - 22) == expected);
+
+  dmw.clearRRs(); // forgets all but the qname again
+  dmw.xfrName({"org"});
+  dmw.xfrName({"powerdns", "com"});
+  REQUIRE(string((const char*)&dmw.payload.at(22), dmw.payloadpos - 22) == string("\x03org\x00\xc0\x10", 7));
+
+  // pointers only reach the first 16384 bytes, names beyond that are written out in full where need be
+  DNSMessageWriter big(qname, DNSType::AXFR, DNSClass::IN, 65535);
+  vector<DNSName> names;
+  for(int n = 0; big.payloadpos < 30000; ++n) {
+    names.push_back(DNSName({"host" + to_string(n % 1500), "example", "com"}));
+    big.putRR(DNSSection::Answer, names.back(), 3600, NSGen::make(names[names.size() / 2]));
+  }
+  string ser = big.serialize();
+  DNSMessageReader dmr(ser);
+  DNSSection section;
+  DNSName rname;
+  DNSType rtype;
+  uint32_t ttl;
+  std::unique_ptr<RRGen> rr;
+  size_t n = 0;
+  while(dmr.getRR(section, rname, rtype, ttl, rr)) {
+    REQUIRE(rname == names.at(n));
+    REQUIRE(rr->toString() == names[(n + 1) / 2].toString());
+    ++n;
+  }
+  REQUIRE(n == names.size());
+}
+
+TEST_CASE("EDNS options", "[dnsmessage]") {
+  DNSName qname({"www", "powerdns", "com"});
+  DNSMessageWriter dmw(qname, DNSType::A);
+  dmw.setEDNS(1232, true);
+  dmw.addEDNSSubnet(ComboAddress("192.0.2.77"), 24);
+  dmw.addEDNSOption(EDNSOptionCode::Cookie, string("\x01\x02\x03\x04\x05\x06\x07\x08", 8));
+  uint16_t timeout = htons(300);
+  dmw.addEDNSOption(EDNSOptionCode::TCPKeepalive, (const uint8_t*)&timeout, 2);
+  dmw.addEDNSOption((EDNSOptionCode)65001, "local");
+  dmw.setEDNSPadding(128);
+  string ser = dmw.serialize();
+  REQUIRE(ser.size() == 128);
+
+  DNSMessageReader dmr(ser);
+  vector<EDNSOptionCode> codes;
+  for(const auto& o : dmr.getEDNSOptions())
+    codes.push_back(o.code);
+  REQUIRE(codes == vector<EDNSOptionCode>({EDNSOptionCode::ClientSubnet, EDNSOptionCode::Cookie,
+          EDNSOptionCode::TCPKeepalive, (EDNSOptionCode)65001, EDNSOptionCode::Padding}));
+  auto opts = dmr.getEDNSOptions();
+  DNSMessageReader::EDNSOption opt;
+  REQUIRE(opts.find(EDNSOptionCode::ClientSubnet, opt));
+  ComboAddress ca;
+  uint8_t source, scope;
+  REQUIRE(opt.getSubnet(ca, source, scope));
+  REQUIRE(ca.toString() == "192.0.2.0");
+  REQUIRE(source == 24);
+  REQUIRE(scope == 0);
+  REQUIRE(opts.find(EDNSOptionCode::Cookie, opt));
+  REQUIRE(string((const char*)opt.data, opt.size) == "\x01\x02\x03\x04\x05\x06\x07\x08");
+  REQUIRE(opts.find(EDNSOptionCode::TCPKeepalive, opt));
+  REQUIRE(opt.getTimeout(timeout));
+  REQUIRE(timeout == 300);
+  REQUIRE(!opt.getSubnet(ca, source, scope));
+  REQUIRE(opts.find(EDNSOptionCode::Padding, opt));
+  REQUIRE(std::count(opt.data, opt.data + opt.size, 0) == opt.size);
+  // read from a view, the options point into the caller's buffer
+  auto view = DNSMessageReader::view(ser.c_str(), ser.size());
+  REQUIRE(view.getEDNSOptions().find(EDNSOptionCode::Padding, opt));
+  REQUIRE((const char*)opt.data > ser.c_str());
+  REQUIRE((const char*)opt.data + opt.size == ser.c_str() + ser.size());
+  uint16_t bufsize;
+  bool doBit;
+  REQUIRE(dmr.getEDNS(&bufsize, &doBit));
+  REQUIRE(bufsize == 1232);
+
+  DNSMessageWriter v6(qname, DNSType::A);
+  v6.setEDNS(1232, false);
+  v6.addEDNSSubnet(ComboAddress("2001:db8:ffff::1"), 36, 48);
+  ser = v6.serialize();
+  auto v6opts = DNSMessageReader::view(ser.c_str(), ser.size()).getEDNSOptions();
+  REQUIRE(v6opts.find(EDNSOptionCode::ClientSubnet, opt));
+  REQUIRE(opt.size == 4 + 5);
+  REQUIRE(opt.getSubnet(ca, source, scope));
+  REQUIRE(ca.toString() == "2001:db8:f000::");
+  REQUIRE(scope == 48);
+
+  // no OPT record, or one without options
+  DNSMessageWriter plain(qname, DNSType::A);
+  REQUIRE(DNSMessageReader(plain.serialize()).getEDNSOptions().empty());
+  DNSMessageWriter bare(qname, DNSType::A);
+  bare.setEDNS(1232, false);
+  ser = bare.serialize();
+  REQUIRE(DNSMessageReader(ser).getEDNSOptions().empty());
+  // an option that claims more than the OPT record has
+  ser[ser.size() - 1] = 4; // the rdlength
+  ser.append("\x00\x0a\x00\x08", 4);
+  DNSMessageReader broken(ser);
+  REQUIRE(broken.getEDNS(&bufsize, &doBit)); // the rest of EDNS is fine
+  REQUIRE_THROWS_AS(broken.getEDNSOptions(), std::out_of_range);
+
+  // padding never makes a message bigger than it may be
+  DNSMessageWriter full(qname, DNSType::A, DNSClass::IN, 100);
+  full.setEDNS(100, false);
+  full.setEDNSPadding(468);
+  REQUIRE(full.serialize().size() == 100);
+}
+
+TEST_CASE("DNSNode child index", "[dnsnode]") {
+  DNSNode zone;
+  vector<DNSName> names;
+  for(int n = 0; n < 40; ++n) {
+    names.push_back({"host"+to_string(n), "big"});
+    zone.add(names.back());
+  }
+  zone.add({"a", "small"});
+  zone.add({"b", "small"});
+
+  auto walk = [&zone]() {
+    vector<DNSName> ret;
+    for(auto node = zone.next(); node; node = node->next()) {
+      ret.push_back(node->getName());
+      ret.push_back(node->prev()->getName());
+    }
+    return ret;
+  };
+  auto before = walk();
+  zone.freeze();
+  REQUIRE(zone.d_index.d_kind == DNSNode::ChildIndex::Kind::Sorted);
+  REQUIRE(zone.findChild({"big"})->d_index.d_kind == DNSNode::ChildIndex::Kind::Hashed);
+  REQUIRE(walk() == before);
+  REQUIRE(before.front() == DNSName({"big"}));
+  REQUIRE(before[before.size()-2] == DNSName({"b", "small"}));
+
+  for(auto name : names) {
+    DNSName last;
+    auto node = zone.find(name, last);
+    REQUIRE(name.empty());
+    REQUIRE(node->getName() == last);
+  }
+  REQUIRE(!zone.findChild({"big"})->findChild({"HOST41"}));
+  REQUIRE(zone.findChild({"big"})->findChild({"HOST39"}));
+
+  zone.add({"c", "small"}); // unfreezes 'small'
+  REQUIRE(zone.findChild({"small"})->d_index.d_kind == DNSNode::ChildIndex::Kind::None);
+  REQUIRE(zone.findChild({"small"})->findChild({"c"}));
+  auto after = walk(); // 'small' walks via its set again, the rest of the tree still by position
+  REQUIRE(after.size() == before.size() + 2);
+  REQUIRE(after[after.size()-2] == DNSName({"c", "small"}));
+  REQUIRE(after.back() == DNSName({"b", "small"}));
+}
+
+TEST_CASE("RadixIndex finds what the tree finds", "[radix]") {
+  DNSNode zone;
+  zone.addRRs(NSGen::make({"ns1", "example", "com"}));
+  zone.add({"*"})->addRRs(AGen::make("192.0.2.1"));
+  zone.add({"delegated"})->addRRs(NSGen::make({"ns1", "example", "com"}));
+  zone.add({"*", "delegated"})->addRRs(AGen::make("192.0.2.1")); // below a cut
+  zone.add({"www", "Sub"})->addRRs(AGen::make("192.0.2.1"));
+  zone.add({"*", "wild", "sub"})->addRRs(NSGen::make({"ns1", "example", "com"}));
+  zone.add({"a", "b", "c", "deep"})->addRRs(AGen::make("192.0.2.1"));
+  zone.add({"x\000y", "sub"});
+  zone.add({string(63, 'l'), string(63, 'm')});
+  for(int n = 0; n < 40; ++n)
+    zone.add({"host"+to_string(n), "many"})->addRRs(AGen::make("192.0.2.1"));
+  zone.add({"cut", "many"})->addRRs(NSGen::make({"ns1", "example", "com"}));
+
+  vector<DNSName> queries{{}, {"www", "sub"}, {"WWW", "SUB"}, {"nope", "sub"}, {"a", "b", "sub"},
+      {"nope"}, {"a", "nope"}, {"delegated"}, {"x", "delegated"}, {"y", "x", "delegated"},
+      {"wild", "sub"}, {"x", "wild", "sub"}, {"y", "x", "wild", "sub"}, {"*", "wild", "sub"},
+      {"a", "b", "c", "deep"}, {"b", "c", "deep"}, {"z", "a", "b", "c", "deep"}, {"c", "c", "deep"},
+      {"x", "sub"}, {"x\000y", "sub"}, {"x\000y", "SUB"}, {"x\000", "sub"},
+      {"host", "many"}, {"host39", "many"}, {"host399", "many"}, {"x", "cut", "many"},
+      {string(63, 'l'), string(63, 'm')}, {string(62, 'l'), string(63, 'm')}, {string(63, 'M')},
+      {"de"}, {"delegate"}, {"delegatedx"}};
+
+  struct Result
+  {
+    const DNSNode* node;
+    DNSName name, last;
+    const DNSNode* zonecut;
+    const DNSNode* wildcard;
+    bool operator==(const Result& rhs) const
+    {
+      return node == rhs.node && name == rhs.name && last == rhs.last &&
+        zonecut == rhs.zonecut && wildcard == rhs.wildcard;
+    }
+  };
+  auto findAll = [&]() {
+    vector<Result> ret;
+    for(bool wildcards : {false, true}) {
+      for(const auto& q : queries) {
+        Result r{nullptr, q, {}, nullptr, nullptr};
+        r.node = zone.find(r.name, r.last, wildcards, &r.zonecut, &r.wildcard);
+        ret.push_back(r);
+      }
+    }
+    return ret;
+  };
+  zone.freeze();
+  REQUIRE(!zone.d_radix);
+  auto tree = findAll();
+  zone.freeze(FindEngine::Radix);
+  REQUIRE(zone.d_radix);
+  REQUIRE(zone.d_radix->size() == 57);
+  auto radix = findAll();
+  for(size_t n = 0; n < tree.size(); ++n) {
+    INFO("query " << n % queries.size() << ": " << queries[n % queries.size()]);
+    REQUIRE(radix[n] == tree[n]);
+  }
+  REQUIRE(tree[1].zonecut == nullptr);
+  REQUIRE(tree[8].zonecut == zone.findChild({"delegated"}));
+  REQUIRE(tree[queries.size() + 11].wildcard);
+
+  zone.add({"new", "sub"});
+  REQUIRE(!zone.d_radix);
+}
+
+TEST_CASE("Exact matches agree with find", "[exact]") {
+  DNSNode zones;
+  DNSName zonename({"example", "com"});
+  auto zonenode = zones.add(zonename);
+  zonenode->zone = make_unique<DNSNode>();
+  auto& zone = *zonenode->zone;
+  zone.addRRs(SOAGen::make({"ns1", "example", "com"}, {"admin", "example", "com"}, 1), NSGen::make({"ns1", "example", "com"}));
+  zone.add({"*"})->addRRs(AGen::make("192.0.2.1"));
+  zone.add({"www", "Sub"})->addRRs(AGen::make("192.0.2.1"));
+  zone.add({"a", "b", "c", "deep"})->addRRs(AGen::make("192.0.2.1"));
+  zone.add({"delegated"})->addRRs(NSGen::make({"ns1", "example", "com"}));
+  zone.add({"www", "delegated"})->addRRs(AGen::make("192.0.2.1")); // below a cut
+  for(int n = 0; n < 40; ++n)
+    zone.add({"host"+to_string(n), "many"})->addRRs(AGen::make("192.0.2.1"));
+
+  vector<DNSName> queries{{}, {"*"}, {"www", "sub"}, {"WWW", "SUB"}, {"sub"}, {"nope", "sub"},
+      {"a", "b", "c", "deep"}, {"b", "c", "deep"}, {"z", "a", "b", "c", "deep"}, {"delegated"},
+      {"www", "delegated"}, {"host17", "MANY"}, {"host40", "many"}, {"nope"}, {"sub", "www"}};
+
+  REQUIRE(!zone.findExact({"www", "sub"})); // only frozen zones have one
+  zones.freeze();
+  REQUIRE(zone.d_exact);
+  REQUIRE(zone.d_exact->size() == 49);
+  ZoneImage image(zone, zonename);
+  auto apex = image.apex();
+  for(const auto& q : queries) {
+    INFO("query " << q);
+    DNSName name(q), last;
+    const DNSNode *zonecut = nullptr, *wildcard = nullptr;
+    auto node = zone.find(name, last, true, &zonecut, &wildcard);
+    // it finds exactly the names that find() matches entirely, without passing a zone cut or a wildcard
+    bool exact = name.empty() && !zonecut && !wildcard;
+    REQUIRE(zone.findExact(q) == (exact ? node : nullptr));
+
+    DNSName iname(q), ilast;
+    const ZoneImage::Node *izonecut = nullptr, *iwildcard = nullptr;
+    auto inode = apex->find(iname, ilast, true, &izonecut, &iwildcard);
+    REQUIRE(apex->findExact(q) == (exact ? inode : nullptr));
+  }
+  REQUIRE(zone.findExact({"WWW", "sub"}) == zone.findChild({"sub"})->findChild({"www"}));
+  REQUIRE(!zone.findExact({"delegated"}));
+  REQUIRE(!apex->children.find({"many"})->findExact({"many"})); // only for the apex
+
+  zone.add({"new", "sub"});
+  REQUIRE(!zone.d_exact);
+}
+
+TEST_CASE("Zone in an arena", "[arena]") {
+  auto arena = std::make_unique<Arena>();
+  auto zone = std::make_unique<DNSNode>();
+  {
+    ArenaScope scope(arena.get());
+    zone = std::make_unique<DNSNode>();
+    for(int n = 0; n < 100; ++n)
+      zone->add({"host"+to_string(n)})->addRRs(AGen::make("192.0.2.1"), TXTGen::make({string(100, 'x')}));
+    REQUIRE(Arena::current() == arena.get());
+  }
+  REQUIRE(!Arena::current());
+  auto used = arena->used();
+  REQUIRE(used > 100 * (sizeof(DNSNode) + sizeof(AGen)));
+  REQUIRE(arena->reserved() >= used);
+
+  // outside of the scope, containers made in it keep using the arena, but new records come from the heap
+  zone->add({"late"})->addRRs(AGen::make("192.0.2.2"));
+  REQUIRE(arena->used() > used);
+  REQUIRE(arena->used() - used < sizeof(DNSNode) + 64);
+
+  DNSName name({"host99"}), last;
+  auto node = zone->find(name, last);
+  REQUIRE(name.empty());
+  REQUIRE(node->rrsets.count(DNSType::TXT));
+  zone->d_arena = std::move(arena);
+  zone.reset(); // frees the arena after the nodes
+}
+
+namespace {
+struct Counted
+{
+  explicit Counted(int v) : value(v) { ++live; }
+  ~Counted() { value = 0; --live; }
+  int value;
+  static std::atomic<int> live;
+};
+std::atomic<int> Counted::live;
+}
+
+TEST_CASE("RCUPtr swaps under readers", "[rcu]") {
+  {
+    RCUPtr<Counted> rcu(make_unique<Counted>(1));
+    {
+      RCUPtr<Counted>::Pin pin(rcu);
+      rcu.publish(make_unique<Counted>(2));
+      REQUIRE(pin->value == 1); // still ours, even though it was replaced
+      REQUIRE(Counted::live == 2);
+      REQUIRE(rcu.reclaim() == 1);
+      RCUPtr<Counted>::Pin pin2(rcu);
+      REQUIRE(pin2->value == 2);
+    }
+    REQUIRE(rcu.reclaim() == 0);
+    REQUIRE(Counted::live == 1);
+
+    // readers never see an object that was freed
+    std::atomic<bool> stop{false};
+    std::atomic<int> bad{0};
+    vector<std::thread> readers;
+    for(int n = 0; n < 4; ++n)
+      readers.emplace_back([&]() {
+          while(!stop) {
+            RCUPtr<Counted>::Pin pin(rcu);
+            if(pin->value < 2)
+              ++bad;
+          }
+        });
+    for(int n = 3; n < 1000; ++n)
+      rcu.publish(make_unique<Counted>(n));
+    stop = true;
+    for(auto& t : readers)
+      t.join();
+    REQUIRE(bad == 0);
+    REQUIRE(rcu.reclaim() == 0);
+    REQUIRE(Counted::live == 1);
+  }
+  REQUIRE(Counted::live == 0);
+}
+
+TEST_CASE("DoubleBuffered keeps its copies the same", "[rcu]") {
+  typedef vector<int> Ints;
+  DoubleBuffered<Ints> db(std::make_unique<Ints>(), [](const Ints& v) { return std::make_unique<Ints>(v); });
+  auto current = [&]() { RCUPtr<Ints>::Pin pin(db.rcu()); return *pin; };
+  // each update swaps the copies, so two in a row show both
+  auto both = [&]() {
+    Ints first = current();
+    db.update([](Ints&) {});
+    REQUIRE(current() == first);
+    db.update([](Ints&) {});
+    REQUIRE(current() == first);
+    return first;
+  };
+
+  db.update([](Ints& v) { v.push_back(1); });
+  REQUIRE(both() == Ints({1}));
+
+  // failing on the second copy: the change is out there, and the second copy is made anew
+  int calls = 0;
+  db.update([&](Ints& v) {
+      v.push_back(2);
+      if(++calls == 2)
+        throw std::runtime_error("second copy");
+    });
+  REQUIRE(both() == Ints({1, 2}));
+
+  // failing on the first copy: nobody sees it, and it is made anew
+  calls = 0;
+  REQUIRE_THROWS_AS(db.update([&](Ints& v) {
+        v.push_back(3);
+        if(++calls == 1)
+          throw std::runtime_error("first copy");
+      }), std::runtime_error);
+  REQUIRE(calls == 1);
+  REQUIRE(both() == Ints({1, 2}));
+}
+
+//! Everything in a zone, in canonical order, for comparing zones
+static string describeZone(const DNSNode& apex)
+{
+  string ret;
+  for(auto n = &apex; n; n = n->next()) {
+    ret += n->getName().toString() + "\n";
+    for(const auto& rrs : n->rrsets) {
+      ret += string(" ") + toString(rrs.first) + " " + to_string(rrs.second.ttl);
+      for(const auto* part : {&rrs.second.contents, &rrs.second.signatures})
+        for(const auto& rr : *part)
+          ret += " " + rr->toString();
+      ret += "\n";
+    }
+  }
+  return ret;
+}
+
+TEST_CASE("Changesets", "[changeset]") {
+  auto base = [](DNSNode& zone) {
+    zone.addRRs(SOAGen::make({"ns1", "example", "com"}, {"admin", "example", "com"}, 1), NSGen::make({"ns1", "example", "com"}));
+    zone.add({"www"})->addRRs(AGen::make("192.0.2.1"));
+    zone.add({"mail"})->addRRs(AGen::make("192.0.2.2"));
+    zone.add({"sub"})->addRRs(NSGen::make({"ns1", "sub", "example", "com"}), NSGen::make({"ns2", "sub", "example", "com"}));
+    zone.add({"ns1", "sub"})->addRRs(AGen::make("192.0.2.3"));
+    zone.add({"x", "y", "deep"})->addRRs(TXTGen::make({"deep"}));
+    zone.add({"deep"})->addRRs(TXTGen::make({"stays"}));
+    for(int n = 0; n < 20; ++n)
+      zone.add({"host"+to_string(n), "many"})->addRRs(AGen::make("192.0.2.4"));
+  };
+
+  Changeset cs;
+  cs.remove({"www"}, AGen::make("192.0.2.1"));
+  cs.remove({"x", "y", "deep"}, TXTGen::make({"deep"}));
+  cs.remove({"sub"}, NSGen::make({"ns1", "sub", "example", "com"}));
+  cs.remove({"sub"}, NSGen::make({"ns2", "sub", "example", "com"}));
+  cs.remove({"host0", "many"}, AGen::make("192.0.2.4"));
+  cs.remove({"nosuch"}, AGen::make("192.0.2.4"));          // not there, so ignored
+  cs.remove({"mail"}, AGen::make("192.0.2.99"));           // neither is this
+  cs.add({"www"}, 60, AGen::make("192.0.2.9"));
+  cs.add({"new", "name"}, 3600, AGen::make("192.0.2.5"));
+  cs.add({"mail"}, 3600, NSGen::make({"ns1", "example", "com"}));
+  cs.add({"host20", "many"}, 3600, AGen::make("192.0.2.4"));
+  cs.add({"host1", "many"}, 3600, AGen::make("192.0.2.4")); // already there, so ignored
+
+  // what the zone should look like afterwards
+  auto expected = [&](DNSNode& zone) {
+    zone.addRRs(SOAGen::make({"ns1", "example", "com"}, {"admin", "example", "com"}, 1), NSGen::make({"ns1", "example", "com"}));
+    zone.add({"www"})->addRRs(AGen::make("192.0.2.9"));
+    zone.add({"www"})->rrsets[DNSType::A].ttl = 60;
+    zone.add({"mail"})->addRRs(AGen::make("192.0.2.2"), NSGen::make({"ns1", "example", "com"}));
+    zone.add({"ns1", "sub"})->addRRs(AGen::make("192.0.2.3"));
+    zone.add({"deep"})->addRRs(TXTGen::make({"stays"}));
+    zone.add({"new", "name"})->addRRs(AGen::make("192.0.2.5"));
+    for(int n = 1; n < 21; ++n)
+      zone.add({"host"+to_string(n), "many"})->addRRs(AGen::make("192.0.2.4"));
+  };
+
+  DNSNode zones, wanted;
+  DNSName zonename({"example", "com"});
+  auto& zone = *(zones.add(zonename)->zone = make_unique<DNSNode>());
+  auto& want = *(wanted.add(zonename)->zone = make_unique<DNSNode>());
+  base(zone);
+  expected(want);
+  zones.freeze();
+  wanted.freeze();
+  auto copy = zone.clone();
+  REQUIRE(describeZone(*copy) == describeZone(zone));
+  REQUIRE(copy->d_exact);
+  REQUIRE(copy->d_exact->size() == zone.d_exact->size());
+
+  zone.apply(cs);
+  REQUIRE(describeZone(zone) == describeZone(want));
+  REQUIRE(zone.d_exact->size() == want.d_exact->size());
+  REQUIRE(zone.findChild({"many"})->d_index.d_kind == DNSNode::ChildIndex::Kind::Hashed);
+  REQUIRE(!zone.findChild({"deep"})->findChild({"y"}));
+
+  vector<DNSName> queries{{}, {"www"}, {"WWW"}, {"mail"}, {"x", "mail"}, {"sub"}, {"ns1", "sub"}, {"deep"},
+      {"y", "deep"}, {"x", "y", "deep"}, {"new", "name"}, {"name"}, {"host0", "many"}, {"host20", "many"}, {"nosuch"}};
+  for(const auto& q : queries) {
+    INFO("query " << q);
+    auto ours = zone.findExact(q);
+    auto theirs = want.findExact(q);
+    REQUIRE(!ours == !theirs);
+    if(ours)
+      REQUIRE(ours->getName() == theirs->getName());
+    DNSName name(q), last;
+    const DNSNode *zonecut = nullptr, *wildcard = nullptr;
+    auto node = zone.find(name, last, true, &zonecut, &wildcard);
+    REQUIRE(ours == (name.empty() && !zonecut && !wildcard ? node : nullptr));
+  }
+
+  // the copy, as the standby of a DoubleBuffered, gets the same change
+  DoubleBuffered<DNSNode> db(std::move(copy), [](const DNSNode& z) { return z.clone(); });
+  db.update([&](DNSNode& z) { z.apply(cs); });
+  {
+    RCUPtr<DNSNode>::Pin pin(db.rcu());
+    REQUIRE(describeZone(*pin) == describeZone(want));
+  }
+  db.update([&](DNSNode& z) { z.apply(cs); }); // again, this changes nothing
+  RCUPtr<DNSNode>::Pin pin(db.rcu());
+  REQUIRE(describeZone(*pin) == describeZone(want));
+  // it is frozen, so what it publishes finds names through its indexes
+  REQUIRE(pin->d_exact);
+  REQUIRE(pin->d_exact->size() == want.d_exact->size());
+  REQUIRE(pin->findChild({"many"})->d_index.d_kind == DNSNode::ChildIndex::Kind::Hashed);
+  for(const auto& q : queries) {
+    INFO("query " << q);
+    auto ours = pin->findExact(q);
+    auto theirs = want.findExact(q);
+    REQUIRE(!ours == !theirs);
+    if(ours)
+      REQUIRE(ours->getName() == theirs->getName());
+  }
+}
+
+TEST_CASE("Changes to a zone in an arena", "[changeset][arena]") {
+  DNSNode zones;
+  auto& zone = *(zones.add({"example", "com"})->zone = make_unique<DNSNode>());
+  zone.d_arena = make_unique<Arena>();
+  {
+    ArenaScope scope(zone.d_arena.get());
+    zone.addRRs(SOAGen::make({"ns1", "example", "com"}, {"admin", "example", "com"}, 1));
+    for(int n = 0; n < 1000; ++n)
+      zone.add({"host"+to_string(n)})->addRRs(AGen::make("192.0.2.1"));
+  }
+  zones.freeze();
+  auto loaded = zone.d_arena->used();
+  auto before = describeZone(zone);
+
+  // each round leaves a node and a large record behind in the arena
+  Changeset there, back;
+  there.remove({"host5"}, AGen::make("192.0.2.1"));
+  there.add({"moved5"}, 3600, TXTGen::make({string(200, 'x'), string(200, 'y')}));
+  back.remove({"moved5"}, TXTGen::make({string(200, 'x'), string(200, 'y')}));
+  back.add({"host5"}, 3600, AGen::make("192.0.2.1"));
+  size_t most = 0, used = loaded, compactions = 0;
+  for(int n = 0; n < 5000; ++n) {
+    zone.apply(n % 2 ? back : there);
+    most = std::max(most, zone.d_arena->reserved());
+    compactions += zone.d_arena->used() < used;
+    used = zone.d_arena->used();
+  }
+  REQUIRE(compactions > 1);
+  REQUIRE(most <= 2 * std::max(loaded, (size_t)256 * 1024) + 512 * 1024);
+  REQUIRE(describeZone(zone) == before);
+
+  // and is as frozen as it was
+  REQUIRE(zone.d_exact);
+  REQUIRE(zone.d_index.d_kind == DNSNode::ChildIndex::Kind::Hashed);
+  REQUIRE(zone.findExact({"host999"}) == zone.findChild({"host999"}));
+  REQUIRE(zone.findExact({"host5"}));
+  REQUIRE(!zone.findExact({"moved5"}));
+  REQUIRE(zone.findChild({"host999"})->d_parent == &zone);
+}
+
+TEST_CASE("Changes retrieved with IXFR", "[changeset][ixfr]") {
+  DNSName zonename({"example", "com"});
+  DNSName mname({"ns1", "example", "com"}), rname({"admin", "example", "com"});
+  auto soa = [&](uint32_t serial) { return SOAGen::make(mname, rname, serial); };
+
+  DNSNode zones;
+  auto& zone = *(zones.add(zonename)->zone = make_unique<DNSNode>());
+  zone.addRRs(soa(1), NSGen::make(mname));
+  zone.add({"www"})->addRRs(AGen::make("192.0.2.1"));
+  zone.add({"old"})->addRRs(AGen::make("192.0.2.2"));
+  zones.freeze();
+
+  // a remote that answers each IXFR with the next of these, a message per vector
+  typedef vector<vector<pair<DNSName, std::unique_ptr<RRGen>>>> Response;
+  auto rec = [&](DNSName name, std::unique_ptr<RRGen>&& rr) { return make_pair(name + zonename, std::move(rr)); };
+  vector<Response> responses(3);
+  responses[0].resize(2); // from 1 to 2 to 3, in two messages
+  responses[0][0].push_back(rec({}, soa(3)));
+  responses[0][0].push_back(rec({}, soa(1)));
+  responses[0][0].push_back(rec({"www"}, AGen::make("192.0.2.1")));
+  responses[0][0].push_back(rec({}, soa(2)));
+  responses[0][0].push_back(rec({"www"}, AGen::make("192.0.2.9")));
+  responses[0][1].push_back(rec({}, soa(2)));
+  responses[0][1].push_back(rec({"old"}, AGen::make("192.0.2.2")));
+  responses[0][1].push_back(rec({}, soa(3)));
+  responses[0][1].push_back(rec({"new", "name"}, AGen::make("192.0.2.5")));
+  responses[0][1].push_back(rec({}, soa(3)));
+  responses[1].resize(1); // up to date
+  responses[1][0].push_back(rec({}, soa(3)));
+  responses[2].resize(1); // the whole zone instead
+  responses[2][0].push_back(rec({}, soa(4)));
+  responses[2][0].push_back(rec({}, NSGen::make(mname)));
+  responses[2][0].push_back(rec({}, soa(4)));
+
+  ComboAddress remote("127.0.0.1", 0);
+  Socket listener(remote.sin4.sin_family, SOCK_STREAM);
+  SBind(listener, remote);
+  SListen(listener, 10);
+  socklen_t socklen = remote.getSocklen();
+  getsockname(listener, (struct sockaddr*)&remote, &socklen);
+  vector<uint32_t> asked;
+  std::thread server([&]() {
+      for(const auto& response : responses) {
+        ComboAddress client(remote);
+        Socket sock(SAccept(listener, client));
+        string len = SRead(sock, 2);
+        DNSMessageReader query(SRead(sock, (uint8_t)len[0] * 256 + (uint8_t)len[1]));
+        DNSName qname, name;
+        DNSType qtype, type;
+        query.getQuestion(qname, qtype);
+        DNSSection section;
+        uint32_t ttl;
+        std::unique_ptr<RRGen> rr;
+        while(query.getRR(section, name, type, ttl, rr))
+          if(qtype == DNSType::IXFR && section == DNSSection::Authority && qname == zonename)
+            asked.push_back(rrCast<SOAGen>(rr)->d_serial);
+        for(const auto& message : response) {
+          DNSMessageWriter dmw(zonename, DNSType::IXFR, DNSClass::IN, 16384);
+          for(const auto& r : message)
+            dmw.putRR(DNSSection::Answer, r.first, 3600, r.second);
+          string ser = dmw.serialize();
+          SWriten(sock, string{(char)(ser.size() / 256), (char)(ser.size() % 256)} + ser);
+        }
+      }
+    });
+
+  DoubleBuffered<DNSNode> db(zone.clone(), [](const DNSNode& z) { return z.clone(); });
+  auto serial = [&]() {
+    RCUPtr<DNSNode>::Pin pin(db.rcu());
+    return rrCast<SOAGen>(pin->rrsets.find(DNSType::SOA)->second.contents[0])->d_serial;
+  };
+  auto refresh = [&]() {
+    RCUPtr<DNSNode>::Pin pin(db.rcu());
+    return retrieveChanges(remote, zonename, *rrCast<SOAGen>(pin->rrsets.find(DNSType::SOA)->second.contents[0]));
+  };
+
+  auto ixfr = refresh();
+  REQUIRE(!ixfr.full());
+  REQUIRE(ixfr.changesets.size() == 2);
+  REQUIRE(ixfr.changesets[0].removes.size() == 2); // SOA 1 and www
+  REQUIRE(ixfr.changesets[1].adds.size() == 2);    // SOA 3 and new.name
+  db.update([&](DNSNode& z) {
+      for(const auto& cs : ixfr.changesets)
+        z.apply(cs);
+    });
+  REQUIRE(serial() == 3);
+  {
+    RCUPtr<DNSNode>::Pin pin(db.rcu());
+    auto www = pin->findExact({"www"});
+    REQUIRE(www);
+    REQUIRE(www->rrsets.find(DNSType::A)->second.contents.size() == 1);
+    REQUIRE(rrCast<AGen>(www->rrsets.find(DNSType::A)->second.contents[0])->getIP() == ComboAddress("192.0.2.9"));
+    REQUIRE(pin->findExact({"new", "name"}));
+    REQUIRE(!pin->findExact({"old"}));
+    REQUIRE(pin->findChild({"name"})->d_index.d_kind != DNSNode::ChildIndex::Kind::None);
+  }
+
+  ixfr = refresh();
+  REQUIRE(!ixfr.full());
+  REQUIRE(ixfr.changesets.empty());
+
+  ixfr = refresh();
+  REQUIRE(ixfr.full());
+  server.join();
+  REQUIRE(asked == vector<uint32_t>({1, 3, 3}));
+}
+
+TEST_CASE("Record kinds", "[rrgen]") {
+  auto a = AGen::make("192.0.2.1");
+  std::unique_ptr<RRGen> unknown(new UnknownGen(DNSType::A, string(4, '\0')));
+  auto clock = ClockTXTGen::make("%Y");
+
+  REQUIRE(rrCast<AGen>(a));
+  REQUIRE(rrCast<AGen>(a)->getIP() == ComboAddress("192.0.2.1"));
+  REQUIRE(!rrCast<AGen>(unknown)); // same type, but not an AGen, just like dynamic_cast
+  REQUIRE(!rrCast<TXTGen>(clock));
+  REQUIRE(!rrCast<AGen>((RRGen*)nullptr));
+
+  auto name = [](const RRGen& rr) {
+    return visitRR(rr, [](const auto& gen) { return std::string(typeid(gen).name()); });
+  };
+  REQUIRE(name(*a) == typeid(AGen).name());
+  REQUIRE(name(*unknown) == typeid(UnknownGen).name());
+  REQUIRE(name(*clock) == typeid(ClockTXTGen).name());
+
+  MXGen mx(25, {"server1", "example", "com"});
+  string text;
+  visitRR((RRGen&)mx, [&](auto& gen) { text = gen.toString(); });
+  REQUIRE(text == "25 server1.example.com.");
+  REQUIRE(getTargetName(std::unique_ptr<RRGen>(new MXGen(mx))) == DNSName({"server1", "example", "com"}));
+  REQUIRE_THROWS_AS(getSOAMinimum(a), std::runtime_error);
+}
+
+TEST_CASE("Interned names", "[intern]") {
+  DNSName ns1({"ns1", "example", "com"});
+  auto before = InternedName::stats();
+  {
+    NSGen a(ns1), b(ns1), c(makeDNSName("NS1.example.com"));
+    REQUIRE(!a.d_name.sameAs(b.d_name)); // each has its own, until interned
+    REQUIRE(InternedName::stats().names == before.names);
+    for(auto* gen : {&a, &b, &c})
+      gen->d_name.intern();
+    REQUIRE(a.d_name.sameAs(b.d_name));
+    REQUIRE(!a.d_name.sameAs(c.d_name)); // case is kept
+    REQUIRE(a.d_name == c.d_name);
+    REQUIRE(a.d_name == ns1);
+    REQUIRE(c.toString() == "NS1.example.com.");
+
+    auto during = InternedName::stats();
+    REQUIRE(during.names == before.names + 2);
+    REQUIRE(during.references == before.references + 3);
+
+    // freezing a zone interns the names its records point to
+    DNSNode zone;
+    for(int n = 0; n < 1000; ++n)
+      zone.add({"mx"+to_string(n)})->addRRs(MXGen::make(n, ns1));
+    zone.freeze();
+    const auto& mx = zone.findChild(DNSLabel("mx999"))->rrsets.find(DNSType::MX)->second;
+    REQUIRE(rrCast<MXGen>(mx.contents[0])->d_name.sameAs(a.d_name));
+    REQUIRE(InternedName::stats().saved() > during.saved() + 900 * 200);
+  }
+  auto after = InternedName::stats(); // unused names leave the table
+  REQUIRE(after.names == before.names);
+  REQUIRE(after.references == before.references);
+
+  // names parsed from messages are not, reading takes no lock
+  DNSMessageWriter dmw(ns1, DNSType::NS);
+  dmw.putRR(DNSSection::Answer, ns1, 3600, NSGen::make(ns1));
+  dmw.putRR(DNSSection::Answer, ns1, 3600, NSGen::make(ns1));
+  DNSMessageReader dmr(dmw.serialize());
+  DNSName rname;
+  DNSType rtype;
+  dmr.getQuestion(rname, rtype);
+  DNSSection rrsection;
+  uint32_t ttl;
+  std::unique_ptr<RRGen> rr1, rr2;
+  REQUIRE(dmr.getRR(rrsection, rname, rtype, ttl, rr1));
+  REQUIRE(dmr.getRR(rrsection, rname, rtype, ttl, rr2));
+  REQUIRE(!rrCast<NSGen>(rr1)->d_name.sameAs(rrCast<NSGen>(rr2)->d_name));
+  REQUIRE(rrCast<NSGen>(rr1)->d_name == rrCast<NSGen>(rr2)->d_name);
+  REQUIRE(InternedName::stats().names == before.names);
+}
+
+TEST_CASE("Memory usage", "[memory]") {
+  DNSNode zones;
+  DNSName apex({"example", "com"});
+  auto zone = zones.add(apex);
+  zone->zone = std::make_unique<DNSNode>();
+  zone->zone->addRRs(SOAGen::make({"ns1", "example", "com"}, {"admin", "example", "com"}, 1),
+                     std::unique_ptr<RRGen>(new RRSIGGen(DNSType::SOA, 1234, apex, string(64, 'x'), 3600, 2, 1, 13, 2)));
+  for(int n = 0; n < 100; ++n)
+    zone->zone->add({"host"+to_string(n)})->addRRs(AGen::make("192.0.2.1"), TXTGen::make({string(100, 'x')}));
+  zone->zone->freeze();
+
+  auto tree = zone->zone->memoryUsage();
+  REQUIRE(tree.nodes == 101);
+  REQUIRE(tree.records == 201);
+  REQUIRE(tree.signatures == 1);
+  REQUIRE(tree.nodeBytes >= 101 * sizeof(DNSNode));
+  REQUIRE(tree.types[DNSType::TXT] > 100 * 100);
+  REQUIRE(tree.types[DNSType::A] >= 100 * sizeof(AGen));
+  REQUIRE(tree.types[DNSType::SOA] > tree.signatureBytes);
+  REQUIRE(tree.rdataBytes + tree.signatureBytes == tree.types[DNSType::A] + tree.types[DNSType::TXT] + tree.types[DNSType::SOA]);
+  REQUIRE(tree.describe().at(0) == "total "+to_string(tree.total()));
+
+  ZoneImage image(*zone->zone, apex);
+  auto compiled = image.memoryUsage();
+  REQUIRE(compiled.total() == image.size());
+  REQUIRE(compiled.nodes == tree.nodes);
+  REQUIRE(compiled.records == tree.records);
+  REQUIRE(compiled.types[DNSType::A] == 100 * 6);
+  REQUIRE(compiled.total() < tree.total());
+
+  auto all = zonesMemoryUsage(zones);
+  REQUIRE(all.size() == 1);
+  REQUIRE(all[0].first == apex);
+  REQUIRE(all[0].second.total() == tree.total());
+  compileZones(zones);
+  REQUIRE(zonesMemoryUsage(zones).at(0).second.total() == image.size());
+}
+
+TEST_CASE("Pre-rendered rdata", "[rrset]") {
+  DNSNode zone;
+  DNSName apex({"example", "com"});
+  zone.addRRs(SOAGen::make({"ns1", "example", "com"}, {"admin", "example", "com"}, 1),
+              MXGen::make(25, {"server1", "example", "com"}),
+              AGen::make("192.0.2.1"), AAAAGen::make("2001:db8::1"),
+              std::unique_ptr<RRGen>(new SRVGen(1, 2, 5060, {"server1", "example", "com"})),
+              std::unique_ptr<RRGen>(new NAPTRGen(1, 2, "s", "SIP+D2U", "", {"_sip", "_udp", "example", "com"})),
+              std::unique_ptr<RRGen>(new RRSIGGen(DNSType::A, 1234, apex, string(64, 'x'), 3600, 2, 1, 13, 3)),
+              ClockTXTGen::make("%Y"));
+
+  // the names in the rdata get compressed the same way, straight from the wire format
+  auto render = [&](bool wire) {
+    DNSMessageWriter dmw(apex, DNSType::ANY);
+    for(const auto& rrs : zone.rrsets) {
+      for(const auto* part : {&rrs.second.contents, &rrs.second.signatures}) {
+        for(const auto& rr : *part) {
+          string rdata = makeWireRData(*rr);
+          if(wire && !rr->isDynamic())
+            dmw.putRR(DNSSection::Answer, apex, rrs.second.ttl, RDataView{rr->getType(), (const uint8_t*)rdata.c_str(), (uint16_t)rdata.size()});
+          else
+            dmw.putRR(DNSSection::Answer, apex, rrs.second.ttl, rr);
+        }
+      }
+    }
+    return dmw.serialize();
+  };
+  REQUIRE(render(true) == render(false));
+
+  // names in pre-rendered rdata are uncompressed, and fit
+  DNSMessageWriter dmw(apex, DNSType::NS);
+  REQUIRE_THROWS_AS(dmw.putRR(DNSSection::Answer, apex, 3600, RDataView{DNSType::NS, (const uint8_t*)"\xc0\x0c", 2}), std::runtime_error);
+  REQUIRE_THROWS_AS(dmw.putRR(DNSSection::Answer, apex, 3600, RDataView{DNSType::NS, (const uint8_t*)"\x03ns1\x07", 6}), std::runtime_error);
+  REQUIRE(dmw.dh.ancount == 0);
+}
+
+//! The authority section addNXDOMAINDNSSEC writes for 'qname', below the apex of 'zone', as "name type" strings
+template<typename Node>
+static vector<string> nxdomainProof(const Node* zone, const DNSName& apex, const DNSName& qname)
+{
+  DNSMessageWriter dmw(qname + apex, DNSType::A);
+  addNXDOMAINDNSSEC(dmw, zone->rrsets.find(DNSType::SOA)->second, qname, zone, (const Node*)nullptr, apex);
+  DNSMessageReader dmr(dmw.serialize());
+  vector<string> ret;
+  DNSSection section;
+  DNSName name;
+  DNSType type;
+  uint32_t ttl;
+  std::unique_ptr<RRGen> rr;
+  while(dmr.getRR(section, name, type, ttl, rr)) {
+    REQUIRE(section == DNSSection::Authority);
+    ret.push_back(name.toString() + " " + toString(type));
+    if(type == DNSType::RRSIG)
+      ret.back() += " " + string(toString(rrCast<RRSIGGen>(rr)->d_type));
+  }
+  return ret;
+}
+
+TEST_CASE("NSEC for names that do not exist", "[dnssec]") {
+  DNSName apex({"example", "com"});
+  DNSNode zone;
+  auto nsec = [&](DNSNode* node) {
+    node->addRRs(std::unique_ptr<RRGen>(new UnknownGen(DNSType::NSEC, string("\x00\x01\x40", 3))),
+                 std::unique_ptr<RRGen>(new RRSIGGen(DNSType::NSEC, 1234, apex, string(64, 'x'), 3600, 2, 1, 13, 2)));
+  };
+  zone.addRRs(SOAGen::make({"ns1", "example", "com"}, {"admin", "example", "com"}, 1),
+              std::unique_ptr<RRGen>(new RRSIGGen(DNSType::SOA, 1234, apex, string(64, 'x'), 3600, 2, 1, 13, 2)));
+  nsec(&zone);
+  for(const char* name : {"a", "m"}) {
+    auto node = zone.add({name});
+    node->addRRs(AGen::make("192.0.2.1"));
+    nsec(node);
+  }
+  auto below = zone.add({"x", "y"}); // which makes y an empty non-terminal, without an NSEC
+  below->addRRs(AGen::make("192.0.2.1"));
+  nsec(below);
+  zone.freeze();
+  ZoneImage image(zone, apex);
+
+  const string soaSig = "example.com. RRSIG SOA";
+  for(int compiled = 0; compiled < 2; ++compiled) {
+    auto proof = [&](const DNSName& qname) {
+      return compiled ? nxdomainProof(image.apex(), apex, qname) : nxdomainProof(&zone, apex, qname);
+    };
+    // between two children, the SOA signature goes on the apex, not on a zone cut we did not pass
+    REQUIRE(proof({"c"}) == vector<string>({soaSig, "a.example.com. NSEC", "a.example.com. RRSIG NSEC"}));
+    REQUIRE(proof({"n"}) == vector<string>({soaSig, "m.example.com. NSEC", "m.example.com. RRSIG NSEC"}));
+    // after the last child, which is an empty non-terminal, so there is no NSEC to give
+    REQUIRE(proof({"z"}) == vector<string>({soaSig}));
+    // before the first child, the apex comes before it
+    REQUIRE(proof({"0"}) == vector<string>({soaSig, "example.com. NSEC", "example.com. RRSIG NSEC"}));
+  }
+
+  // after the last child, when that has an NSEC
+  DNSNode flat;
+  flat.addRRs(SOAGen::make({"ns1", "example", "com"}, {"admin", "example", "com"}, 1));
+  nsec(flat.add({"a"}));
+  flat.freeze();
+  REQUIRE(nxdomainProof(&flat, apex, {"b"}) == vector<string>({"a.example.com. NSEC", "a.example.com. RRSIG NSEC"}));
+}
+
+TEST_CASE("ZoneImage", "[zoneimage]") {
+  DNSNode zone;
+  DNSName apex({"example", "com"});
+  zone.addRRs(SOAGen::make({"ns1", "example", "com"}, {"admin", "example", "com"}, 1));
+  zone.rrsets[DNSType::SOA].ttl = 3600;
+  zone.addRRs(NSGen::make({"ns1", "example", "com"}), NSGen::make({"ns1", "example", "net"}));
+  zone.addRRs(MXGen::make(25, {"server1", "example", "com"}));
+  zone.add({"ns1"})->addRRs(AGen::make("192.0.2.1"), AAAAGen::make("2001:db8::1"));
+  zone.add({"www"})->addRRs(CNAMEGen::make({"server1", "example", "com"}));
+  zone.add({"server1"})->addRRs(AGen::make("192.0.2.2"));
+  zone.add({"server1"})->addRRs(std::unique_ptr<RRGen>(new RRSIGGen(DNSType::A, 1234, apex, string(64, 'x'), 3600, 2, 1, 13, 3)));
+  zone.add({"*", "wild"})->addRRs(TXTGen::make({"wildcard"}));
+  zone.add({"_sip", "_udp"})->addRRs(std::unique_ptr<RRGen>(new SRVGen(1, 2, 5060, {"server1", "example", "com"})));
+  zone.add({"naptr"})->addRRs(std::unique_ptr<RRGen>(new NAPTRGen(1, 2, "s", "SIP+D2U", "", {"_sip", "_udp", "example", "com"})));
+  zone.add({"sub"})->addRRs(NSGen::make({"ns1", "sub", "example", "com"}));
+  zone.add({"ns1", "sub"})->addRRs(AGen::make("192.0.2.3"));
+  for(int n = 0; n < 40; ++n)
+    zone.add({"host"+to_string(n), "big"})->addRRs(AGen::make("192.0.2.4"));
+
+  ZoneImage image(zone, apex);
+  auto ia = image.apex();
+
+  // same nodes in the same order, with the same records, which serialize identically
+  const DNSNode* tn = &zone;
+  auto in = ia;
+  for(; tn && in; tn = tn->next(), in = in->next()) {
+    REQUIRE(tn->getName() == in->getName());
+    if(tn != &zone)
+      REQUIRE(tn->prev()->getName() == in->prev()->getName());
+    REQUIRE(tn->children.size() == in->children.size());
+    REQUIRE(tn->rrsets.size() == in->rrsets.size());
+    for(const auto& rrs : tn->rrsets) {
+      auto iter = in->rrsets.find(rrs.first);
+      REQUIRE(iter != in->rrsets.end());
+      REQUIRE(iter->second.ttl == rrs.second.ttl);
+      REQUIRE(iter->second.contents.size() == rrs.second.contents.size());
+      REQUIRE(iter->second.signatures.size() == rrs.second.signatures.size());
+
+      DNSMessageWriter tw(apex, DNSType::ANY), iw(apex, DNSType::ANY);
+      for(unsigned int n = 0; n < rrs.second.contents.size(); ++n) {
+        tw.putRR(DNSSection::Answer, tn->getName()+apex, rrs.second.ttl, rrs.second.contents[n]);
+        iw.putRR(DNSSection::Answer, in->getName()+apex, iter->second.ttl, iter->second.contents[n]);
+      }
+      for(unsigned int n = 0; n < rrs.second.signatures.size(); ++n) {
+        tw.putRR(DNSSection::Answer, tn->getName()+apex, rrs.second.ttl, rrs.second.signatures[n]);
+        iw.putRR(DNSSection::Answer, in->getName()+apex, iter->second.ttl, iter->second.signatures[n]);
+      }
+      REQUIRE(tw.serialize() == iw.serialize());
+    }
+  }
+  REQUIRE(!tn);
+  REQUIRE(!in);
+  REQUIRE(!ia->rrsets.count(DNSType::TXT));
+  REQUIRE(ia->rrsets.find(DNSType::DS) == ia->rrsets.end());
+
+  // find, including wildcards and zonecuts
+  for(auto name : vector<DNSName>{{"www"}, {"WWW"}, {"host39", "big"}, {"host40", "big"}, {"a", "b", "wild"}, {"ns1", "sub"}, {"nosuch"}}) {
+    DNSName tname(name), tlast, iname(name), ilast;
+    const DNSNode* tcut = 0, *twild = 0;
+    const ZoneImage::Node* icut = 0, *iwild = 0;
+    auto tfnd = zone.find(tname, tlast, true, &tcut, &twild);
+    auto ifnd = ia->find(iname, ilast, true, &icut, &iwild);
+    REQUIRE(tname == iname);
+    REQUIRE(tlast == ilast);
+    REQUIRE(tfnd->getName() == ifnd->getName());
+    REQUIRE(!tcut == !icut);
+    REQUIRE(!twild == !iwild);
+  }
+
+  REQUIRE(getTargetName(ia->children.find({"www"})->rrsets.find(DNSType::CNAME)->second.contents[0]) == DNSName({"server1", "example", "com"}));
+  REQUIRE(getSOAMinimum(ia->rrsets.find(DNSType::SOA)->second.contents[0]) == 3600);
+
+  // snapshots
+  REQUIRE(image.serial() == 1);
+  REQUIRE(image.zoneName() == apex);
+  char tmpl[] = "/tmp/tdns-testXXXXXX";
+  REQUIRE(mkdtemp(tmpl));
+  string fname = snapshotName(tmpl, apex);
+  image.save(fname);
+  {
+    auto loaded = ZoneImage::load(fname);
+    REQUIRE(loaded->size() == image.size());
+    REQUIRE(loaded->serial() == 1);
+    REQUIRE(loaded->zoneName() == apex);
+    auto ln = loaded->apex();
+    for(in = ia; in; in = in->next(), ln = ln->next()) {
+      REQUIRE(ln);
+      REQUIRE(ln->getName() == in->getName());
+      REQUIRE(ln->rrsets.size() == in->rrsets.size());
+    }
+    REQUIRE(!ln);
+  }
+  string raw;
+  {
+    ifstream ifs(fname);
+    raw.assign(istreambuf_iterator<char>(ifs), istreambuf_iterator<char>());
+  }
+  // every offset is checked on loading, so a changed snapshot can't send us outside of it
+  typedef ZoneImage::Node Node;
+  size_t child = ia->d_self + sizeof(Node); // the first child of the apex
+  for(auto field : {child + offsetof(Node, d_self), child + offsetof(Node, d_parent),
+        child + offsetof(Node, d_label), child + offsetof(Node, d_next), child + offsetof(Node, d_pos),
+        child + offsetof(Node, children) + offsetof(ZoneImage::ChildList, d_count),
+        child + offsetof(Node, rrsets) + offsetof(ZoneImage::RRSetMap, d_count),
+        ia->d_self + offsetof(Node, children) + offsetof(ZoneImage::ChildList, d_offsets),
+        ia->d_self + offsetof(Node, rrsets) + offsetof(ZoneImage::RRSetMap, d_entries)}) {
+    string bad = raw;
+    uint32_t val = 0x7ffffff0;
+    memcpy(&bad.at(field), &val, sizeof(val));
+    ofstream(fname) << bad;
+    REQUIRE_THROWS_AS(ZoneImage::load(fname), std::runtime_error);
+  }
+  ofstream(fname) << raw;
+  REQUIRE(ZoneImage::load(fname)->serial() == 1);
+
+  raw.resize(raw.size() - 1);
+  ofstream(fname) << raw;
+  REQUIRE_THROWS_AS(ZoneImage::load(fname), std::runtime_error);
+  raw[0] = 'x';
+  ofstream(fname) << raw;
+  REQUIRE_THROWS_AS(ZoneImage::load(fname), std::runtime_error);
+  unlink(fname.c_str());
+  rmdir(tmpl);
+  REQUIRE_THROWS_AS(ZoneImage::load(fname), std::runtime_error);
+
+  zone.add({"time"})->addRRs(ClockTXTGen::make("%H:%M"));
+  REQUIRE_THROWS_AS(ZoneImage(zone, apex), std::runtime_error);
+}
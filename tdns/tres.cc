@@ -1,6 +1,7 @@
 #include <fstream>
 #include <vector>
 #include <map>
+#include <unordered_set>
 #include <stdexcept>
 #include "sclasses.hh"
 #include <signal.h>
@@ -105,9 +106,9 @@ static ComboAddress getIP(const std::unique_ptr<RRGen>& rr)
 {
   ComboAddress ret;
   ret.sin4.sin_family = 0;
-  if(auto ptr = dynamic_cast<AGen*>(rr.get()))
+  if(auto ptr = rrCast<AGen>(rr))
     ret=ptr->getIP();
-  else if(auto ptr = dynamic_cast<AAAAGen*>(rr.get()))
+  else if(auto ptr = rrCast<AAAAGen>(rr))
     ret=ptr->getIP();
 
   ret.sin4.sin_port = htons(53);
@@ -326,7 +327,7 @@ TDNSResolver::ResolveResult TDNSResolver::resolveAt(const DNSName& dn, const DNS
       }
       
       std::unique_ptr<RRGen> rr;
-      set<DNSName> nsses;
+      unordered_set<DNSName, DNSNameHash, DNSNameEqual> nsses; // shuffled below anyway
       multimap<DNSName, ComboAddress> addresses;
 
       /* here we loop over records. Perhaps the answer is there, perhaps
@@ -342,15 +343,20 @@ TDNSResolver::ResolveResult TDNSResolver::resolveAt(const DNSName& dn, const DNS
             ret.res.push_back({dn, ttl, std::move(rr)});
           }
           else if(dn == rrdn && rrdt == DNSType::CNAME) {
-            DNSName target = dynamic_cast<CNAMEGen*>(rr.get())->d_name;
+            DNSName target = rrCast<CNAMEGen>(rr)->d_name;
             ret.intermediate.push_back({dn, ttl, std::move(rr)}); // rr is DEAD now!
             lstream() << prefix<<"We got a CNAME to " << target <<", chasing"<<endl;
             dotCNAME(target, sp.first, dn);
             if(target.isPartOf(auth)) { // this points to something we consider this server auth for
               lstream() << prefix << "target " << target << " is within " << auth<<", harvesting from packet"<<endl;
-              bool hadMatch=false;      // perhaps the answer is in this DNS message
-              while(dmr.getRR(rrsection, rrdn, rrdt, ttl, rr)) {
-                if(rrsection==DNSSection::Answer && rrdn == target && rrdt == dt) {
+              bool hadMatch=false;      // perhaps the answer is in this DNS message, before or after the CNAME
+              const auto& index = dmr.index();
+              for(size_t n = 0; n < index.size(); ++n) {
+                if(index[n].section != DNSSection::Answer || index[n].type != dt)
+                  continue;             // only the records we might want get parsed
+                dmr.seekRR(n);
+                dmr.getRR(rrsection, rrdn, rrdt, ttl, rr);
+                if(rrdn == target) {
                   hadMatch=true;
                   ret.res.push_back({dn, ttl, std::move(rr)});
                 }
@@ -375,7 +381,7 @@ TDNSResolver::ResolveResult TDNSResolver::resolveAt(const DNSName& dn, const DNS
           // of what we approached this server for.
           if(rrsection == DNSSection::Authority && rrdt == DNSType::NS) {
             if(dn.isPartOf(rrdn))  {
-              DNSName nsname = dynamic_cast<NSGen*>(rr.get())->d_name;
+              DNSName nsname = rrCast<NSGen>(rr)->d_name;
 
               if(!dmr.dh.aa && (newAuth != rrdn || nsses.empty())) {
                 dotDelegation(rrdn, sp.first);
@@ -0,0 +1,59 @@
+#include <iostream>
+#include <string>
+#include "record-types.hh"
+#include "zone-image.hh"
+
+/*! 
+   @file
+   @brief Reports what zones cost in memory, see MemoryUsage
+
+   Retrieves zones by AXFR and reports what they use as a tree, and as the
+   ZoneImage tauth would serve them from. Or, reports on snapshots tauth saved.
+   A running tauth reports on its zones in response to a CH TXT query for
+   memory.tdns.
+*/
+
+using namespace std;
+
+static void report(const string& what, const MemoryUsage& mu)
+{
+  for(const auto& line : mu.describe())
+    cout << what << ": " << line << endl;
+}
+
+int main(int argc, char** argv)
+try
+{
+  if(argc < 2) {
+    cerr<<"Syntax: tzonestat ip[:port] zone [zone] .."<<endl;
+    cerr<<"        tzonestat snapshot.zimg [snapshot.zimg] .."<<endl;
+    return(EXIT_FAILURE);
+  }
+  string first(argv[1]);
+  if(first.size() > 5 && first.substr(first.size() - 5) == ".zimg") {
+    for(int n = 1; n < argc; ++n) {
+      auto image = ZoneImage::load(argv[n]);
+      report(image->zoneName().toString()+" snapshot", image->memoryUsage());
+    }
+    return EXIT_SUCCESS;
+  }
+
+  ComboAddress remote(argv[1], 53);
+  for(int n = 2; n < argc; ++n) {
+    DNSName zonename = makeDNSName(argv[n]);
+    auto zone = retrieveZone(remote, zonename);
+    zone->freeze();
+    report(zonename.toString()+" tree", zone->memoryUsage());
+    if(zone->d_arena)
+      cout << zonename << " tree: arena "<<zone->d_arena->reserved()<<endl;
+    ZoneImage image(*zone, zonename);
+    report(zonename.toString()+" image", image.memoryUsage());
+  }
+  auto is = InternedName::stats();
+  cout<<"interned names: "<<is.names<<" for "<<is.references<<" references, using "<<is.bytes<<", saving "<<is.saved()<<endl;
+}
+catch(std::exception& e)
+{
+  cerr<<"Fatal error: "<<e.what()<<endl;
+  return EXIT_FAILURE;
+}
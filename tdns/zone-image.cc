@@ -0,0 +1,670 @@
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "zone-image.hh"
+#include "record-types.hh"
+
+/*!
+   @file
+   @brief Compiles a DNSNode tree into a ZoneImage, walks the image, and saves and maps snapshots of it
+*/
+
+using namespace std;
+
+namespace {
+//! A node of the tree we are compiling, with the index of its parent and children
+struct Todo
+{
+  const DNSNode* node;
+  uint32_t parent;
+  uint32_t pos;
+  vector<uint32_t> children;
+};
+
+//! Lists 'node' and everything below it in canonical order, which is depth first
+void collect(vector<Todo>& todo, const DNSNode* node, uint32_t parent, uint32_t pos)
+{
+  uint32_t us = todo.size();
+  todo.push_back({node, parent, pos, {}});
+  uint32_t childpos = 0;
+  for(const auto& c : node->children) {
+    todo[us].children.push_back(todo.size());
+    collect(todo, &c, us, childpos++);
+  }
+}
+}
+
+//! Adds 'len' bytes to the image, aligned on 4 bytes, returns their offset
+uint32_t ZoneImage::append(const void* data, size_t len)
+{
+  d_data.resize((d_data.size() + 3) & ~3);
+  if(d_data.size() + len > UINT32_MAX)
+    throw std::runtime_error("Zone too large for a ZoneImage");
+  uint32_t ret = d_data.size();
+  d_data.append((const char*)data, len);
+  return ret;
+}
+
+ZoneImage::ZoneImage(const DNSNode& zone, const DNSName& zonename)
+{
+  vector<Todo> todo;
+  collect(todo, &zone, 0, 0);
+
+  // the nodes come right after the header, so we know where each will end up
+  Header header;
+  memset(&header, 0, sizeof(header));
+  strcpy(header.magic, "tdnsimg");
+  header.version = version;
+  header.nodes = sizeof(Header);
+  header.count = todo.size();
+  append(&header, sizeof(header));
+  vector<Node> nodes(todo.size());
+  d_data.resize(sizeof(Header) + nodes.size() * sizeof(Node));
+  auto offset = [](uint32_t idx) -> uint32_t { return sizeof(Header) + idx * sizeof(Node); };
+  // for the table of full names, parents come before their children
+  vector<uint32_t> hashes(todo.size(), ExactIndex::hashStart);
+  vector<bool> belowCut(todo.size(), false);
+  uint32_t exactcount = 0;
+
+  for(uint32_t idx = 0; idx < todo.size(); ++idx) {
+    const auto& t = todo[idx];
+    Node& n = nodes[idx];
+    memset(&n, 0, sizeof(n));
+    n.d_self = offset(idx);
+    n.d_parent = idx ? offset(t.parent) : 0;
+    n.d_next = idx + 1 < todo.size() ? offset(idx + 1) : 0;
+    n.d_pos = t.pos;
+    if(idx) {
+      hashes[idx] = ExactIndex::hash(hashes[t.parent], t.node->d_name);
+      belowCut[idx] = belowCut[t.parent] || t.node->rrsets.count(DNSType::NS);
+    }
+    if(!belowCut[idx])
+      ++exactcount;
+
+    // the apex has no label of its own, it has length 0
+    string label(1, 0);
+    if(idx) {
+      const auto& dl = t.node->d_name;
+      label[0] = dl.d_s.size();
+      label += dl.d_s;
+      label += dl.d_folded;
+    }
+    n.d_label = append(label.c_str(), label.size());
+
+    vector<uint32_t> children;
+    for(auto c : t.children)
+      children.push_back(offset(c));
+    n.children.d_count = children.size();
+    if(!children.empty())
+      n.children.d_offsets = append(&children.at(0), children.size() * sizeof(uint32_t));
+
+    if(children.size() >= DNSNode::ChildIndex::hashThreshold) {
+      uint32_t size = 1;
+      while(size < 2 * children.size())
+        size *= 2;
+      // like DNSNode::ChildIndex, but the slots point straight at the child
+      vector<DNSNode::ChildIndex::Slot> table(size, DNSNode::ChildIndex::Slot{0, 0});
+      uint32_t pos = 0;
+      for(const auto& c : t.node->children) {
+        auto hash = DNSNode::ChildIndex::hash(c.d_name);
+        auto slot = hash & (size - 1);
+        while(table[slot].pos)
+          slot = (slot + 1) & (size - 1);
+        table[slot] = DNSNode::ChildIndex::Slot{hash, children[pos++]};
+      }
+      n.children.d_table = append(&table.at(0), table.size() * sizeof(table[0]));
+      n.children.d_tablesize = size;
+    }
+
+    vector<RRSetEntry> entries;
+    for(const auto& rrs : t.node->rrsets) { // std::map, so sorted by type
+      vector<uint32_t> records;
+      for(const auto* part : {&rrs.second.contents, &rrs.second.signatures}) {
+        for(const auto& rr : *part) {
+          if(rr->isDynamic())
+            throw std::runtime_error("Record of type "+string(toString(rr->getType()))+" is dynamic and can't be compiled");
+          string wire = makeWireRData(*rr);
+          uint16_t len = wire.size();
+          records.push_back(append(&len, sizeof(len)));
+          d_data.append(wire);
+        }
+      }
+      RRSetEntry e;
+      memset(&e, 0, sizeof(e));
+      e.type = rrs.first;
+      e.count = rrs.second.contents.size();
+      e.sigcount = rrs.second.signatures.size();
+      e.ttl = rrs.second.ttl;
+      if(!records.empty())
+        e.records = append(&records.at(0), records.size() * sizeof(uint32_t));
+      entries.push_back(e);
+      if((int)e.type < 256)
+        n.rrsets.d_types[(int)e.type / 8] |= 1 << ((int)e.type % 8);
+    }
+    n.rrsets.d_count = entries.size();
+    if(!entries.empty())
+      n.rrsets.d_entries = append(&entries.at(0), entries.size() * sizeof(RRSetEntry));
+  }
+  memcpy(&d_data.at(sizeof(Header)), &nodes.at(0), nodes.size() * sizeof(Node));
+
+  uint32_t size = 1;
+  while(size < 2 * exactcount)
+    size *= 2;
+  vector<DNSNode::ChildIndex::Slot> table(size, DNSNode::ChildIndex::Slot{0, 0});
+  for(uint32_t idx = 0; idx < todo.size(); ++idx) {
+    if(belowCut[idx])
+      continue;
+    auto slot = hashes[idx] & (size - 1);
+    while(table[slot].pos)
+      slot = (slot + 1) & (size - 1);
+    table[slot] = DNSNode::ChildIndex::Slot{hashes[idx], offset(idx)};
+  }
+  header.exact = append(&table.at(0), table.size() * sizeof(table[0]));
+  header.exactsize = size;
+
+  header.zonename = append("", 0);
+  uint8_t len = zonename.wireLength();
+  d_data.append((const char*)&len, 1);
+  d_data.append((const char*)zonename.data(), len);
+  header.size = d_data.size();
+  memcpy(&d_data.at(0), &header, sizeof(header));
+  d_data.shrink_to_fit();
+  d_base = d_data.c_str();
+  d_size = d_data.size();
+
+  // the serial comes from the image, which has the SOA in wire format
+  auto soa = apex()->rrsets.find(DNSType::SOA);
+  if(soa != apex()->rrsets.end() && !soa->second.contents.empty()) {
+    header.serial = getSOASerial(soa->second.contents[0]);
+    memcpy(&d_data.at(0), &header, sizeof(header));
+  }
+}
+
+ZoneImage::~ZoneImage()
+{
+  if(d_map)
+    munmap(d_map, d_size);
+}
+
+std::unique_ptr<ZoneImage> ZoneImage::load(const std::string& fname)
+{
+  int fd = open(fname.c_str(), O_RDONLY);
+  if(fd < 0)
+    throw std::runtime_error("Unable to open snapshot '"+fname+"': "+strerror(errno));
+  struct stat st;
+  if(fstat(fd, &st) < 0) {
+    close(fd);
+    throw std::runtime_error("Unable to stat snapshot '"+fname+"': "+strerror(errno));
+  }
+  if((size_t)st.st_size < sizeof(Header)) {
+    close(fd);
+    throw std::runtime_error("Snapshot '"+fname+"' is too short");
+  }
+  void* map = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd); // the mapping stays
+  if(map == MAP_FAILED)
+    throw std::runtime_error("Unable to map snapshot '"+fname+"': "+strerror(errno));
+
+  std::unique_ptr<ZoneImage> ret(new ZoneImage());
+  ret->d_map = map;
+  ret->d_base = (const char*)map;
+  ret->d_size = st.st_size;
+  ret->check();
+  return ret;
+}
+
+/* Checks the header, and then every offset in the image, so a snapshot that was cut short,
+   is stale or was edited can not make us read outside of it. Nodes only point to nodes after
+   them, and tables always have an empty slot, so walks and lookups end too */
+void ZoneImage::check() const
+{
+  const Header* h = header();
+  if(memcmp(h->magic, "tdnsimg", 8))
+    throw std::runtime_error("Not a zone snapshot");
+  if(h->version != version)
+    throw std::runtime_error("Zone snapshot has version "+to_string(h->version)+", we need version "+to_string(version));
+  if(h->size != d_size)
+    throw std::runtime_error("Zone snapshot is truncated");
+  if(!h->count || h->nodes % 4 || h->nodes + (uint64_t)h->count * sizeof(Node) > d_size || h->zonename >= d_size ||
+     h->zonename + 1 + (uint8_t)d_base[h->zonename] > d_size ||
+     !h->exactsize || (h->exactsize & (h->exactsize - 1)) || h->exact % 4 ||
+     h->exact + (uint64_t)h->exactsize * sizeof(DNSNode::ChildIndex::Slot) > d_size)
+    throw std::runtime_error("Zone snapshot header is corrupt");
+
+  auto corrupt = [](const Node& n, const char* what) {
+    throw std::runtime_error("Zone snapshot is corrupt, node at offset "+to_string(n.d_self)+" has a bad "+what);
+  };
+  // 'count' items of 'size' bytes at 'offset' are all in the image, and aligned for reading
+  auto fits = [this](uint64_t offset, uint64_t count, uint64_t size) {
+    return !(offset % 4) && offset + count * size <= d_size;
+  };
+  auto isNode = [h](uint32_t offset) {
+    return offset >= h->nodes && (offset - h->nodes) % sizeof(Node) == 0 &&
+      (offset - h->nodes) / sizeof(Node) < h->count;
+  };
+  auto node = [this](uint32_t offset) -> const Node& { return *(const Node*)(d_base + offset); };
+  auto checkTable = [&](const DNSNode::ChildIndex::Slot* table, uint32_t size) {
+    bool empty = false; // or a lookup of something that is not there would never end
+    for(uint32_t n = 0; n < size; ++n) {
+      if(!table[n].pos)
+        empty = true;
+      else if(!isNode(table[n].pos))
+        return false;
+    }
+    return empty;
+  };
+
+  for(uint32_t idx = 0; idx < h->count; ++idx) {
+    uint32_t self = h->nodes + idx * sizeof(Node);
+    const Node& n = node(self);
+    if(n.d_self != self)
+      corrupt(n, "offset of itself");
+    if(n.d_next != (idx + 1 < h->count ? self + sizeof(Node) : 0))
+      corrupt(n, "next node");
+    if(n.d_label >= d_size || (uint8_t)d_base[n.d_label] > 63 || (idx == 0) != (d_base[n.d_label] == 0) ||
+       n.d_label + 1 + 2 * (uint64_t)(uint8_t)d_base[n.d_label] > d_size)
+      corrupt(n, "label");
+    if(idx) { // the parent comes first, so its children were checked already
+      if(!isNode(n.d_parent) || n.d_parent >= self)
+        corrupt(n, "parent");
+      const auto& siblings = node(n.d_parent).children;
+      if(n.d_pos >= siblings.d_count || ((const uint32_t*)(d_base + siblings.d_offsets))[n.d_pos] != self)
+        corrupt(n, "position among its siblings");
+    }
+    else if(n.d_parent)
+      corrupt(n, "parent");
+
+    const auto& c = n.children;
+    if(c.d_count) {
+      if(!fits(c.d_offsets, c.d_count, sizeof(uint32_t)))
+        corrupt(n, "list of children");
+      const uint32_t* offsets = (const uint32_t*)(d_base + c.d_offsets);
+      for(uint32_t pos = 0; pos < c.d_count; ++pos)
+        if(!isNode(offsets[pos]) || offsets[pos] <= self || node(offsets[pos]).d_parent != self)
+          corrupt(n, "child");
+    }
+    if(c.d_table && (!c.d_tablesize || (c.d_tablesize & (c.d_tablesize - 1)) ||
+                     !fits(c.d_table, c.d_tablesize, sizeof(DNSNode::ChildIndex::Slot)) ||
+                     !checkTable((const DNSNode::ChildIndex::Slot*)(d_base + c.d_table), c.d_tablesize)))
+      corrupt(n, "table of children");
+
+    const auto& r = n.rrsets;
+    if(r.d_count && !fits(r.d_entries, r.d_count, sizeof(RRSetEntry)))
+      corrupt(n, "list of RRSets");
+    const RRSetEntry* entries = (const RRSetEntry*)(d_base + r.d_entries);
+    for(uint32_t e = 0; e < r.d_count; ++e) {
+      uint32_t records = entries[e].count + entries[e].sigcount;
+      if(!records)
+        continue;
+      if(!fits(entries[e].records, records, sizeof(uint32_t)))
+        corrupt(n, "list of records");
+      const uint32_t* offsets = (const uint32_t*)(d_base + entries[e].records);
+      for(uint32_t rec = 0; rec < records; ++rec) {
+        uint16_t len;
+        if(offsets[rec] + (uint64_t)sizeof(len) > d_size)
+          corrupt(n, "record");
+        memcpy(&len, d_base + offsets[rec], sizeof(len));
+        if(offsets[rec] + (uint64_t)sizeof(len) + len > d_size)
+          corrupt(n, "record");
+      }
+    }
+  }
+  if(!checkTable((const DNSNode::ChildIndex::Slot*)(d_base + h->exact), h->exactsize))
+    throw std::runtime_error("Zone snapshot has a corrupt table of names");
+}
+
+void ZoneImage::save(const std::string& fname) const
+{
+  string tmp = fname + ".tmp";
+  FILE* fp = fopen(tmp.c_str(), "w");
+  if(!fp)
+    throw std::runtime_error("Unable to write snapshot '"+tmp+"': "+strerror(errno));
+  bool ok = fwrite(d_base, 1, d_size, fp) == d_size;
+  ok = !fclose(fp) && ok;
+  // rename is atomic, so anyone who has the old snapshot mapped keeps seeing it
+  if(!ok || rename(tmp.c_str(), fname.c_str())) {
+    auto err = errno;
+    unlink(tmp.c_str());
+    throw std::runtime_error("Unable to write snapshot '"+fname+"': "+strerror(err));
+  }
+}
+
+const ZoneImage::Node* ZoneImage::apex() const
+{
+  return (const Node*)(d_base + header()->nodes);
+}
+
+uint32_t ZoneImage::serial() const
+{
+  return header()->serial;
+}
+
+DNSName ZoneImage::zoneName() const
+{
+  const uint8_t* p = (const uint8_t*)d_base + header()->zonename;
+  const uint8_t* end = p + 1 + p[0];
+  DNSName ret;
+  for(++p; p < end && *p; p += 1 + *p)
+    ret.push_back(p + 1, *p);
+  return ret;
+}
+
+MemoryUsage ZoneImage::memoryUsage() const
+{
+  MemoryUsage ret;
+  for(auto n = apex(); n; n = n->next()) {
+    ++ret.nodes;
+    ret.nodeBytes += sizeof(Node) + n->children.size() * sizeof(uint32_t) +
+      n->children.d_tablesize * sizeof(DNSNode::ChildIndex::Slot);
+    ret.labelBytes += 1 + 2 * (uint8_t)d_base[n->d_label]; // length, label, lowercased label
+    for(const auto& rrs : n->rrsets) {
+      const auto& rrset = rrs.second;
+      ret.rrsetBytes += sizeof(RRSetEntry) + (rrset.contents.size() + rrset.signatures.size()) * sizeof(uint32_t);
+      for(const auto& rr : rrset.contents) {
+        ret.rdataBytes += sizeof(uint16_t) + rr.size;
+        ret.types[rrs.first] += sizeof(uint16_t) + rr.size;
+      }
+      for(const auto& rr : rrset.signatures) {
+        ret.signatureBytes += sizeof(uint16_t) + rr.size;
+        ret.types[rrs.first] += sizeof(uint16_t) + rr.size;
+      }
+      ret.records += rrset.contents.size();
+      ret.signatures += rrset.signatures.size();
+    }
+  }
+  ret.nodeBytes += d_size - ret.total();
+  return ret;
+}
+
+RDataView ZoneImage::RecordList::operator[](size_t n) const
+{
+  const char* rec = d_base + d_offsets[n];
+  uint16_t len;
+  memcpy(&len, rec, sizeof(len));
+  return RDataView{d_type, (const uint8_t*)rec + sizeof(len), len};
+}
+
+ZoneImage::RRSetMap::const_iterator::const_iterator(const char* base, const RRSetEntry* entry, const RRSetEntry* end) :
+  d_base(base), d_entry(entry), d_end(end)
+{
+  fill();
+}
+
+void ZoneImage::RRSetMap::const_iterator::fill()
+{
+  if(d_entry == d_end)
+    return;
+  const uint32_t* offsets = (const uint32_t*)(d_base + d_entry->records);
+  d_cur.first = d_entry->type;
+  d_cur.second.ttl = d_entry->ttl;
+  d_cur.second.contents = RecordList(d_base, offsets, d_entry->type, d_entry->count);
+  d_cur.second.signatures = RecordList(d_base, offsets + d_entry->count, DNSType::RRSIG, d_entry->sigcount);
+}
+
+ZoneImage::RRSetMap::const_iterator& ZoneImage::RRSetMap::const_iterator::operator++()
+{
+  ++d_entry;
+  fill();
+  return *this;
+}
+
+const ZoneImage::Node* ZoneImage::RRSetMap::node() const
+{
+  return (const Node*)((const char*)this - offsetof(Node, rrsets));
+}
+
+const char* ZoneImage::RRSetMap::base() const
+{
+  return node()->base();
+}
+
+const ZoneImage::RRSetEntry* ZoneImage::RRSetMap::entries() const
+{
+  return (const RRSetEntry*)(base() + d_entries);
+}
+
+bool ZoneImage::RRSetMap::hasType(DNSType type) const
+{
+  int t = (int)type;
+  return t >= 256 || (d_types[t / 8] & (1 << (t % 8)));
+}
+
+ZoneImage::RRSetMap::const_iterator ZoneImage::RRSetMap::begin() const
+{
+  return const_iterator(base(), entries(), entries() + d_count);
+}
+
+ZoneImage::RRSetMap::const_iterator ZoneImage::RRSetMap::end() const
+{
+  return const_iterator(base(), entries() + d_count, entries() + d_count);
+}
+
+ZoneImage::RRSetMap::const_iterator ZoneImage::RRSetMap::find(DNSType type) const
+{
+  if(!hasType(type))
+    return end();
+  auto first = entries(), last = entries() + d_count;
+  auto iter = std::lower_bound(first, last, type, [](const RRSetEntry& e, DNSType t) { return e.type < t; });
+  if(iter != last && iter->type == type)
+    return const_iterator(base(), iter, last);
+  return end();
+}
+
+size_t ZoneImage::RRSetMap::count(DNSType type) const
+{
+  return find(type) != end();
+}
+
+const ZoneImage::Node* ZoneImage::ChildList::node() const
+{
+  return (const Node*)((const char*)this - offsetof(Node, children));
+}
+
+const char* ZoneImage::ChildList::base() const
+{
+  return node()->base();
+}
+
+ZoneImage::ChildList::const_iterator ZoneImage::ChildList::begin() const
+{
+  return const_iterator(base(), (const uint32_t*)(base() + d_offsets));
+}
+
+ZoneImage::ChildList::const_iterator ZoneImage::ChildList::end() const
+{
+  return const_iterator(base(), (const uint32_t*)(base() + d_offsets) + d_count);
+}
+
+ZoneImage::ChildList::const_iterator ZoneImage::ChildList::lower_bound(const DNSLabel& label) const
+{
+  const char* b = base();
+  const uint32_t* first = (const uint32_t*)(b + d_offsets);
+  auto iter = std::lower_bound(first, first + d_count, label, [b](uint32_t off, const DNSLabel& l) {
+      return ((const Node*)(b + off))->compareLabel(l) < 0;
+    });
+  return const_iterator(b, iter);
+}
+
+const ZoneImage::Node* ZoneImage::ChildList::find(const DNSLabel& label) const
+{
+  const char* b = base();
+  if(d_table) {
+    auto hash = DNSNode::ChildIndex::hash(label);
+    auto table = (const DNSNode::ChildIndex::Slot*)(b + d_table);
+    auto mask = d_tablesize - 1;
+    for(auto slot = hash & mask; table[slot].pos; slot = (slot + 1) & mask) {
+      if(table[slot].hash != hash)
+        continue;
+      auto child = (const Node*)(b + table[slot].pos);
+      if(child->labelEquals(label))
+        return child;
+    }
+    return nullptr;
+  }
+  auto iter = lower_bound(label);
+  if(iter != end() && iter->labelEquals(label))
+    return &*iter;
+  return nullptr;
+}
+
+DNSLabel ZoneImage::Node::label() const
+{
+  const char* l = base() + d_label;
+  return DNSLabel(l + 1, (uint8_t)l[0]);
+}
+
+int ZoneImage::Node::compareLabel(const DNSLabel& label) const
+{
+  const uint8_t* l = (const uint8_t*)base() + d_label;
+  size_t ours = l[0], theirs = label.d_folded.size();
+  if(int ret = memcmp(l + 1 + ours, label.d_folded.c_str(), std::min(ours, theirs)))
+    return ret;
+  return ours < theirs ? -1 : (ours > theirs ? 1 : 0);
+}
+
+bool ZoneImage::Node::labelEquals(const DNSLabel& label) const
+{
+  const uint8_t* l = (const uint8_t*)base() + d_label;
+  return l[0] == label.d_folded.size() && !memcmp(l + 1 + l[0], label.d_folded.c_str(), l[0]);
+}
+
+const ZoneImage::Node* ZoneImage::Node::find(DNSName& name, DNSName& last, bool wildcard, const Node** passedZonecut, const Node** passedWcard) const
+{
+  if(!last.empty() && rrsets.count(DNSType::NS)) {
+    if(passedZonecut)
+      *passedZonecut = this;
+  }
+
+  if(name.empty()) {
+    return this;
+  }
+  auto child = children.find(name.back());
+  if(!child) {
+    if(!wildcard)
+      return this;
+    child = children.find(DNSLabel("*"));
+    if(!child)
+      return this;
+    if(passedWcard)
+      *passedWcard = child;
+    while(name.size() > 1) { // the wildcard matches all remaining labels
+      last.push_front(name.back());
+      name.pop_back();
+    }
+  }
+  last.push_front(name.back());
+  name.pop_back();
+  return child->find(name, last, wildcard, passedZonecut, passedWcard);
+}
+
+const ZoneImage::Node* ZoneImage::Node::findExact(const DNSName& name) const
+{
+  if(d_parent)
+    return nullptr;
+  const char* b = base();
+  auto h = (const Header*)b;
+  auto hash = ExactIndex::hash(name);
+  auto table = (const DNSNode::ChildIndex::Slot*)(b + h->exact);
+  auto mask = h->exactsize - 1;
+  for(auto slot = hash & mask; table[slot].pos; slot = (slot + 1) & mask) {
+    if(table[slot].hash != hash)
+      continue;
+    // check the labels, from the first one in 'name' and the node up to the apex
+    auto node = (const Node*)(b + table[slot].pos);
+    auto iter = name.begin();
+    for(; iter != name.end() && node->d_parent; ++iter, node = node->parent()) {
+      const uint8_t* l = (const uint8_t*)b + node->d_label;
+      if(l[0] != iter.size() || dnsFoldCompare(l + 1 + l[0], (const uint8_t*)iter.data(), l[0]))
+        break;
+    }
+    if(iter == name.end() && !node->d_parent)
+      return (const Node*)(b + table[slot].pos);
+  }
+  return nullptr;
+}
+
+const ZoneImage::Node* ZoneImage::Node::next() const
+{
+  return d_next ? (const Node*)(base() + d_next) : nullptr;
+}
+
+//! Same semantics as DNSNode::prev: our left sibling, or failing that, that of our parent
+const ZoneImage::Node* ZoneImage::Node::prev() const
+{
+  const Node* us = this;
+  if(!us->d_parent)
+    return nullptr;
+  for(auto parent = us->parent(); parent; us = parent, parent = us->parent()) {
+    if(us->d_pos) {
+      auto offsets = (const uint32_t*)(base() + parent->children.d_offsets);
+      return (const Node*)(base() + offsets[us->d_pos - 1]);
+    }
+  }
+  return us;
+}
+
+DNSName ZoneImage::Node::getName() const
+{
+  DNSName ret;
+  for(const Node* us = this; us->d_parent; us = us->parent()) {
+    const uint8_t* l = (const uint8_t*)base() + us->d_label;
+    ret.push_back(l + 1, l[0]);
+  }
+  return ret;
+}
+
+std::string snapshotName(const std::string& snapshotdir, const DNSName& zone)
+{
+  string name = zone.empty() ? "root" : zone.toString();
+  if(name.size() > 1 && name.back() == '.')
+    name.pop_back();
+  replace(name.begin(), name.end(), '/', '_');
+  return snapshotdir + "/" + name + ".zimg";
+}
+
+void compileZones(DNSNode& node, const std::string& snapshotdir)
+{
+  if(node.zone) {
+    auto zonename = node.getName();
+    try {
+      node.image = std::make_unique<ZoneImage>(*node.zone, zonename);
+      cout<<"Compiled zone "<<zonename<<" to an image of "<<node.image->size()<<" bytes"<<endl;
+      node.zone.reset();
+    }
+    catch(std::exception& e) {
+      cout<<"Serving zone "<<zonename<<" from its tree: "<<e.what()<<endl;
+    }
+    if(node.image && !snapshotdir.empty()) {
+      try {
+        node.image->save(snapshotName(snapshotdir, zonename));
+      }
+      catch(std::exception& e) {
+        cout<<"Not saving a snapshot: "<<e.what()<<endl;
+      }
+    }
+  }
+  for(auto& c : node.children)
+    compileZones(const_cast<DNSNode&>(c), snapshotdir);
+}
+
+static void zonesMemoryUsage(const DNSNode& node, std::vector<std::pair<DNSName, MemoryUsage>>& ret)
+{
+  if(node.zone)
+    ret.push_back({node.getName(), node.zone->memoryUsage()});
+  else if(node.image)
+    ret.push_back({node.getName(), node.image->memoryUsage()});
+  for(const auto& c : node.children)
+    zonesMemoryUsage(c, ret);
+}
+
+std::vector<std::pair<DNSName, MemoryUsage>> zonesMemoryUsage(const DNSNode& zones)
+{
+  std::vector<std::pair<DNSName, MemoryUsage>> ret;
+  zonesMemoryUsage(zones, ret);
+  return ret;
+}
@@ -0,0 +1,251 @@
+#pragma once
+#include <string>
+#include <iterator>
+#include <memory>
+#include "dns-storage.hh"
+#include "dnsmessages.hh"
+
+/*!
+   @file
+   @brief Defines ZoneImage, a compact read-only form of a zone
+
+   After loading, a zone never changes, yet a DNSNode tree spreads it over many
+   small heap allocations. A ZoneImage compiles such a tree into a single block
+   of memory, in which everything refers to everything else by offset:
+
+     - Nodes, in canonical (depth first) order, each with its label, a sorted
+       array of children and a bitmap of the types present
+     - For nodes with many children, a hash table on the lowercased label
+     - A hash table on the full lowercased name of every node that is not at
+       or below a zone cut, like the ExactIndex of a DNSNode tree
+     - RRSets, with their records pre-rendered in uncompressed wire format
+
+   The image duck-types the parts of DNSNode and RRSet that tauth uses to
+   answer questions, so the same code can serve from either. Records come
+   out as RDataView, which DNSMessageWriter::putRR knows how to write.
+
+   Because nothing in an image is a pointer, it can be saved to a file as is,
+   and served straight from an mmap of that file later on. Such snapshots
+   carry a version, which changes with the layout, and the SOA serial of the
+   zone. They are in host byte order, so they don't travel between machines.
+   Loading one checks every offset in it, so a damaged snapshot is refused
+   instead of read beyond its end.
+*/
+
+class ZoneImage
+{
+public:
+  //! Compiles 'zone', throws if it contains records that can not be pre-rendered, like ClockTXTGen
+  ZoneImage(const DNSNode& zone, const DNSName& zonename);
+  ZoneImage(const ZoneImage&) = delete;
+  ZoneImage& operator=(const ZoneImage&) = delete;
+  ~ZoneImage();
+
+  //! Maps a snapshot written by save(), throws if it is not a valid snapshot of this version
+  static std::unique_ptr<ZoneImage> load(const std::string& fname);
+  //! Writes a snapshot, atomically replacing 'fname'
+  void save(const std::string& fname) const;
+
+  static constexpr uint32_t version = 2; //!< of the layout, snapshots of other versions are refused
+
+  struct Node;
+  const Node* apex() const;
+  size_t size() const { return d_size; } //!< bytes in use by this image
+  uint32_t serial() const;               //!< of the SOA, 0 if there is none
+  DNSName zoneName() const;
+  //! Like DNSNode::memoryUsage, adds up to size(). The header and alignment count as nodes
+  MemoryUsage memoryUsage() const;
+
+  //! The records or signatures of an RRSet, in wire format
+  class RecordList
+  {
+  public:
+    RecordList() {}
+    RecordList(const char* base, const uint32_t* offsets, DNSType type, uint16_t count) :
+      d_base(base), d_offsets(offsets), d_type(type), d_count(count) {}
+    RDataView operator[](size_t n) const;
+    size_t size() const { return d_count; }
+    bool empty() const { return !d_count; }
+
+    class const_iterator
+    {
+    public:
+      typedef std::forward_iterator_tag iterator_category;
+      typedef RDataView value_type;
+      typedef std::ptrdiff_t difference_type;
+      typedef const RDataView* pointer;
+      typedef RDataView reference;
+      const_iterator(const RecordList* list, size_t pos) : d_list(list), d_pos(pos) {}
+      RDataView operator*() const { return (*d_list)[d_pos]; }
+      const_iterator& operator++() { ++d_pos; return *this; }
+      bool operator==(const const_iterator& rhs) const { return d_pos == rhs.d_pos; }
+      bool operator!=(const const_iterator& rhs) const { return d_pos != rhs.d_pos; }
+    private:
+      const RecordList* d_list;
+      size_t d_pos;
+    };
+    const_iterator begin() const { return const_iterator(this, 0); }
+    const_iterator end() const { return const_iterator(this, d_count); }
+  private:
+    const char* d_base{nullptr};
+    const uint32_t* d_offsets{nullptr};
+    DNSType d_type{DNSType::A};
+    uint16_t d_count{0};
+  };
+
+  //! Like RRSet, the records of one type at a node, with one TTL
+  struct RRSetView
+  {
+    uint32_t ttl;
+    RecordList contents;
+    RecordList signatures;
+  };
+
+  //! How an RRSet is stored in the image
+  struct RRSetEntry
+  {
+    DNSType type;
+    uint16_t count;      //!< number of records
+    uint16_t sigcount;   //!< number of signatures, which follow the records
+    uint16_t pad;
+    uint32_t ttl;
+    uint32_t records;    //!< offset of count+sigcount offsets, each to a uint16_t length and the rdata
+  };
+
+  //! Duck-types DNSNode::rrsets, a map from DNSType to RRSetView
+  struct RRSetMap
+  {
+    class const_iterator
+    {
+    public:
+      typedef std::forward_iterator_tag iterator_category;
+      typedef std::pair<DNSType, RRSetView> value_type;
+      typedef std::ptrdiff_t difference_type;
+      typedef const value_type* pointer;
+      typedef const value_type& reference;
+      const_iterator(const char* base, const RRSetEntry* entry, const RRSetEntry* end);
+      const value_type& operator*() const { return d_cur; }
+      const value_type* operator->() const { return &d_cur; }
+      const_iterator& operator++();
+      bool operator==(const const_iterator& rhs) const { return d_entry == rhs.d_entry; }
+      bool operator!=(const const_iterator& rhs) const { return d_entry != rhs.d_entry; }
+    private:
+      void fill();
+      const char* d_base;
+      const RRSetEntry* d_entry;
+      const RRSetEntry* d_end;
+      value_type d_cur;
+    };
+    const_iterator begin() const;
+    const_iterator end() const;
+    const_iterator find(DNSType type) const;
+    size_t count(DNSType type) const;
+    size_t size() const { return d_count; }
+    bool empty() const { return !d_count; }
+
+    uint32_t d_entries;    //!< offset of d_count RRSetEntry's, sorted by type
+    uint32_t d_count;
+    uint8_t d_types[32];   //!< bitmap of types below 256 that are present, for quick misses
+  private:
+    const Node* node() const;
+    const char* base() const;
+    const RRSetEntry* entries() const;
+    bool hasType(DNSType type) const;
+  };
+
+  //! Duck-types DNSNode::children, in canonical order
+  struct ChildList
+  {
+    class const_iterator
+    {
+    public:
+      typedef std::bidirectional_iterator_tag iterator_category;
+      typedef Node value_type;
+      typedef std::ptrdiff_t difference_type;
+      typedef const Node* pointer;
+      typedef const Node& reference;
+      const_iterator(const char* base, const uint32_t* pos) : d_base(base), d_pos(pos) {}
+      const Node& operator*() const { return *(const Node*)(d_base + *d_pos); }
+      const Node* operator->() const { return (const Node*)(d_base + *d_pos); }
+      const_iterator& operator++() { ++d_pos; return *this; }
+      const_iterator& operator--() { --d_pos; return *this; }
+      bool operator==(const const_iterator& rhs) const { return d_pos == rhs.d_pos; }
+      bool operator!=(const const_iterator& rhs) const { return d_pos != rhs.d_pos; }
+    private:
+      const char* d_base;
+      const uint32_t* d_pos;
+    };
+    const_iterator begin() const;
+    const_iterator end() const;
+    const_iterator lower_bound(const DNSLabel& label) const;
+    //! finds a direct child, nullptr if there is none
+    const Node* find(const DNSLabel& label) const;
+    size_t size() const { return d_count; }
+    bool empty() const { return !d_count; }
+
+    uint32_t d_offsets;    //!< offset of d_count node offsets, in canonical order
+    uint32_t d_count;
+    uint32_t d_table;      //!< offset of the hash table, 0 if we have few children. Slots hold node offsets
+    uint32_t d_tablesize;  //!< always a power of two
+  private:
+    const Node* node() const;
+    const char* base() const;
+  };
+
+  //! Duck-types DNSNode, as stored in the image
+  struct Node
+  {
+    //! Same semantics as DNSNode::find
+    const Node* find(DNSName& name, DNSName& last, bool wildcards=false, const Node** passedZonecut=0, const Node** passedWcard=0) const;
+    //! Same semantics as DNSNode::findExact, only the apex has an ExactIndex
+    const Node* findExact(const DNSName& name) const;
+    const Node* next() const;
+    const Node* prev() const;
+    DNSName getName() const;
+    const char* base() const { return (const char*)this - d_self; }
+    const Node* parent() const { return d_parent ? (const Node*)(base() + d_parent) : nullptr; }
+    DNSLabel label() const;
+    //! compares our label to 'label', in canonical order
+    int compareLabel(const DNSLabel& label) const;
+    bool labelEquals(const DNSLabel& label) const;
+
+    uint32_t d_self;    //!< our own offset, which is how we find the start of the image
+    uint32_t d_parent;  //!< 0 for the apex
+    uint32_t d_label;   //!< offset of a length byte, the label, and the label lowercased
+    uint32_t d_next;    //!< next node in canonical order, 0 if we are the last one
+    uint32_t d_pos;     //!< our position among the children of our parent
+    ChildList children;
+    RRSetMap rrsets;
+  };
+
+private:
+  ZoneImage() {}
+  struct Header
+  {
+    char magic[8];      //!< "tdnsimg" and a 0
+    uint32_t version;
+    uint32_t size;      //!< of the whole image, including this header
+    uint32_t serial;
+    uint32_t zonename;  //!< offset of the name of the zone, in wire format
+    uint32_t nodes;     //!< offset of the node array, which starts with the apex
+    uint32_t count;     //!< number of nodes
+    uint32_t exact;     //!< offset of the table for Node::findExact. Slots hold node offsets
+    uint32_t exactsize; //!< always a power of two
+  };
+  const Header* header() const { return (const Header*)d_base; }
+  uint32_t append(const void* data, size_t len);
+  void check() const;
+
+  const char* d_base{nullptr}; //!< either d_data, or our mmap
+  size_t d_size{0};
+  std::string d_data;
+  void* d_map{nullptr};
+};
+
+//! Compiles every zone in 'zones' to a ZoneImage and drops its tree, zones that can't be compiled stay a tree
+/*! If 'snapshotdir' is set, newly compiled zones are also saved there, see snapshotName() */
+void compileZones(DNSNode& zones, const std::string& snapshotdir = std::string());
+//! The file in 'snapshotdir' for a snapshot of 'zone'
+std::string snapshotName(const std::string& snapshotdir, const DNSName& zone);
+//! What each zone in 'zones' uses, whether it is a tree or an image
+std::vector<std::pair<DNSName, MemoryUsage>> zonesMemoryUsage(const DNSNode& zones);